@@ -1,15 +1,21 @@
+#define _GNU_SOURCE /* for sendmmsg() and pthread_setaffinity_np() */
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/videodev2.h>
@@ -18,16 +24,238 @@
 #define DEFAULT_AUDIO_DEVICE "hw:Music"
 #define MAX_VOLUME 100
 #define MAX_CHANNELS 2
-
+#define RDS_READ_BLOCKS 64
+#define AF_CODES 205 /* AF list frequency codes are 1 - 204 */
+#define MAX_AF 25
+
+/* Build roles, see the Makefile targets
+ *
+ * SI470X_RDS_ONLY leaves out all audio, SI470X_JACK and SI470X_RECORDER
+ * capture for JACK or for Ogg Vorbis files only, and the default is the
+ * full build.  SI470X_CHANNELS and one of SI470X_FORMAT_S32, _S24_3LE,
+ * _S16 or _FLOAT fix the capture channels and sample format at compile
+ * time, see formats[].
+ */
+#if defined(SI470X_RDS_ONLY)
+#elif defined(SI470X_JACK)
+#define HAVE_AUDIO 1
+#define HAVE_JACK 1
+#elif defined(SI470X_RECORDER)
+#define HAVE_AUDIO 1
+#define HAVE_VORBIS 1
+#else
+#define HAVE_AUDIO 1
 #define HAVE_JACK 1
+#define HAVE_VORBIS 1
+#define HAVE_OPUS 1
+#endif
 
 static int verbose = 0;
 
-static int frequencyDivider;
-static float minFrequency, currentFrequency, maxFrequency;
+static volatile sig_atomic_t quit = 0;
+
+static void
+sigterm_handler(int signal) {
+  quit = 1;
+}
+
+static inline uint64_t
+monotonicTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Real-time setup (-X)
+ *
+ * On a loaded host the audio and RDS threads have to run as soon as
+ * their device has data.  With -X each process locks its memory, faults
+ * in the buffers its threads work on up front and pins these threads
+ * to a CPU each with a SCHED_FIFO priority.  Any step may fail for lack
+ * of privileges or limits; reception carries on without it and the
+ * outcome of every step is listed once the threads are set up.
+ *
+ * The JACK process thread belongs to libjack and gets its priority from
+ * the server, it is only pinned.  Locking future pages as well covers
+ * its stack, and the buffers allocated after the lock.
+ */
+
+#define REALTIME_STACK (64 * 1024) /* faulted in by each thread */
+#define REALTIME_REPORT 0X800
+
+typedef struct {
+  int cpu;      /* -1 to leave the thread where it is */
+  int priority; /* SCHED_FIFO, 0 to keep the thread as it is */
+} RealtimeThread;
+
+static struct {
+  int enabled;
+  RealtimeThread audio, rds;
+  int locked;               /* mlockall() succeeded */
+  int failures;
+  unsigned long prefaulted; /* bytes */
+  int buffers;
+  size_t fill;
+  char report[REALTIME_REPORT];
+  pthread_mutex_t lock;
+} realtime = { .audio = { -1, 70 }, .rds = { -1, 60 },
+               .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Parse CPU[:PRIORITY], where CPU may be - to leave it unpinned */
+static int
+parseRealtimeThread(RealtimeThread *t, const char *spec) {
+  const char *priority = strchr(spec, ':');
+
+  t->cpu = spec[0] == '-'? -1 : atoi(spec);
+  if (priority != NULL) t->priority = atoi(priority + 1);
+  return t->cpu < CPU_SETSIZE && t->priority >= 0 &&
+    t->priority <= sched_get_priority_max(SCHED_FIFO);
+}
+
+/* Parse AUDIO[,RDS] */
+static int
+parseRealtime(const char *spec) {
+  const char *rds = strchr(spec, ',');
+
+  realtime.enabled = 1;
+  return parseRealtimeThread(&realtime.audio, spec) &&
+    (rds == NULL || parseRealtimeThread(&realtime.rds, rds + 1));
+}
+
+static void
+realtimeNote(int failed, const char *format, ...) {
+  va_list args;
+  int n;
+
+  pthread_mutex_lock(&realtime.lock);
+  if (failed) realtime.failures++;
+  va_start(args, format);
+  n = vsnprintf(realtime.report + realtime.fill,
+                sizeof(realtime.report) - realtime.fill, format, args);
+  va_end(args);
+  if (n > 0) {
+    realtime.fill += n;
+    if (realtime.fill >= sizeof(realtime.report))
+      realtime.fill = sizeof(realtime.report) - 1;
+  }
+  pthread_mutex_unlock(&realtime.lock);
+}
+
+/* Lock all memory of this process, locks are not inherited by fork() */
+static void
+lockMemory() {
+  if (!realtime.enabled) return;
+  realtime.locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+  if (realtime.locked)
+    realtimeNote(0, "  memory locked\n");
+  else
+    realtimeNote(1, "  memory not locked: %s\n", strerror(errno));
+}
+
+#ifdef HAVE_AUDIO
+/**
+ * Touch every page of a buffer so that its first use does not fault.
+ * Without mlockall() the buffer is locked on its own, as far as
+ * RLIMIT_MEMLOCK allows.
+ */
+static void
+prefault(const char *name, void *buffer, size_t size) {
+  volatile char *p = buffer;
+  const long pageSize = sysconf(_SC_PAGESIZE);
+
+  if (!realtime.enabled || buffer == NULL || size == 0) return;
+  for (size_t i = 0; i < size; i += pageSize) p[i] = p[i];
+  p[size - 1] = p[size - 1];
+  if (!realtime.locked && mlock(buffer, size) != 0)
+    realtimeNote(1, "  %s not locked: %s\n", name, strerror(errno));
+  pthread_mutex_lock(&realtime.lock);
+  realtime.prefaulted += size;
+  realtime.buffers++;
+  pthread_mutex_unlock(&realtime.lock);
+}
+#endif
+
+/* Fault in the stack a thread is going to use, called on that thread */
+static void
+prefaultStack() {
+  volatile char stack[REALTIME_STACK];
+  const long pageSize = sysconf(_SC_PAGESIZE);
+
+  if (!realtime.enabled) return;
+  for (size_t i = 0; i < sizeof(stack); i += pageSize) stack[i] = 0;
+}
+
+/* Pin thread and raise its priority as t says */
+static void
+setupRealtimeThread(const char *name, pthread_t thread,
+                    const RealtimeThread *t) {
+  int err;
+
+  if (!realtime.enabled) return;
+  if (t->cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(t->cpu, &cpus);
+    if ((err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus)) == 0)
+      realtimeNote(0, "  %s thread on CPU %d\n", name, t->cpu);
+    else
+      realtimeNote(1, "  %s thread not pinned to CPU %d: %s\n",
+                   name, t->cpu, strerror(err));
+  }
+  if (t->priority > 0) {
+    struct sched_param param = { .sched_priority = t->priority };
+
+    if ((err = pthread_setschedparam(thread, SCHED_FIFO, &param)) == 0)
+      realtimeNote(0, "  %s thread SCHED_FIFO %d\n", name, t->priority);
+    else
+      realtimeNote(1, "  %s thread not SCHED_FIFO %d: %s\n",
+                   name, t->priority, strerror(err));
+  }
+}
 
+/* Print and clear what the setup of this process came to */
 static void
-setTunerVolume(int fd, unsigned int volume) {
+reportRealtime(const char *role) {
+  if (!realtime.enabled) return;
+  pthread_mutex_lock(&realtime.lock);
+  printf("Real-time setup of %s, %d failed:\n%s"
+         "  %lu kB in %d buffers faulted in\n",
+         role, realtime.failures, realtime.report,
+         realtime.prefaulted / 1024, realtime.buffers);
+  realtime.fill = 0;
+  realtime.report[0] = '\0';
+  realtime.failures = 0;
+  pthread_mutex_unlock(&realtime.lock);
+}
+
+typedef struct ProgramTable ProgramTable;
+
+/* One radio device and what has been learned about its band */
+typedef struct {
+  const char *device;
+  int fd;
+  uint32_t capabilities;
+  int frequencyDivider;
+  float minFrequency, currentFrequency, maxFrequency;
+  ProgramTable *programs;
+
+  /* Signal last measured on each AF code, in ms of monotonicTime() */
+  struct {
+    uint16_t signal;
+    uint64_t sampled;
+  } afQuality[AF_CODES];
+  uint64_t afChecked;
+
+  /* Incremented before and after every tune, so it is odd while the
+   * frequency changes, see rdsIntakeThread()
+   */
+  unsigned int tuneEpoch;
+} Tuner;
+
+static void
+setTunerVolume(Tuner *t, unsigned int volume) {
+  const int fd = t->fd;
   struct v4l2_control control = {
     .id = V4L2_CID_AUDIO_MUTE,
     .value = (volume==0? 1 : 0)
@@ -59,34 +287,38 @@ setTunerVolume(int fd, unsigned int volume) {
 }
 
 static void
-setTunerFrequency(int fd, struct v4l2_tuner *tuner, float newFrequency) {
-  if (newFrequency < maxFrequency && newFrequency > minFrequency) {
+setTunerFrequency(Tuner *t, float newFrequency) {
+  if (newFrequency <= t->maxFrequency && newFrequency >= t->minFrequency) {
     struct v4l2_frequency freq;
 
     memset(&freq, 0, sizeof(freq));
     freq.tuner = 0;
     freq.type = V4L2_TUNER_RADIO;
-    freq.frequency = newFrequency * frequencyDivider;
-    if (ioctl(fd, VIDIOC_S_FREQUENCY, &freq) != -1) {
+    freq.frequency = newFrequency * t->frequencyDivider + .5;
+    __atomic_add_fetch(&t->tuneEpoch, 1, __ATOMIC_RELEASE);
+    if (ioctl(t->fd, VIDIOC_S_FREQUENCY, &freq) != -1) {
+      t->currentFrequency = newFrequency;
+      __atomic_add_fetch(&t->tuneEpoch, 1, __ATOMIC_RELEASE);
       return;
     } else {
       perror("ioctl VIDIOC_S_FREQUENCY");
+      __atomic_add_fetch(&t->tuneEpoch, 1, __ATOMIC_RELEASE);
     }
   } else {
     printf("%.2f is not in range (%.2f - %.2f)\n",
-	   newFrequency, minFrequency, maxFrequency);
+	   newFrequency, t->minFrequency, t->maxFrequency);
   }
 }
 
 static float
-getTunerFrequency(int fd) {
+getTunerFrequency(Tuner *t) {
   struct v4l2_frequency freq;
 
   memset(&freq, 0, sizeof(freq));
   freq.tuner = 0;
   freq.type = V4L2_TUNER_RADIO;
-  if (ioctl(fd, VIDIOC_G_FREQUENCY, &freq) != -1) {
-    return freq.frequency / (float)frequencyDivider;
+  if (ioctl(t->fd, VIDIOC_G_FREQUENCY, &freq) != -1) {
+    return freq.frequency / (float)t->frequencyDivider;
   } else {
     perror("ioctl VIDIOC_G_FREQUENCY");
   }
@@ -94,7 +326,7 @@ getTunerFrequency(int fd) {
 }
 
 static float
-seekTunerFrequency(int fd, int up) {
+seekTunerFrequency(Tuner *t, int up) {
   struct v4l2_hw_freq_seek freqSeek;
 
   memset(&freqSeek, 0, sizeof(freqSeek));
@@ -102,11 +334,82 @@ seekTunerFrequency(int fd, int up) {
   freqSeek.type = V4L2_TUNER_RADIO;
   freqSeek.seek_upward = up? 1 : 0;
   freqSeek.wrap_around = 1;
-  if (ioctl(fd, VIDIOC_S_HW_FREQ_SEEK, &freqSeek) != -1) {
-    return getTunerFrequency(fd);
+  __atomic_add_fetch(&t->tuneEpoch, 1, __ATOMIC_RELEASE);
+  if (ioctl(t->fd, VIDIOC_S_HW_FREQ_SEEK, &freqSeek) != -1) {
+    __atomic_add_fetch(&t->tuneEpoch, 1, __ATOMIC_RELEASE);
+    return getTunerFrequency(t);
   } else {
     perror("ioctl VIDIOC_S_HW_FREQ_SEEK");
   }
+  __atomic_add_fetch(&t->tuneEpoch, 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static int
+getTunerSignal(Tuner *t, int *stereo) {
+  struct v4l2_tuner tuner;
+
+  memset(&tuner, 0, sizeof(tuner));
+  if (ioctl(t->fd, VIDIOC_G_TUNER, &tuner) == -1) {
+    perror("ioctl VIDIOC_G_TUNER");
+    return -1;
+  }
+  *stereo = (tuner.rxsubchans & V4L2_TUNER_SUB_STEREO) != 0;
+  return tuner.signal;
+}
+
+/**
+ * Open a radio device and read its frequency range, returns 0 and
+ * reports the reason if it is not a usable FM tuner.
+ */
+static int
+openTuner(Tuner *t, const char *device) {
+  struct v4l2_tuner tuner;
+
+  memset(t, 0, sizeof(*t));
+  t->device = device;
+  if ((t->fd = open(device, O_RDONLY)) > 0) {
+    memset(&tuner, 0, sizeof(tuner));
+
+    if (ioctl(t->fd, VIDIOC_G_TUNER, &tuner) != -1) {
+      struct v4l2_capability caps;
+
+      printf("Tuner: %s (%s), %d\n",
+	     tuner.name, tuner.audmode&V4L2_TUNER_MODE_STEREO?"stereo":"mono",
+	     tuner.signal);
+      if (ioctl(t->fd, VIDIOC_QUERYCAP, &caps) != -1) {
+	printf("Capabilities: %X\n", caps.capabilities);
+	t->capabilities = caps.capabilities;
+      } else perror("ioctl VIDIOC_QUERYCAP");
+
+      if (tuner.type == V4L2_TUNER_RADIO) {
+	t->frequencyDivider = (tuner.capability & V4L2_TUNER_CAP_LOW)? 16000: 16;
+	t->minFrequency = ((float)tuner.rangelow)/t->frequencyDivider;
+	t->maxFrequency = ((float)tuner.rangehigh)/t->frequencyDivider;
+	t->currentFrequency = getTunerFrequency(t);
+
+	printf("Radio: %.1f <= %.1f <= %.1f\n",
+	       t->minFrequency, t->currentFrequency, t->maxFrequency);
+	return 1;
+      } else {
+	printf("%s is not a FM radio\n", device);
+      }
+    } else {
+      perror("ioctl VIDIOC_G_TUNER");
+    }
+
+    close(t->fd);
+    t->fd = -1;
+  } else {
+    switch (errno) {
+    case ENOENT:
+      printf("Device %s does not exist\n", device);
+      break;
+    default:
+      perror("open");
+    }
+  }
 
   return 0;
 }
@@ -123,33 +426,279 @@ static const char *programTypes[30] = {
   "Documentary", "Alarm test", "Alarm"
 };
 
+/* Also the record layout of the station cache, bump
+ * PROGRAM_CACHE_VERSION when it changes.
+ */
 typedef struct {
   uint16_t id;
   float freq;
   char name[8+1];
   unsigned char tp;
   unsigned char ta;
+  uint16_t signal; /* VIDIOC_G_TUNER signal when last scanned */
 
   char type;
+  unsigned char afCount;
+  unsigned char af[MAX_AF]; /* AF codes, f = 87.5 + .1*code MHz */
 } ProgramData;
 
-static ProgramData *programs = NULL;
-static int programCount = 0;
+/* Stations are allocated from fixed-size slabs which are never moved,
+ * so pointers returned by getProgram() remain valid for the lifetime of
+ * the process.  Lookup by PI goes through an open-addressing table of
+ * pointers, and byFrequency lists every station and is sorted lazily
+ * when a frequency has changed.
+ */
+#define PROGRAM_SLAB_SIZE 64
+
+/* The station cache is a header followed by ProgramData records, and
+ * each slab maps PROGRAM_SLAB_SIZE records of it.  Stations are updated
+ * in place by the decoder, so the file is current whenever the process
+ * stops and nothing needs to be parsed when it starts again.
+ */
+#define PROGRAM_CACHE_MAGIC "si470xPD"
+#define PROGRAM_CACHE_VERSION 2
+#define PROGRAM_CACHE_DATA 64 /* offset of the first record */
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t count; /* records which have been initialized */
+} ProgramCacheHeader;
+
+struct ProgramTable {
+  ProgramData **slots;
+  unsigned int slotBits;
+  ProgramData *slab;
+  int slabUsed;
+  ProgramData **byFrequency;
+  int count;
+  int sorted;
+  int cacheFd;
+  ProgramCacheHeader *cache;
+  int cachedSlab; /* slab is part of the cache */
+};
+
+static void
+initProgramTable(ProgramTable *table) {
+  memset(table, 0, sizeof(*table));
+  table->slabUsed = PROGRAM_SLAB_SIZE;
+  table->sorted = 1;
+  table->cacheFd = -1;
+}
+
+static inline unsigned int
+programSlot(uint16_t id, unsigned int bits) {
+  return (uint32_t)(id * 2654435761U) >> (32 - bits);
+}
+
+static int
+growProgramSlots(ProgramTable *table) {
+  const unsigned int bits = table->slotBits? table->slotBits + 1 : 6;
+  const unsigned int mask = (1U << bits) - 1;
+  ProgramData **slots = calloc(1U << bits, sizeof(*slots));
+  ProgramData **list = realloc(table->byFrequency,
+                               (1U << (bits - 1)) * sizeof(*list));
+
+  if (slots == NULL || list == NULL) {
+    free(slots);
+    if (list != NULL) table->byFrequency = list;
+    fprintf(stderr, "no memory for station table\n");
+    return 0;
+  }
+  table->byFrequency = list;
+  for (int i = 0; i < table->count; i++) {
+    unsigned int slot = programSlot(list[i]->id, bits);
+    while (slots[slot] != NULL) slot = (slot + 1) & mask;
+    slots[slot] = list[i];
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->slotBits = bits;
+  return 1;
+}
+
+static void
+insertProgram(ProgramTable *table, ProgramData *pd) {
+  unsigned int slot, mask;
+
+  /* Keep the load factor at or below one half */
+  if (2*(table->count + 1) > (1 << table->slotBits)) {
+    if (!growProgramSlots(table)) exit(EXIT_FAILURE);
+  }
+
+  mask = (1U << table->slotBits) - 1;
+  for (slot = programSlot(pd->id, table->slotBits);
+       table->slots[slot] != NULL; slot = (slot + 1) & mask);
+  table->slots[slot] = pd;
+  table->byFrequency[table->count++] = pd;
+  table->sorted = 0;
+}
 
+/**
+ * Map slabs slabs of the station cache starting at slab first, the file
+ * is extended as needed.  Returns NULL if that is not possible.
+ */
 static ProgramData *
-getProgram(uint16_t id) {
-  for (int i = 0; i < programCount; i++) {
-    ProgramData *pd = &programs[i];
-    if (pd->id == id) return pd;
+mapProgramCache(ProgramTable *table, uint32_t first, uint32_t slabs) {
+  const size_t slabBytes = PROGRAM_SLAB_SIZE*sizeof(ProgramData);
+  const off_t offset = PROGRAM_CACHE_DATA + first*slabBytes;
+  const off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+  const size_t length = slabs*slabBytes + (offset - start);
+  struct stat st;
+  char *map;
+
+  if (fstat(table->cacheFd, &st) == -1) {
+    perror("fstat");
+    return NULL;
+  }
+  if (st.st_size < offset + slabs*slabBytes &&
+      ftruncate(table->cacheFd, offset + slabs*slabBytes) == -1) {
+    perror("ftruncate");
+    return NULL;
+  }
+  if ((map = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED,
+                  table->cacheFd, start)) == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
   }
 
-  programs = realloc(programs, ++programCount*sizeof(*programs));
-  {
-    ProgramData *pd = &programs[programCount - 1];
-    memset(pd, 0, sizeof(*pd));
-    pd->id = id;
-    return pd;
+  return (ProgramData *)(map + (offset - start));
+}
+
+static void
+newProgramSlab(ProgramTable *table) {
+  table->slab = NULL;
+  table->cachedSlab = 0;
+  if (table->cache != NULL) {
+    table->slab = mapProgramCache(table,
+                                  table->cache->count / PROGRAM_SLAB_SIZE, 1);
+    table->cachedSlab = table->slab != NULL;
+  }
+  if (table->slab == NULL &&
+      (table->slab = malloc(PROGRAM_SLAB_SIZE*sizeof(*table->slab))) == NULL) {
+    fprintf(stderr, "no memory for station table\n");
+    exit(EXIT_FAILURE);
+  }
+  table->slabUsed = 0;
+}
+
+static ProgramData *
+getProgram(ProgramTable *table, uint16_t id) {
+  ProgramData *pd;
+
+  if (table->slotBits) {
+    const unsigned int mask = (1U << table->slotBits) - 1;
+    unsigned int slot;
+
+    for (slot = programSlot(id, table->slotBits);
+         table->slots[slot] != NULL; slot = (slot + 1) & mask) {
+      if (table->slots[slot]->id == id) return table->slots[slot];
+    }
+  }
+
+  if (table->slabUsed == PROGRAM_SLAB_SIZE) newProgramSlab(table);
+  pd = &table->slab[table->slabUsed++];
+  memset(pd, 0, sizeof(*pd));
+  pd->id = id;
+  /* Only count the record once it is valid */
+  if (table->cachedSlab) table->cache->count += 1;
+  insertProgram(table, pd);
+
+  return pd;
+}
+
+/**
+ * Back table by the station cache in fileName, which is created if
+ * necessary.  Cached stations are added to table, which must be empty.
+ * Returns 0 if the cache could not be opened.
+ */
+static int
+openProgramCache(ProgramTable *table, const char *fileName) {
+  const size_t maxRecords = UINT16_MAX + 1;
+  ProgramCacheHeader *header;
+  struct stat st;
+  uint32_t count;
+
+  if ((table->cacheFd = open(fileName, O_RDWR | O_CREAT, 0644)) == -1) {
+    perror(fileName);
+    return 0;
+  }
+  if (fstat(table->cacheFd, &st) == -1 ||
+      (st.st_size < PROGRAM_CACHE_DATA &&
+       ftruncate(table->cacheFd, PROGRAM_CACHE_DATA) == -1) ||
+      (header = mmap(NULL, PROGRAM_CACHE_DATA, PROT_READ|PROT_WRITE, MAP_SHARED,
+                     table->cacheFd, 0)) == MAP_FAILED) {
+    perror(fileName);
+    close(table->cacheFd);
+    table->cacheFd = -1;
+    return 0;
+  }
+
+  if (memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(header->magic)) ||
+      header->version != PROGRAM_CACHE_VERSION ||
+      header->recordSize != sizeof(ProgramData)) {
+    if (st.st_size > PROGRAM_CACHE_DATA) {
+      printf("%s: discarding incompatible station cache\n", fileName);
+    }
+    memcpy(header->magic, PROGRAM_CACHE_MAGIC, sizeof(header->magic));
+    header->version = PROGRAM_CACHE_VERSION;
+    header->recordSize = sizeof(ProgramData);
+    header->count = 0;
+  }
+
+  /* Records past the end of the file were never written */
+  count = header->count;
+  if (st.st_size < PROGRAM_CACHE_DATA + count*sizeof(ProgramData)) {
+    count = st.st_size < PROGRAM_CACHE_DATA? 0
+      : (st.st_size - PROGRAM_CACHE_DATA) / sizeof(ProgramData);
+  }
+  if (count > maxRecords) count = maxRecords;
+  header->count = count;
+  table->cache = header;
+
+  if (count > 0) {
+    const uint32_t slabs = (count + PROGRAM_SLAB_SIZE - 1) / PROGRAM_SLAB_SIZE;
+    ProgramData *records = mapProgramCache(table, 0, slabs);
+
+    if (records == NULL) {
+      /* Start over rather than losing new stations */
+      header->count = 0;
+      return 1;
+    }
+    for (uint32_t i = 0; i < count; i++) insertProgram(table, &records[i]);
+    table->slab = records + (slabs - 1)*PROGRAM_SLAB_SIZE;
+    table->slabUsed = count - (slabs - 1)*PROGRAM_SLAB_SIZE;
+    table->cachedSlab = 1;
+  }
+  if (verbose) printf("%s: %u cached stations\n", fileName, count);
+
+  return 1;
+}
+
+static inline void
+setProgramFrequency(ProgramTable *table, ProgramData *pd, float freq) {
+  if (pd->freq != freq) {
+    pd->freq = freq;
+    table->sorted = 0;
+  }
+}
+
+static void
+sortProgramsByFrequency(ProgramTable *table) {
+  ProgramData **list = table->byFrequency;
+
+  /* Insertion sort, the list is nearly sorted most of the time */
+  for (int i = 1; i < table->count; i++) {
+    ProgramData *pd = list[i];
+    int j = i;
+    while (j > 0 && list[j-1]->freq > pd->freq) {
+      list[j] = list[j-1];
+      j -= 1;
+    }
+    list[j] = pd;
   }
+  table->sorted = 1;
 }
 
 /* For restoring cannonical mode upon exit */
@@ -175,10 +724,11 @@ disableCannonicalMode() {
 }
 
 static int
-EONAF_handleFrequencyPair(ProgramData *this, ProgramData *other, float f1, float f2) {
-  if (this->freq >= minFrequency) {
+EONAF_handleFrequencyPair(Tuner *t, ProgramData *this, ProgramData *other,
+                          float f1, float f2) {
+  if (this->freq >= t->minFrequency) {
     if (f1 >= (this->freq-.04) && f1 <= (this->freq+.04)) {
-      other->freq = f2;
+      setProgramFrequency(t->programs, other, f2);
       return 1;
     }
   }
@@ -186,1148 +736,6620 @@ EONAF_handleFrequencyPair(ProgramData *this, ProgramData *other, float f1, float
 }
 
 static void
-nextProgram(int fd, struct v4l2_tuner *tuner) {
-  int i;
-
-  if (programCount <= 1) return;
-  for (i = 0; i < programCount; i++) {
-    if (currentFrequency >= programs[i].freq-.09
-     && currentFrequency <= programs[i].freq+.09) {
-      int next = (i == programCount - 1)? 0 : i + 1;
-      while (next != i) {
-        float freq = programs[next].freq;
-        if (freq >= minFrequency) {
-          if (programs[next].name[0])
-            printf("Switching to %s (%.2f)\n", programs[next].name, freq);
-          setTunerFrequency(fd, tuner, freq);
-          currentFrequency = freq;
-          return;
-        }
-        if (next == programCount - 1) next = 0; else next += 1;
-      }
-      printf("No other stations known\n");
+nextProgram(Tuner *t) {
+  ProgramTable *table = t->programs;
+  const float current = t->currentFrequency;
+  int lo = 0, hi = table->count;
+
+  if (table->count <= 1) return;
+  if (!table->sorted) sortProgramsByFrequency(table);
+
+  /* Find the first station above the one we are currently tuned to */
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (table->byFrequency[mid]->freq <= current+.09) lo = mid + 1;
+    else hi = mid;
+  }
+  for (int i = 0; i < table->count; i++) {
+    ProgramData *pd = table->byFrequency[(lo + i) % table->count];
+    float freq = pd->freq;
+    if (freq >= t->minFrequency
+     && (freq < current-.09 || freq > current+.09)) {
+      if (pd->name[0])
+        printf("Switching to %s (%.2f)\n", pd->name, freq);
+      setTunerFrequency(t, freq);
       return;
     }
   }
+  printf("No other stations known\n");
 }
 
-static inline void
-decodeRds(int fd, struct v4l2_tuner *tuner) {
-  typedef enum {
-    TYPE_0A = 0, TYPE_0B, /* Basic tuning and switching information */
-    TYPE_1A, TYPE_1B,     /* Program-item number and slow labeling codes */
-    TYPE_2A, TYPE_2B,     /* Radiotext */
-    TYPE_3A,              /* Applications Identification for Open Data */
-    TYPE_3B,              /* Open data application */
-    TYPE_4A,              /* Clock-time and date */
-    TYPE_4B,              /* Open data application */
-    TYPE_5A, TYPE_5B,     /* Transparent data channels or ODA */
-    TYPE_6A, TYPE_6B,     /* In house applications or ODA */
-    TYPE_7A,              /* Radio paging or ODA */
-    TYPE_7B,              /* Open data application */
-    TYPE_8A, TYPE_8B,     /* Traffic Message Channel or ODA */
-    TYPE_9A, TYPE_9B,     /* Emergency warning systems or ODA */
-    TYPE_10A,             /* Program Type Name */
-    TYPE_10B,             /* Open data */
-    TYPE_11A, TYPE_11B,   /* Open data application */
-    TYPE_12A, TYPE_12B,   /* Open data application */
-    TYPE_13A,             /* Enhanced Radio paging or ODA */
-    TYPE_13B,             /* Open data application */
-    TYPE_14A, TYPE_14B,   /* Enhanced Other Networks information */
-    TYPE_15A,
-    TYPE_15B              /* Fast tuning and switching information */
-  } RDS_GroupType;
-
-  struct rds_data {
-    uint8_t lsb;
-    uint8_t msb;
-    uint8_t block;
-  } __attribute__((packed)) rdsData;
-  ssize_t count;
-  int blockCount = 0;
-  int errorCount = 0;
+typedef enum {
+  TYPE_0A = 0, TYPE_0B, /* Basic tuning and switching information */
+  TYPE_1A, TYPE_1B,     /* Program-item number and slow labeling codes */
+  TYPE_2A, TYPE_2B,     /* Radiotext */
+  TYPE_3A,              /* Applications Identification for Open Data */
+  TYPE_3B,              /* Open data application */
+  TYPE_4A,              /* Clock-time and date */
+  TYPE_4B,              /* Open data application */
+  TYPE_5A, TYPE_5B,     /* Transparent data channels or ODA */
+  TYPE_6A, TYPE_6B,     /* In house applications or ODA */
+  TYPE_7A,              /* Radio paging or ODA */
+  TYPE_7B,              /* Open data application */
+  TYPE_8A, TYPE_8B,     /* Traffic Message Channel or ODA */
+  TYPE_9A, TYPE_9B,     /* Emergency warning systems or ODA */
+  TYPE_10A,             /* Program Type Name */
+  TYPE_10B,             /* Open data */
+  TYPE_11A, TYPE_11B,   /* Open data application */
+  TYPE_12A, TYPE_12B,   /* Open data application */
+  TYPE_13A,             /* Enhanced Radio paging or ODA */
+  TYPE_13B,             /* Open data application */
+  TYPE_14A, TYPE_14B,   /* Enhanced Other Networks information */
+  TYPE_15A,
+  TYPE_15B,             /* Fast tuning and switching information */
+  RDS_GROUP_TYPES
+} RDS_GroupType;
+
+struct rds_data {
+  uint8_t lsb;
+  uint8_t msb;
+  uint8_t block;
+} __attribute__((packed));
+
+/* A Traffic Message Channel message, see decodeGroup8A() */
+#define TMC_MAX_EVENTS 5        /* the first and additional events */
+#define TMC_MAX_MESSAGES 64     /* active at once */
+#define TMC_MAX_SUBSEQUENT 4    /* groups after the first one */
+
+typedef struct {
+  uint16_t events[TMC_MAX_EVENTS];
+  uint16_t location;
+  uint8_t eventCount;
+  uint8_t extent;
+  uint8_t direction;
+  uint8_t diversion;
+  uint8_t duration;
+  uint64_t expires; /* ms of monotonicTime() */
+} TmcMessage;
+
+/* A multi-group message being received */
+typedef struct {
+  char receiving;
+  char remaining; /* group sequence indicator of the last group */
+  int chunkCount;
+  uint32_t chunks[TMC_MAX_SUBSEQUENT]; /* 28 bits of free format each */
+  TmcMessage message;
+} TmcAssembly;
+
+/* PS or RadioText being assembled from its segments, see assembleText() */
+#define RDS_TEXT_MAX (4*0X10)
+
+typedef struct {
+  char text[RDS_TEXT_MAX + 1];     /* as received so far */
+  char complete[RDS_TEXT_MAX + 1]; /* the last complete text, trimmed */
+  uint16_t received;               /* bit n is set once segment n arrived */
+  uint16_t stable;                 /* and when it repeated unchanged */
+  uint8_t length;                  /* 8 for PS, 64 for 2A or 32 for 2B */
+  uint8_t segmentSize;
+  char abFlag;
+} RdsText;
+
+/* 1187.5 bit/s in blocks of 26 bits */
+#define RDS_BLOCKS_PER_SECOND (1187.5 / 26)
+
+/* A group decoded recently, see repeatedGroup() */
+#define RDS_GROUP_CACHE 256 /* entries, a power of two */
+#define RDS_REPEAT_TIMEOUT (5 * RDS_BLOCKS_PER_SECOND) /* blocks on air */
+
+typedef struct {
+  unsigned char data[2*4];
+  int block;       /* blockCount when it was decoded */
+  uint8_t repeats; /* seen again since */
+} RdsGroupCacheEntry;
+
+/* Reception health
+ *
+ * The loop reading a tuner calls sampleRdsHealth(), which takes a
+ * sample every HEALTH_INTERVAL: signal, stereo pilot and audio mode
+ * from VIDIOC_G_TUNER and the blocks, block errors and groups received
+ * since the sample before.  The last HEALTH_SAMPLES are kept, the
+ * rolling block error and group rates cover the last HEALTH_WINDOW.
+ *
+ * For each station the time from its first block A until its PS name
+ * and its RadioText were complete is kept as well.  It is counted on
+ * air, like the repeat timeout, so replays measure what live reception
+ * would.
+ */
+#define HEALTH_INTERVAL 1000 /* ms */
+#define HEALTH_SAMPLES 300
+#define HEALTH_WINDOW 10     /* samples */
+#define HEALTH_STATIONS 32
+
+typedef struct {
+  uint64_t time;     /* ms of monotonicTime() */
+  uint32_t duration; /* ms since the sample before, 0 for the first */
+  float frequency;
+  int16_t signal;    /* -1 if VIDIOC_G_TUNER failed */
+  uint8_t stereo;    /* a stereo pilot is received */
+  uint8_t audmode;   /* V4L2_TUNER_MODE_* */
+  uint16_t pi;       /* 0 before a PI was received */
+  uint16_t blocks, errors, groups;
+} HealthSample;
+
+typedef struct {
+  uint16_t pi;
+  int acquisitions;
+  int psLatency, rtLatency; /* ms in the last acquisition, -1 if not yet */
+  double psTotal, rtTotal;  /* ms, for the mean */
+  int psCount, rtCount;
+} StationHealth;
+
+typedef struct {
+  HealthSample samples[HEALTH_SAMPLES];
+  int next, count;
+  uint64_t lastSample;
+  int lastBlocks, lastErrors, lastGroups;
+
+  StationHealth stations[HEALTH_STATIONS];
+  int stationCount, replaced;
+  StationHealth *acquiring; /* station whose texts are awaited */
+  int acquiredBlock;        /* blockCount of its first block A */
+  char psPending, rtPending;
+} RdsHealth;
+
+/* Index of the entry of station pi, or -1 */
+static int
+findStationHealth(const RdsHealth *h, uint16_t pi) {
+  for (int i = 0; i < h->stationCount; i++)
+    if (h->stations[i].pi == pi) return i;
+  return -1;
+}
+
+/* A station's texts start from scratch with the block counted as block */
+static void
+startAcquisition(RdsHealth *h, uint16_t pi, int block) {
+  const int found = findStationHealth(h, pi);
+  StationHealth *s = found >= 0? &h->stations[found] : NULL;
+
+  if (s == NULL) {
+    /* When full, the entries are replaced in the order they were added */
+    s = h->stationCount < HEALTH_STATIONS? &h->stations[h->stationCount++]
+      : &h->stations[h->replaced++ % HEALTH_STATIONS];
+    memset(s, 0, sizeof(*s));
+    s->pi = pi;
+  }
+  s->acquisitions += 1;
+  s->psLatency = s->rtLatency = -1;
+  h->acquiring = s;
+  h->acquiredBlock = block;
+  h->psPending = h->rtPending = 1;
+}
+
+/* The PS name, or the RadioText if rt, was completed by block */
+static void
+textAcquired(RdsHealth *h, int rt, int block) {
+  StationHealth *s = h->acquiring;
+  const int ms = (block - h->acquiredBlock) * 1000 / RDS_BLOCKS_PER_SECOND;
+
+  if (s == NULL) return;
+  if (!rt && h->psPending) {
+    s->psLatency = ms;
+    s->psTotal += ms;
+    s->psCount += 1;
+    h->psPending = 0;
+  } else if (rt && h->rtPending) {
+    s->rtLatency = ms;
+    s->rtTotal += ms;
+    s->rtCount += 1;
+    h->rtPending = 0;
+  }
+  if (!h->psPending && !h->rtPending) h->acquiring = NULL;
+}
+
+typedef struct RdsDecoder RdsDecoder;
+
+/* A group decoder is called once per complete group, groupData holds
+ * blocks A to D in transmission order (msb first).
+ */
+typedef void (*RdsGroupDecoder)(RdsDecoder *dec, const unsigned char *groupData);
+
+struct RdsDecoder {
+  Tuner *tuner;
+  const char *label; /* prefixed to output if not NULL */
+  char quiet;
+
+  int blockCount;
+  int errorCount;     /* blocks dropped because of uncorrectable errors */
+  int recoveredCount; /* blocks received with corrected errors */
+  int groupCount;
+  int repeatCount;    /* groups skipped as repeats */
+  int psBlock;        /* blockCount when a PS name was first complete */
+  RdsHealth health;
 
   RDS_GroupType groupType;
   unsigned char groupData[2*4];
   unsigned char lastGroupData[2*4];
+  RdsGroupCacheEntry groupCache[RDS_GROUP_CACHE];
+
+  /* Indexed by the 5 bit group type and version code of block B */
+  RdsGroupDecoder groupDecoders[RDS_GROUP_TYPES];
 
-  ProgramData *thisProgram = NULL;
+  ProgramData *thisProgram;
+  ProgramData *textProgram; /* whose PS and RadioText are assembled */
+  unsigned int epoch;       /* tune epoch of the blocks decoded */
 
-  char programName[8+1] = {0};
-  char *lastProgramName = NULL;
+  RdsText ps;
 
-  char stereoKnown = 0;
+  char stereoKnown;
   char isStereo;
-  char ta = 0;
+  char ta;
 
-  int freqCounter = 0;
+  int freqCounter;
 
-  char radioText[4*0X10 + 1] = {0};
-  char radioTextabFlag = 0;
+  RdsText rt;
 
-  memset(radioText, ' ', 4*0X10);
-  radioText[4*0X10] = 0;
+  struct {
+    char toggle;
+    char tag[2][4*0X10 + 1];
+  } rtPlus;
 
-  if (isatty(STDIN_FILENO)) {
-    disableCannonicalMode();
-  }
-  while (1) {
-    struct pollfd fds[] = {
-      { .fd = fd, .events = POLLIN },
-      { .fd = STDIN_FILENO, .events = POLLIN }
-    };
-    const int fdCount = sizeof(fds)/sizeof(*fds);
-    int pollval = poll(fds, fdCount, 1000);
+  struct {
+    TmcAssembly assembly[8]; /* by continuity index */
+    TmcMessage active[TMC_MAX_MESSAGES];
+    int activeCount;
+  } tmc;
+};
 
-    if (pollval == 0) {
-      if (verbose) printf("No RDS data\n");
-      continue;
-    } else if (pollval == -1) {
-      perror("poll");
-      break;
-    }
-    
-    for (int i = 0; i < fdCount; i++) {
-      if (fds[i].revents & fds[i].events) {
-        if (fds[i].fd == fd) {
-          count = read(fd, &rdsData, sizeof(rdsData));
-          if (count == 0) break;
-          if (count != sizeof(rdsData)) {
-            printf("ERR: Incomplete RDS block, count was %d\n", (int)count);
-            continue;
-          }
-        } else if (fds[i].fd == STDIN_FILENO) {
-          uint8_t c;
-          count = read(STDIN_FILENO, &c, 1);
-          if (count == 1) {
-            switch (c) {
-            case 'n': nextProgram(fd, tuner); break;
-            case '+': {
-              currentFrequency += .05;
-              if (currentFrequency > maxFrequency)
-                currentFrequency = minFrequency;
-              setTunerFrequency(fd, tuner, currentFrequency);
-              printf("Frequency tuned to %.2f\n", currentFrequency);
-              break;
-            }
-            case '-': {
-              currentFrequency -= .05;
-              if (currentFrequency < minFrequency)
-                currentFrequency = maxFrequency;
-              setTunerFrequency(fd, tuner, currentFrequency);
-              printf("Frequency tuned to %.2f\n", currentFrequency);
-              break;
-            }
-            default:
-              printf("Keyboard: %d (%X)\n", c, c);
-            }
-            continue;
-          } else if (count == 0) {
-            break;
-          }
-        }
-      }
-    }
+static RdsGroupDecoder groupDecoders[RDS_GROUP_TYPES];
 
-    int blockNumber = rdsData.block & 0X07;
-    int error = (rdsData.block&0X80)==0X80;
+static void
+rdsPrintf(RdsDecoder *dec, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/* Event output
+ *
+ * What the decoder learns is reported as events, which a sink either
+ * prints as text (the default), writes as NDJSON or binary records, or
+ * appends to a shared memory ring.  Sinks other than stdio text never
+ * block: records go to a buffer which is written whenever the
+ * descriptor accepts data, and records which do not fit are dropped and
+ * counted.  Diagnostics which are not events still go through
+ * rdsPrintf(), to stderr unless the sink prints text to stdout.
+ */
 
-    blockCount += 1;
+typedef enum {
+  RDS_EVENT_PS = 1, RDS_EVENT_PTY, RDS_EVENT_TA, RDS_EVENT_STEREO,
+  RDS_EVENT_RADIOTEXT, RDS_EVENT_TIME, RDS_EVENT_TMC, RDS_EVENT_EON_FREQ,
+  RDS_EVENT_EON_TA, RDS_EVENT_RTPLUS, RDS_EVENT_AF_SWITCH,
+  RDS_EVENT_TMC_EXPIRED,
+  RDS_EVENT_TYPES
+} RdsEventType;
+
+#define RDS_EVENT_VALUES 6
+
+/* Names of the integer values and the text of each event, in order */
+static const struct {
+  const char *name;
+  const char *values[RDS_EVENT_VALUES];
+  const char *text;
+} rdsEventTypes[RDS_EVENT_TYPES] = {
+  [RDS_EVENT_PS] = { "ps", { NULL }, "name" },
+  [RDS_EVENT_PTY] = { "pty", { "code" } },
+  [RDS_EVENT_TA] = { "ta", { "on" } },
+  [RDS_EVENT_STEREO] = { "stereo", { "on" } },
+  [RDS_EVENT_RADIOTEXT] = { "rt", { NULL }, "text" },
+  [RDS_EVENT_TIME] = { "time", { "year", "month", "day", "hour", "minute",
+                                 "offset" } }, /* local time, offset in minutes */
+  [RDS_EVENT_TMC] = { "tmc", { "event", "location", "direction", "extent",
+                               "duration", "diversion" }, "text" },
+  [RDS_EVENT_EON_FREQ] = { "eon_freq", { "pi", "khz" }, "name" },
+  [RDS_EVENT_EON_TA] = { "eon_ta", { "pi", "on" }, "name" },
+  [RDS_EVENT_RTPLUS] = { "rtplus", { "content" }, "text" },
+  [RDS_EVENT_AF_SWITCH] = { "af_switch", { "from_khz", "to_khz", "signal",
+                                           "new_signal" }, "name" },
+  [RDS_EVENT_TMC_EXPIRED] = { "tmc_expired", { "event", "location",
+                                               "direction" } },
+};
 
-    if (error) {
-      errorCount += 1;
-      if (verbose) printf("%d errors in %d blocks so far\n",
-			  errorCount, blockCount);
-      continue;
-    }
+typedef struct {
+  RdsEventType type;
+  uint64_t time;      /* CLOCK_REALTIME in ns */
+  const char *label;  /* of the tuner, may be NULL */
+  uint16_t pi;        /* of the program received, 0 if not known yet */
+  int valueCount;
+  int32_t values[RDS_EVENT_VALUES];
+  const char *text;
+} RdsEvent;
+
+static const char *rtPlusContentTypes[] = {
+  "Dummy", "Title", "Album", "Track", "Artist", "Composition", "Movement",
+  "Conductor", "Composer", "Band", "Comment", "Genre"
+};
 
-    if (blockNumber == 0) {
-      thisProgram = getProgram(rdsData.msb<<8|rdsData.lsb);
-      thisProgram->freq = currentFrequency;
-    }
-    if (blockNumber == 1) {
-      int ptyCode = ((rdsData.msb << 3) & 0X18) | ((rdsData.lsb >> 5) & 0X07);
+static const char *tmcDurations[8] = {
+  "unknown", "15 minutes", "30 minutes", "1 hour", "2 hours", "3 hour",
+  "4 hour", "rest of the day"
+};
 
-      if (thisProgram != NULL && ptyCode != 0) {
-	if (thisProgram->type != ptyCode) {
-          thisProgram->type = ptyCode;
-          if (ptyCode > 0) printf("Program type: %s\n",
-                                  programTypes[ptyCode-1]);
-        }
-      }
-      groupType = (RDS_GroupType)rdsData.msb>>3;
-    }
-    groupData[2*blockNumber] = rdsData.msb;
-    groupData[2*blockNumber+1] = rdsData.lsb;
-    if (blockNumber == 3) {
-      if (memcmp(groupData, lastGroupData, sizeof(groupData)) == 0)
-        continue;
-      switch (groupType) {
-      case TYPE_0A: {
-        char TP = (groupData[2] & 0x04) == 0X04;
-	char isTrafficAnnouncement = (groupData[3] & 0x10) == 0X10;
-	char isMusic = (groupData[3] & 0x08) == 0X08;
-	int index = (groupData[3] & 0x03) << 1;
-
-	if (TP && isTrafficAnnouncement != ta) {
-	  ta = isTrafficAnnouncement;
-	  printf("Traffic announcement %s\n", ta? "on" : "off");
-	}
-	programName[index] = groupData[6];
-	programName[index+1] = groupData[7];
-	if (strlen(programName) && index == 6) {
-	  if (lastProgramName == NULL
-	   || strcmp(programName, lastProgramName) != 0) {
-	    printf("Program: %s\n", programName);
-	    if (lastProgramName != NULL) free(lastProgramName);
-	    lastProgramName = strdup(programName);
-	  }
-	  programName[0] = 0;
-	}
-	switch (groupData[3]&0X03) {
-	case 3:
-	  if (!stereoKnown) {
-	    isStereo = ((groupData[3]&0X04)==0X04);
-	    stereoKnown = 1;
-	    printf("Program is %s\n", isStereo? "stereo" : "mono");
-	  }
-	  if (isStereo != ((groupData[3]&0X04)==0X04)) {
-	    isStereo = ((groupData[3]&0X04)==0X04);
-	    printf("Program is %s\n", isStereo? "stereo" : "mono");
-	  }
-	  break;
-	}
+typedef enum { SINK_TEXT, SINK_JSON, SINK_BINARY, SINK_RING } EventFormat;
 
-	if ((groupData[4]>=224)&&(groupData[4]<=249)) {
-	  freqCounter = groupData[4] - 224;
-	  if (freqCounter) {
-	    if ((groupData[5]>=1) && ((groupData[5]<=204))) {
-	      float f = ((100*(groupData[5]-1))+87600)/1000.0;
-	      freqCounter -= 1;
-	    }
-	  }
-	} else if (freqCounter > 0) {
-	  float f1 = ((100*(groupData[4]-1))+87600)/1000.0;
-	  float f2 = ((100*(groupData[5]-1))+87600)/1000.0;
-          freqCounter -= 2;
-	  if (freqCounter == 0) {
-	    //printf("AFlist done\n");
-	  }
-	}
-	break;
-      }
-      case TYPE_2A: {
-	int index = groupData[3]&0X0F;
-	int newabFlag = (groupData[3]&0X10)==0X10;
-	if (newabFlag != radioTextabFlag) {
-	  radioTextabFlag = newabFlag;
-
-	  {
-	    int i = 63;
-	    while (i >= 0) {
-	      if (radioText[i] == 0) {
-		i -= 1;
-		continue;
-	      }
-	      if ((radioText[i] == ' ') || (radioText[i] == '\r')) {
-		radioText[i] = 0;
-		i -= 1;
-		continue;
-	      }
-	      break;
-	    }
-	  }
-	  if (strlen(radioText) > 0) {
-	    printf("Text: %s\n", radioText);
-	  }
-	  
-	  memset(radioText, ' ', 4*0X10);
-	}
-	for (int i = 0; i < 4; i++) {
-	  radioText[4*index + i] = groupData[4+i];
-	}
-              }
-              break;
-      case TYPE_4A: {
-	const int monthDays[] = {31,28,31,30,31,30,31,31,30,31,30,31};
-	const int julianDate = ((groupData[3]&0X03)<<15)
-                             | (groupData[4]<<7)
-	                     | (groupData[5]>>1);
-	int year = (int)(((double)julianDate - 15078.2)/365.25);
-	int month = (int)(((julianDate - 14956.1)-(int)(year*365.25))/30.6001);
-	int day = julianDate-14956-(int)(year*365.25)-(int)(month*30.6001);
-	int utcHour = ((groupData[5]&0X01)<<4)
-	            | ((groupData[6]&0XF0)>>4);
-	int utcMinute = ((groupData[6]&0X0F)<<2)
-	              | ((groupData[7]&0XC0)>>6);
-	int utcOffset = groupData[7]&0X1F;
-	int K = ((month == 14)||(month == 15))? 1 : 0;
-
-	if (groupData[7]&0X20) utcOffset = -utcOffset;
-
-	year = year + K + 1900;
-	month = month - 1 - (K*12);
-
-	{ /* Calculate local time */
-	  int localHour = utcHour; 
-	  int localMinute  = utcMinute + (utcOffset*30);
-
-	  while (localMinute < 0) { localMinute += 60, localHour -= 1; }
-	  while (localMinute >= 60) { localMinute -= 60, localHour += 1; }
-	  if (localHour < 0) {
-	    localHour += 24, day -= 1;
-	    if (day < 1) {
-	      month -= 1;
-	      if (month < 1) {
-		month = 12;
-		year -= 1;
-	      }
-	      day = monthDays[month-1];
-	      if (((year % 4) == 0) && (month == 2)) day = 29;
-	    }
-	  }
-	  if (localHour >= 24) {
-	    localHour -= 24, day += 1;
-	    int maxDay = (((year%4)==0)&&(month==2))? 29 : monthDays[month-1];
-	    if (day > maxDay) {
-	      month += 1;
-	      if (month > 12) {
-		month = 1, year += 1;
-	      }
-	    }
-	  }
+/* The ring is a header followed by size bytes of binary records, which
+ * start at 8 byte boundaries.  head counts all bytes ever written and is
+ * only advanced once a record is complete.  A record never wraps, the
+ * rest of the ring is filled with a record of type 0 instead.  Readers
+ * which fall more than size bytes behind head have lost records and
+ * continue from head.
+ */
+#define EVENT_RING_MAGIC "si470xEV"
+#define EVENT_RING_SIZE (1 << 20)
+#define EVENT_RING_DATA 64
 
-	  printf("Date: %04d-%02d-%02d %02d:%02d (%c%02d:%02d)\n",
-		 year, month, day, localHour, localMinute,
-		 (utcOffset > 0)? '+' : '-',
-		 utcOffset*30 / 60, (utcOffset*30) % 60);
-	}
-	break;
-      }
-      case TYPE_8A: {
-	typedef enum {TMC_GROUP=0, TMC_SINGLE, TMC_SYSTEM, TMC_TUNING} TMC_Type;
-	TMC_Type tmctype = (groupData[3]&0X18)>>3;
-	int CI = groupData[3]&0X07;
-        int extent = (groupData[4]&0X38)>>3;
-	int event = ((groupData[4]&0X07)<<8)|groupData[5];
-        uint16_t location = groupData[6]<<8|groupData[7];
-	switch (tmctype) {
-	case TMC_SINGLE: {
-          int duration = CI;
-          char *durStr = NULL;
-          switch (duration) {
-          case 0: durStr = "unknown"; break;
-          case 1: durStr = "15 minutes"; break;
-          case 2: durStr = "30 minutes"; break;
-          case 3: durStr = "1 hour"; break;
-          case 4: durStr = "2 hours"; break;
-          case 5: durStr = "3 hour"; break;
-          case 6: durStr = "4 hour"; break;
-          case 7: durStr = "rest of the day"; break;
-          }
-	  printf("TMC(single): evt=%X, loc=%X, extent=%X, dur=%s\n",
-		 event, location, extent, durStr);
-	  break;
-	}
-	default:
-	  if (verbose) printf("TMC: Type=%X, CI=%X, event=%X, loc=%X\n",
-		 tmctype, CI, event, location);
-	}
-	break;
-      }
-      case TYPE_14A: {
-	int TPON = (groupData[3]&0X10)==0X10;
-	int variantType = groupData[3]&0X0F;
-	int info = (groupData[4]<<8)|(groupData[5]);
-	int PION = (groupData[6]<<8)|(groupData[7]);
-	ProgramData *otherProgram = getProgram(PION);
-        switch (variantType) {
-	case 0:
-	case 1:
-	case 2:
-	case 3: {
-	  otherProgram->name[2*variantType] = groupData[4];
-	  otherProgram->name[2*variantType+1] = groupData[5];
-	  break;
-	}
-        case 5: {
-          uint8_t lsb = groupData[5];
-          uint8_t msb = groupData[4];
-          if (thisProgram != NULL
-           && EONAF_handleFrequencyPair(thisProgram, otherProgram,
-                                    ((100*(msb-1))+87600)/1000.0,
-                                    ((100*(lsb-1))+87600)/1000.0)) {
-            if (verbose && otherProgram->name && otherProgram->name[0])
-              printf("%s is on %.2fMHz\n", otherProgram->name, otherProgram->freq);
-          }
-	  break;
-        }
-        case 0XD: {
-          int TAON = groupData[5]&0X01;
-          if (TPON && TAON) {
-	    if (TAON != otherProgram->ta) {
-	      if (otherProgram->name && otherProgram->name[0])
-		printf("Traffic Announcement on %s is %s\n",
-		       otherProgram->name, TAON? "on" : "off");
-	      else
-		printf("Traffic Announcement on %X is %s\n",
-		       PION, TAON? "on" : "off");
-	      otherProgram->ta = TAON;
-	    }
-          }
-          break;
-        }
-        default:
-          if (verbose) printf("EON: TPON=%d, v=%X, info=%X, PION=%X\n",
-				  TPON, variantType, info, PION);
+typedef struct {
+  char magic[8];
+  uint32_t size;
+  uint32_t reserved;
+  uint64_t head;
+} EventRingHeader;
 
-	break;
-        }
-      }
-      default:
-        if (verbose > 1) {
-          printf("Group(%X): %02X%02X-%02X%02X-%02X%02X-%02X%02X\n",
-                 groupType,
-                 groupData[0], groupData[1], groupData[2], groupData[3],
-	         groupData[4], groupData[5], groupData[6], groupData[7]);
-        }
+#define EVENT_BUFFER_SIZE 65536
+#define EVENT_RECORD_MAX 512
+
+typedef struct {
+  EventFormat format;
+  int fd;          /* -1 to print text through stdio */
+  char *buffer;
+  size_t fill;
+  EventRingHeader *ring;
+  unsigned long dropped;
+} EventSink;
+
+static EventSink eventSink = { .format = SINK_TEXT, .fd = -1 };
+
+static size_t
+formatTextEvent(char *out, size_t size, const RdsEvent *e) {
+  const int32_t *v = e->values;
+  int n = 0;
+
+  if (e->label != NULL) n = snprintf(out, size, "%s: ", e->label);
+  out += n, size -= n;
+  switch (e->type) {
+  case RDS_EVENT_PS:
+    return n + snprintf(out, size, "Program: %s\n", e->text);
+  case RDS_EVENT_PTY:
+    return n + snprintf(out, size, "Program type: %s\n",
+                        v[0] <= 30? programTypes[v[0]-1] : "unknown");
+  case RDS_EVENT_TA:
+    return n + snprintf(out, size, "Traffic announcement %s\n",
+                        v[0]? "on" : "off");
+  case RDS_EVENT_STEREO:
+    return n + snprintf(out, size, "Program is %s\n", v[0]? "stereo" : "mono");
+  case RDS_EVENT_RADIOTEXT:
+    return n + snprintf(out, size, "Text: %s\n", e->text);
+  case RDS_EVENT_TIME:
+    return n + snprintf(out, size, "Date: %04d-%02d-%02d %02d:%02d "
+                        "(%c%02d:%02d)\n", v[0], v[1], v[2], v[3], v[4],
+                        v[5] >= 0? '+' : '-', abs(v[5]) / 60, abs(v[5]) % 60);
+  case RDS_EVENT_TMC:
+    return n + snprintf(out, size, "TMC: evt=%X, loc=%X, dir=%c, extent=%X, "
+                        "dur=%s%s%s%s\n", v[0], v[1], v[2]? '-' : '+', v[3],
+                        tmcDurations[v[4]&7], v[5]? ", diversion" : "",
+                        e->text[0]? ": " : "", e->text);
+  case RDS_EVENT_TMC_EXPIRED:
+    if (!verbose) return 0;
+    return n + snprintf(out, size, "TMC expired: evt=%X, loc=%X, dir=%c\n",
+                        v[0], v[1], v[2]? '-' : '+');
+  case RDS_EVENT_EON_FREQ:
+    if (!verbose || !e->text[0]) return 0;
+    return n + snprintf(out, size, "%s is on %.2fMHz\n", e->text, v[1]/1000.0);
+  case RDS_EVENT_EON_TA:
+    if (e->text[0])
+      return n + snprintf(out, size, "Traffic Announcement on %s is %s\n",
+                          e->text, v[1]? "on" : "off");
+    return n + snprintf(out, size, "Traffic Announcement on %X is %s\n",
+                        v[0], v[1]? "on" : "off");
+  case RDS_EVENT_RTPLUS:
+    if (v[0] < sizeof(rtPlusContentTypes)/sizeof(*rtPlusContentTypes))
+      return n + snprintf(out, size, "%s: %s\n", rtPlusContentTypes[v[0]],
+                          e->text);
+    if (!verbose) return 0;
+    return n + snprintf(out, size, "RT+(%d): %s\n", v[0], e->text);
+  case RDS_EVENT_AF_SWITCH:
+    if (e->text[0])
+      return n + snprintf(out, size, "Signal %d%%, switching %s to %.2f "
+                          "(%d%%)\n", v[2]*100/0XFFFF, e->text, v[1]/1000.0,
+                          v[3]*100/0XFFFF);
+    return n + snprintf(out, size, "Signal %d%%, switching to %.2f (%d%%)\n",
+                        v[2]*100/0XFFFF, v[1]/1000.0, v[3]*100/0XFFFF);
+  default:
+    return 0;
+  }
+}
+
+static size_t
+formatJsonString(char *out, size_t size, const char *s) {
+  size_t n = 0;
+
+  if (size < 3) return 0;
+  out[n++] = '"';
+  for (; *s && n + 8 < size; s++) {
+    const unsigned char c = *s;
+
+    if (c == '"' || c == '\\') {
+      out[n++] = '\\';
+      out[n++] = c;
+    } else if (c < 0X20 || c >= 0X7F) {
+      /* RDS characters are not UTF-8, pass them on as code points */
+      n += sprintf(out + n, "\\u%04X", c);
+    } else {
+      out[n++] = c;
+    }
+  }
+  out[n++] = '"';
+  out[n] = 0;
+  return n;
+}
+
+static size_t
+formatJsonEvent(char *out, size_t size, const RdsEvent *e) {
+  const size_t end = size - 3; /* room for "}\n" */
+  size_t n;
+
+  n = snprintf(out, size, "{\"ts\":%llu.%03u,\"event\":\"%s\",\"pi\":%u",
+               (unsigned long long)(e->time / 1000000000),
+               (unsigned int)(e->time / 1000000 % 1000),
+               rdsEventTypes[e->type].name, e->pi);
+  if (e->label != NULL && n + 10 < end) {
+    n += sprintf(out + n, ",\"tuner\":");
+    n += formatJsonString(out + n, end - n, e->label);
+  }
+  for (int i = 0; i < e->valueCount && n + 32 < end; i++) {
+    n += sprintf(out + n, ",\"%s\":%d", rdsEventTypes[e->type].values[i],
+                 (int)e->values[i]);
+  }
+  if (e->text != NULL && n + 16 < end) {
+    n += sprintf(out + n, ",\"%s\":", rdsEventTypes[e->type].text);
+    n += formatJsonString(out + n, end - n, e->text);
+  }
+  out[n++] = '}';
+  out[n++] = '\n';
+  out[n] = 0;
+  return n;
+}
+
+/* A binary record is this header, valueCount 32 bit values, the label
+ * and the text, all in host byte order.
+ */
+typedef struct {
+  uint16_t length;      /* of the entire record */
+  uint8_t type;
+  uint8_t valueCount;
+  uint16_t pi;
+  uint8_t labelLength;
+  uint8_t textLength;
+  uint64_t time;
+} __attribute__((packed)) RdsEventRecord;
+
+static size_t
+formatBinaryEvent(char *out, size_t size, const RdsEvent *e) {
+  RdsEventRecord record = {
+    .type = e->type,
+    .valueCount = e->valueCount,
+    .pi = e->pi,
+    .labelLength = e->label != NULL? strlen(e->label) : 0,
+    .textLength = e->text != NULL? strlen(e->text) : 0,
+    .time = e->time
+  };
+  const size_t values = e->valueCount*sizeof(*e->values);
+  size_t n = sizeof(record);
+
+  record.length = n + values + record.labelLength + record.textLength;
+  if (record.length > size) return 0;
+  memcpy(out, &record, sizeof(record));
+  memcpy(out + n, e->values, values);
+  n += values;
+  memcpy(out + n, e->label, record.labelLength);
+  n += record.labelLength;
+  memcpy(out + n, e->text, record.textLength);
+  return record.length;
+}
+
+static void
+writeEventRing(EventRingHeader *ring, const char *record, size_t length) {
+  char *data = (char *)ring + EVENT_RING_DATA;
+  const uint64_t head = ring->head;
+  const size_t offset = head & (ring->size - 1);
+  const size_t aligned = (length + 7) & ~(size_t)7;
+
+  if (offset + aligned > ring->size) {
+    const uint16_t padding[2] = { ring->size - offset, 0 };
+
+    memcpy(data + offset, padding, sizeof(padding));
+    __atomic_store_n(&ring->head, head + padding[0], __ATOMIC_RELEASE);
+    writeEventRing(ring, record, length);
+    return;
+  }
+  memcpy(data + offset, record, length);
+  __atomic_store_n(&ring->head, head + aligned, __ATOMIC_RELEASE);
+}
+
+/* Write as much of the buffer as the descriptor takes without blocking */
+static void
+flushEventSink() {
+  EventSink *sink = &eventSink;
+  size_t written = 0;
+
+  if (sink->fd == -1) {
+    if (sink->ring == NULL) fflush(stdout);
+    return;
+  }
+  while (written < sink->fill) {
+    ssize_t n = write(sink->fd, sink->buffer + written, sink->fill - written);
+    if (n <= 0) {
+      if (n == -1 && errno != EAGAIN && errno != EINTR) {
+        perror("event output");
+        sink->fill = written = 0;
       }
-      memcpy(lastGroupData, groupData, sizeof(groupData));
-      memset(groupData, 0, sizeof(groupData));
+      break;
     }
+    written += n;
   }
+  memmove(sink->buffer, sink->buffer + written, sink->fill - written);
+  sink->fill -= written;
+}
 
-  if (lastProgramName != NULL) free(lastProgramName);
-  tcsetattr(0, TCSAFLUSH, &savedTerminalSettings);
+static void
+writeEvent(const RdsEvent *e) {
+  EventSink *sink = &eventSink;
+  char record[EVENT_RECORD_MAX];
+  size_t length;
+
+  switch (sink->format) {
+  case SINK_TEXT:
+    length = formatTextEvent(record, sizeof(record), e);
+    if (length >= sizeof(record)) length = sizeof(record) - 1;
+    break;
+  case SINK_JSON:
+    length = formatJsonEvent(record, sizeof(record), e);
+    break;
+  default:
+    length = formatBinaryEvent(record, sizeof(record), e);
+  }
+  if (length == 0) return;
+
+  if (sink->ring != NULL) {
+    writeEventRing(sink->ring, record, length);
+  } else if (sink->fd == -1) {
+    fwrite(record, 1, length, stdout);
+  } else {
+    if (sink->fill + length > EVENT_BUFFER_SIZE) flushEventSink();
+    if (sink->fill + length > EVENT_BUFFER_SIZE) {
+      sink->dropped += 1;
+      return;
+    }
+    memcpy(sink->buffer + sink->fill, record, length);
+    sink->fill += length;
+  }
 }
 
-/* Audio I/O */
+/**
+ * Report an event of the decoder, followed by the integer values and
+ * the text listed for type in rdsEventTypes.
+ */
+static void
+rdsEvent(RdsDecoder *dec, RdsEventType type, ...) {
+  RdsEvent event = {
+    .type = type,
+    .label = dec->label,
+    .pi = dec->thisProgram != NULL? dec->thisProgram->id : 0
+  };
+  struct timespec ts;
+  va_list args;
+
+  if (dec->quiet) return;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  event.time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  va_start(args, type);
+  while (event.valueCount < RDS_EVENT_VALUES
+      && rdsEventTypes[type].values[event.valueCount] != NULL) {
+    event.values[event.valueCount++] = va_arg(args, int);
+  }
+  if (rdsEventTypes[type].text != NULL) event.text = va_arg(args, const char *);
+  va_end(args);
 
-#include <alsa/asoundlib.h>
-#include <samplerate.h>
+  writeEvent(&event);
+}
 
-static snd_pcm_t *pcmIn;
+/**
+ * Select the event sink from FORMAT[:PATH], where FORMAT is text, json
+ * or binary and PATH defaults to stdout, or from ring:PATH.  Returns 0
+ * if it cannot be set up.
+ */
+static int
+openEventSink(const char *spec) {
+  EventSink *sink = &eventSink;
+  const char *path = strchr(spec, ':');
+  const size_t length = path != NULL? path - spec : strlen(spec);
+  const char *formats[] = { "text", "json", "binary", "ring" };
+  int format;
+
+  for (format = 0; format < sizeof(formats)/sizeof(*formats); format++) {
+    if (strlen(formats[format]) == length
+     && strncmp(spec, formats[format], length) == 0) break;
+  }
+  if (format == sizeof(formats)/sizeof(*formats)) {
+    fprintf(stderr, "Unknown event format %.*s\n", (int)length, spec);
+    return 0;
+  }
+  sink->format = format;
+  if (path != NULL) path += 1;
 
-static unsigned int inputSampleRate = 96000;
-static char num_channels = 2;
-static unsigned int period_size = 2048, num_periods = 4; /* 85ms */
+  if (format == SINK_RING) {
+    const size_t bytes = EVENT_RING_DATA + EVENT_RING_SIZE;
+    EventRingHeader *ring;
+    int fd;
 
-static unsigned int resample_quality = 3;
+    if (path == NULL) {
+      fprintf(stderr, "ring needs a file, for instance in /dev/shm\n");
+      return 0;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+      perror(path);
+      return 0;
+    }
+    if (ftruncate(fd, bytes) == -1 ||
+        (ring = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))
+        == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return 0;
+    }
+    close(fd);
+    ring->size = EVENT_RING_SIZE;
+    ring->head = 0;
+    memcpy(ring->magic, EVENT_RING_MAGIC, sizeof(ring->magic));
+    sink->ring = ring;
+    return 1;
+  }
 
-#ifdef HAVE_JACK
-#include <alloca.h>
-#include <math.h>
+  if (path == NULL || strcmp(path, "-") == 0) {
+    if (format == SINK_TEXT) return 1;
+    sink->fd = STDOUT_FILENO;
+  } else if ((sink->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644))
+             == -1) {
+    perror(path);
+    return 0;
+  }
+  if (fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) | O_NONBLOCK) == -1) {
+    perror("fcntl O_NONBLOCK");
+    return 0;
+  }
+  if ((sink->buffer = malloc(EVENT_BUFFER_SIZE)) == NULL) {
+    fprintf(stderr, "no memory for event buffer\n");
+    return 0;
+  }
+  return 1;
+}
 
-#include <jack/jack.h>
+static void
+closeEventSink() {
+  EventSink *sink = &eventSink;
 
-static jack_client_t *jackClient;
-static jack_port_t *jackPorts[MAX_CHANNELS];
-static SRC_STATE *srcs[MAX_CHANNELS];
+  flushEventSink();
+  if (sink->fill > 0) sink->dropped += 1;
+  if (sink->dropped) {
+    fprintf(stderr, "%lu events dropped by a slow consumer\n", sink->dropped);
+  }
+}
 
-static int jackSampleRate, jackBufferSize;
+static void
+rdsPrintf(RdsDecoder *dec, const char *format, ...) {
+  FILE *out = (eventSink.format == SINK_TEXT && eventSink.fd == -1)?
+    stdout : stderr;
+  va_list args;
+
+  if (dec->quiet) return;
+  if (dec->label != NULL) fprintf(out, "%s: ", dec->label);
+  va_start(args, format);
+  vfprintf(out, format, args);
+  va_end(args);
+}
 
-static int quit = 0;
-static double resample_mean = 1.0;
-static double static_resample_factor = 1.0;
+/**
+ * Install decoder as the default handler for groups of the given type,
+ * passing NULL turns decoding of that group type off.  Only decoders
+ * initialized after the call pick up the change.
+ */
+static void
+registerGroupDecoder(RDS_GroupType type, RdsGroupDecoder decoder) {
+  if (type < RDS_GROUP_TYPES) groupDecoders[type] = decoder;
+}
 
-static double *offset_array;
-static double *window_array;
-static int offset_differential_index = 0;
-static double offset_integral = 0;
+/* Open Data Applications announce their group type in 3A groups */
 
-static int target_delay = 0; /* the delay which the program should try to approach. */
-static int max_diff = 0;     /* the diff value, when a hard readpointer skip should occur */
-static int catch_factor = 100000, catch_factor2 = 10000;
-static double pclamp = 15.0;
-static double controlquant = 10000.0;
-static const int smooth_size = 512;
+#define MAX_ODA_DECODERS 16
 
-// Debug stuff:
+static struct {
+  uint16_t aid;
+  const char *name;
+  RdsGroupDecoder decoder;
+} odaDecoders[MAX_ODA_DECODERS];
+static int odaDecoderCount = 0;
 
-volatile float output_resampling_factor = 1.0;
-volatile int output_new_delay = 0;
-volatile float output_offset = 0.0;
-volatile float output_integral = 0.0;
-volatile float output_diff = 0.0;
+static void
+registerOdaDecoder(uint16_t aid, const char *name, RdsGroupDecoder decoder) {
+  if (odaDecoderCount < MAX_ODA_DECODERS) {
+    odaDecoders[odaDecoderCount].aid = aid;
+    odaDecoders[odaDecoderCount].name = name;
+    odaDecoders[odaDecoderCount].decoder = decoder;
+    odaDecoderCount += 1;
+  } else {
+    fprintf(stderr, "Too many ODA decoders, ignoring %s\n", name);
+  }
+}
 
-typedef struct {
-  snd_pcm_format_t format_id;
-  size_t sample_size;
-  void (*soundcard_to_jack) (jack_default_audio_sample_t *dst, char *src,
-			     unsigned long nsamples, unsigned long src_skip);
-} alsa_format_t;
+static inline float
+afFrequency(int code) {
+  return 87.5 + .1*code;
+}
 
-#define SAMPLE_16BIT_SCALING  32767.0f
+static inline int
+afCode(float freq) {
+  const int code = (freq - 87.5)*10 + .5;
+  return (code >= 1 && code < AF_CODES)? code : 0;
+}
 
 static void
-sample_move_dS_s16(jack_default_audio_sample_t *dst, char *src,
-		   unsigned long nsamples, unsigned long src_skip) 
-{
-  while (nsamples--) {
-    *dst = (*((short *)src)) / SAMPLE_16BIT_SCALING;
-    dst += 1, src += src_skip;
+addAlternativeFrequency(ProgramData *pd, uint8_t code) {
+  if (code < 1 || code >= AF_CODES) return;
+  for (int i = 0; i < pd->afCount; i++) {
+    if (pd->af[i] == code) return;
   }
-}	
+  if (pd->afCount < MAX_AF) pd->af[pd->afCount++] = code;
+}
 
-static alsa_format_t formats[] = {
-  { SND_PCM_FORMAT_S16, 2, sample_move_dS_s16 }
-};
-#define NUMFORMATS (sizeof(formats)/sizeof(formats[0]))
-static int format = 0;
+/* Text assembly
+ *
+ * PS and RadioText are sent in segments of 2 or 4 characters, which
+ * arrive in any order and may be missed or, with undetected errors,
+ * wrong.  A segment is trusted once it arrived twice with the same
+ * content, and a text is complete when all its segments are trusted, up
+ * to the one holding a carriage return if any.  Only a complete text
+ * which differs from the previous one is reported.
+ */
+
+static void
+resetText(RdsText *t, int length) {
+  memset(t->text, ' ', RDS_TEXT_MAX);
+  t->text[length] = 0;
+  t->received = t->stable = 0;
+  t->length = length;
+  t->segmentSize = length == 8? 2 : length / 0X10;
+}
+
+/* Store a segment, returns 1 if it completed a new text */
 static int
-set_hwformat(snd_pcm_t *handle, snd_pcm_hw_params_t *params) {
-  int err;
+assembleText(RdsText *t, int index, const unsigned char *chars) {
+  const int size = t->segmentSize;
+  const uint16_t bit = 1 << index;
+  char *segment = t->text + index*size;
+  int end = t->length, segments;
+  uint32_t mask;
+
+  if ((t->received & bit) && memcmp(segment, chars, size) == 0) {
+    t->stable |= bit;
+  } else {
+    memcpy(segment, chars, size);
+    t->received |= bit;
+    t->stable &= ~bit;
+  }
 
-  for (int i=0; i<NUMFORMATS; i++) {
-    err = snd_pcm_hw_params_set_format(handle, params, formats[i].format_id);
-    if (err == 0) {
-      format = i;
+  for (int i = 0; i < t->length; i++) {
+    if (t->text[i] == '\r' && (t->received & (1 << (i / size)))) {
+      end = i;
       break;
     }
   }
+  segments = (end < t->length? end : end - 1) / size + 1;
+  mask = (1UL << segments) - 1;
+  if ((t->stable & mask) != mask) return 0;
+
+  while (end > 0 && t->text[end-1] == ' ') end -= 1;
+  if (end == 0 || (strncmp(t->complete, t->text, end) == 0
+                   && t->complete[end] == 0))
+    return 0;
+  memcpy(t->complete, t->text, end);
+  t->complete[end] = 0;
+  return 1;
+}
+
+static void
+decodeGroup0A(RdsDecoder *dec, const unsigned char *groupData) {
+  char TP = (groupData[2] & 0x04) == 0X04;
+  char isTrafficAnnouncement = (groupData[3] & 0x10) == 0X10;
+  int index = (groupData[3] & 0x03) << 1;
+
+  if (TP && isTrafficAnnouncement != dec->ta) {
+    dec->ta = isTrafficAnnouncement;
+    rdsEvent(dec, RDS_EVENT_TA, dec->ta);
+  }
+  if (dec->thisProgram != NULL) dec->thisProgram->tp = TP;
+  if (assembleText(&dec->ps, index >> 1, groupData + 6)) {
+    if (dec->thisProgram != NULL)
+      strcpy(dec->thisProgram->name, dec->ps.complete);
+    if (dec->psBlock == 0) dec->psBlock = dec->blockCount;
+    textAcquired(&dec->health, 0, dec->blockCount);
+    rdsEvent(dec, RDS_EVENT_PS, dec->ps.complete);
+  }
+  switch (groupData[3]&0X03) {
+  case 3:
+    if (!dec->stereoKnown) {
+      dec->isStereo = ((groupData[3]&0X04)==0X04);
+      dec->stereoKnown = 1;
+      rdsEvent(dec, RDS_EVENT_STEREO, dec->isStereo);
+    }
+    if (dec->isStereo != ((groupData[3]&0X04)==0X04)) {
+      dec->isStereo = ((groupData[3]&0X04)==0X04);
+      rdsEvent(dec, RDS_EVENT_STEREO, dec->isStereo);
+    }
+    break;
+  }
 
-  return err;
+  if ((groupData[4]>=224)&&(groupData[4]<=249)) {
+    dec->freqCounter = groupData[4] - 224;
+    if (dec->freqCounter) {
+      if ((groupData[5]>=1) && ((groupData[5]<=204))) {
+        dec->freqCounter -= 1;
+        if (dec->thisProgram != NULL)
+          addAlternativeFrequency(dec->thisProgram, groupData[5]);
+      }
+    }
+  } else if (dec->freqCounter > 0) {
+    dec->freqCounter -= 2;
+    if (dec->thisProgram != NULL) {
+      addAlternativeFrequency(dec->thisProgram, groupData[4]);
+      addAlternativeFrequency(dec->thisProgram, groupData[5]);
+    }
+    if (dec->freqCounter <= 0 && verbose && dec->thisProgram != NULL) {
+      rdsPrintf(dec, "%d alternative frequencies\n", dec->thisProgram->afCount);
+    }
+  }
 }
 
-static int
-xrun_recovery(snd_pcm_t *handle, int err) {
-  if (err == -EPIPE) { /* under-run */
-    err = snd_pcm_prepare(handle);
-    if (err < 0)
-      printf("Can't recovery from underrun, prepare failed: %s\n",
-	     snd_strerror(err));
-  } else if (err == -EAGAIN) {
-    while ((err = snd_pcm_resume(handle)) == -EAGAIN)
-      usleep(100);	/* wait until the suspend flag is released */
-    if (err < 0) {
-      err = snd_pcm_prepare(handle);
-      if (err < 0)
-	printf("Can't recovery from suspend, prepare failed: %s\n",
-	       snd_strerror(err));
+/* 2A carries 4 characters of a 64 character text, 2B 2 of 32 */
+static void
+decodeRadioText(RdsDecoder *dec, const unsigned char *chars,
+                const unsigned char *groupData, int length) {
+  const int abFlag = (groupData[3]&0X10)==0X10;
+
+  if (abFlag != dec->rt.abFlag || length != dec->rt.length) {
+    /* A new text, forget the segments of the old one */
+    resetText(&dec->rt, length);
+    dec->rt.abFlag = abFlag;
+  }
+  if (assembleText(&dec->rt, groupData[3]&0X0F, chars)) {
+    textAcquired(&dec->health, 1, dec->blockCount);
+    rdsEvent(dec, RDS_EVENT_RADIOTEXT, dec->rt.complete);
+  }
+}
+
+static void
+decodeGroup2A(RdsDecoder *dec, const unsigned char *groupData) {
+  decodeRadioText(dec, groupData + 4, groupData, 4*0X10);
+}
+
+static void
+decodeGroup2B(RdsDecoder *dec, const unsigned char *groupData) {
+  decodeRadioText(dec, groupData + 6, groupData, 2*0X10);
+}
+
+static void
+decodeGroup3A(RdsDecoder *dec, const unsigned char *groupData) {
+  RDS_GroupType applicationGroup = groupData[3]&0X1F;
+  uint16_t aid = (groupData[6]<<8)|groupData[7];
+
+  /* 00000 means no group is used, 11111 signals a temporary data fault */
+  if (applicationGroup == TYPE_0A || applicationGroup == TYPE_15B) return;
+
+  for (int i = 0; i < odaDecoderCount; i++) {
+    if (odaDecoders[i].aid == aid) {
+      if (dec->groupDecoders[applicationGroup] != odaDecoders[i].decoder) {
+        if (verbose)
+          rdsPrintf(dec, "ODA %s (%04X) in group %d%c\n", odaDecoders[i].name, aid,
+                 applicationGroup>>1, (applicationGroup&1)? 'B' : 'A');
+        dec->groupDecoders[applicationGroup] = odaDecoders[i].decoder;
+      }
+      return;
     }
   }
-  return err;
+  if (verbose > 1)
+    rdsPrintf(dec, "ODA: AID=%04X, group %d%c\n", aid,
+           applicationGroup>>1, (applicationGroup&1)? 'B' : 'A');
 }
 
-static inline int
-set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
-             snd_pcm_access_t access, unsigned int rate, unsigned int channels,
-             unsigned int period, unsigned int nperiods) {
-  int err, dir=0;
-  unsigned int buffer_time;
-  unsigned int period_time;
-  unsigned int rrate;
+static void
+decodeGroup4A(RdsDecoder *dec, const unsigned char *groupData) {
+  const int monthDays[] = {31,28,31,30,31,30,31,31,30,31,30,31};
+  const int julianDate = ((groupData[3]&0X03)<<15)
+                       | (groupData[4]<<7)
+                       | (groupData[5]>>1);
+  int year = (int)(((double)julianDate - 15078.2)/365.25);
+  int month = (int)(((julianDate - 14956.1)-(int)(year*365.25))/30.6001);
+  int day = julianDate-14956-(int)(year*365.25)-(int)(month*30.6001);
+  int utcHour = ((groupData[5]&0X01)<<4)
+              | ((groupData[6]&0XF0)>>4);
+  int utcMinute = ((groupData[6]&0X0F)<<2)
+                | ((groupData[7]&0XC0)>>6);
+  int utcOffset = groupData[7]&0X1F;
+  int K = ((month == 14)||(month == 15))? 1 : 0;
+
+  if (groupData[7]&0X20) utcOffset = -utcOffset;
+
+  year = year + K + 1900;
+  month = month - 1 - (K*12);
+
+  { /* Calculate local time */
+    int localHour = utcHour;
+    int localMinute  = utcMinute + (utcOffset*30);
+
+    while (localMinute < 0) { localMinute += 60, localHour -= 1; }
+    while (localMinute >= 60) { localMinute -= 60, localHour += 1; }
+    if (localHour < 0) {
+      localHour += 24, day -= 1;
+      if (day < 1) {
+        month -= 1;
+        if (month < 1) {
+          month = 12;
+          year -= 1;
+        }
+        day = monthDays[month-1];
+        if (((year % 4) == 0) && (month == 2)) day = 29;
+      }
+    }
+    if (localHour >= 24) {
+      localHour -= 24, day += 1;
+      int maxDay = (((year%4)==0)&&(month==2))? 29 : monthDays[month-1];
+      if (day > maxDay) {
+        month += 1;
+        if (month > 12) {
+          month = 1, year += 1;
+        }
+      }
+    }
 
-  /* choose all parameters */
-  if ((err = snd_pcm_hw_params_any(handle, params)) == 0) {
-    if ((err = snd_pcm_hw_params_set_access(handle, params, access)) == 0) {
-      if ((err = set_hwformat(handle, params)) == 0) {
-	unsigned int rchannels = channels;
-	if ((err = snd_pcm_hw_params_set_channels_near(handle, params,
-						       &rchannels)) == 0) {
-	  if (rchannels != channels) {
-	    printf("WARNING: channel count does not match (requested %d got %d)\n",
-		   channels, rchannels);
-	    num_channels = rchannels;
-	  }
-	  rrate = rate;
-	  if ((err = snd_pcm_hw_params_set_rate_near(handle, params,
-						     &rrate, NULL)) >= 0) {
-	    if (rrate != rate) {
-	      printf("WARNING: Rate doesn't match (requested %iHz, get %iHz)\n", rate,
-		     rrate);
-	      inputSampleRate = rrate;
-	    }
-	    buffer_time = 1000000*(uint64_t)period*nperiods/rrate;
-            printf("buffer_time = %d\n", buffer_time);
-	    if ((err = snd_pcm_hw_params_set_buffer_time_near(handle, params,
-							      &buffer_time,
-							      &dir)) >= 0) {
-              snd_pcm_uframes_t real_buffer_size;
-	      if ((err = snd_pcm_hw_params_get_buffer_size(params,
-							   &real_buffer_size))
-		  >= 0) {
-                printf("Buffer size: %d\n", (int)real_buffer_size);
-		if (real_buffer_size != nperiods * period) {
-		  printf("WARNING: buffer size does not match: "
-			 "requested %d, got %d\n",
-			 nperiods * period, (int) real_buffer_size);
-		}
-		/* set the period time */
-		printf("period_time = %d\n", period_time = 1000000U*(uint64_t)period/rrate);
-		if ((err = snd_pcm_hw_params_set_period_time_near(handle,
-								  params,
-								  &period_time,
-								  &dir))
-		    == 0) {
-                  snd_pcm_uframes_t real_period_size;
-		  if ((err = snd_pcm_hw_params_get_period_size(params,
-							       &real_period_size, NULL))
-		      == 0) {
-                    printf("Period size: %d\n", (int)real_period_size);
-		    if (real_period_size != period) {
-		      printf("WARNING: period size does not match: "
-			     "requested %i, got %i\n",
-			     period, (int)real_period_size);
-		    }
+    rdsEvent(dec, RDS_EVENT_TIME, year, month, day, localHour, localMinute,
+             utcOffset*30);
+  }
+}
 
-		    /* write the parameters to device */
-		    if ((err = snd_pcm_hw_params(handle, params)) == 0) {
-                      if (verbose)
-                        printf("Input buffer time: %.1fms\n",
-                               1000.0/(rrate/(float)real_buffer_size));
-		      return 0;
-		    } else {
-		      printf("Unable to set hw params for capture: %s\n",
-			     snd_strerror(err));
-		    }
-		  } else {
-		    printf("Unable to get period size back: %s\n",
-                           snd_strerror(err));
-		  }
-		} else {
-		  printf("Unable to set period time %i for capture: %s\n",
-			 (int)(1000000*(uint64_t)period/rate),
-                         snd_strerror(err));
-		}
-	      } else {
-		printf("Unable to get buffer size back: %s\n",
-		       snd_strerror(err));
-	      }
-	    } else {
-	      printf("Unable to set buffer time %i for capture: %s\n",
-		     (int)(1000000*(uint64_t)period*nperiods/rate),
-                     snd_strerror(err));
-	    }
-	  } else {
-	    printf("Rate %iHz not available for playback: %s\n",
-		   rate, snd_strerror(err));
-	  }
-	} else {
-	  printf("Channels count (%i) not available for record: %s\n",
-		 channels, snd_strerror(err));
-	}
-      } else {
-	printf("Sample format not available for playback: %s\n",
-	       snd_strerror(err));
+/* Traffic Message Channel (ALERT-C)
+ *
+ * A message is either a single 8A group or a first group followed by up
+ * to four subsequent groups with the same continuity index.  These carry
+ * 28 bits each of optional label/value pairs, such as the duration and
+ * additional events.  Complete messages are kept while they are active,
+ * according to their duration, and a message which is received again
+ * only refreshes its expiry time.  So each message is reported once,
+ * when it starts or changes, and once more when it expires.
+ *
+ * Event and location descriptions are looked up in text tables with a
+ * CODE;TEXT line per entry, as can be cut from the ISO 14819 event list
+ * and a location table.  The files are mapped and indexed by a sorted
+ * array of code, offset and length.
+ */
+
+typedef struct {
+  uint16_t code;
+  uint16_t length;
+  uint32_t offset;
+} TmcEntry;
+
+typedef struct {
+  const char *text;
+  TmcEntry *entries;
+  int count;
+} TmcTable;
+
+static TmcTable tmcEvents, tmcLocations;
+
+static int
+compareTmcEntries(const void *a, const void *b) {
+  return (int)((const TmcEntry *)a)->code - (int)((const TmcEntry *)b)->code;
+}
+
+/**
+ * Map a CODE;TEXT table, lines which do not start with a code are
+ * skipped.  Returns 0 if the file cannot be read.
+ */
+static int
+loadTmcTable(TmcTable *table, const char *fileName) {
+  int fd = open(fileName, O_RDONLY);
+  struct stat st;
+  const char *text, *p, *end;
+  int capacity = 0;
+
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(fileName);
+    if (fd != -1) close(fd);
+    return 0;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+  text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED) {
+    perror(fileName);
+    return 0;
+  }
+
+  table->text = text;
+  for (p = text, end = text + st.st_size; p < end; ) {
+    const char *eol = memchr(p, '\n', end - p);
+    const char *q = p;
+    unsigned long code = 0;
+
+    if (eol == NULL) eol = end;
+    while (q < eol && *q >= '0' && *q <= '9') code = 10*code + (*q++ - '0');
+    if (q > p && q < eol && code <= UINT16_MAX
+     && (*q == ';' || *q == ',' || *q == '\t')) {
+      const char *description = ++q;
+
+      while (q < eol && *q != ';' && *q != '\t' && *q != '\r') q++;
+      if (table->count == capacity) {
+        TmcEntry *entries;
+
+        capacity = capacity? 2*capacity : 1024;
+        entries = realloc(table->entries, capacity*sizeof(*entries));
+        if (entries == NULL) {
+          fprintf(stderr, "no memory for %s\n", fileName);
+          return 0;
+        }
+        table->entries = entries;
+      }
+      table->entries[table->count].code = code;
+      table->entries[table->count].length = q - description;
+      table->entries[table->count].offset = description - text;
+      table->count += 1;
+    }
+    p = eol + 1;
+  }
+  qsort(table->entries, table->count, sizeof(*table->entries),
+        compareTmcEntries);
+  if (verbose) printf("%s: %d entries\n", fileName, table->count);
+
+  return 1;
+}
+
+static const TmcEntry *
+lookupTmc(const TmcTable *table, uint16_t code) {
+  const TmcEntry key = { .code = code };
+
+  if (table->count == 0) return NULL;
+  return bsearch(&key, table->entries, table->count, sizeof(key),
+                 compareTmcEntries);
+}
+
+/* Events and location as text, empty without tables */
+static void
+describeTmcMessage(const TmcMessage *m, char *out, size_t size) {
+  const TmcEntry *entry;
+  size_t n = 0;
+
+  out[0] = 0;
+  for (int i = 0; i < m->eventCount && n < size; i++) {
+    if ((entry = lookupTmc(&tmcEvents, m->events[i])) != NULL) {
+      n += snprintf(out + n, size - n, "%s%.*s", n? "; " : "",
+                    entry->length, tmcEvents.text + entry->offset);
+    }
+  }
+  if (n < size && (entry = lookupTmc(&tmcLocations, m->location)) != NULL) {
+    snprintf(out + n, size - n, "%s%.*s", n? " at " : "",
+             entry->length, tmcLocations.text + entry->offset);
+  }
+}
+
+/* Lifetime of a message by its duration code, 7 is the rest of the day */
+static uint64_t
+tmcLifetime(int duration) {
+  static const int minutes[8] = { 15, 15, 30, 60, 120, 180, 240, 0 };
+
+  if (duration == 7) {
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    return (86400 - (tm.tm_hour*3600 + tm.tm_min*60 + tm.tm_sec)) * 1000ULL;
+  }
+  return minutes[duration & 7] * 60000ULL;
+}
+
+static void
+reportTmcMessage(RdsDecoder *dec, const TmcMessage *m) {
+  char text[256];
+
+  describeTmcMessage(m, text, sizeof(text));
+  rdsEvent(dec, RDS_EVENT_TMC, m->events[0], m->location, m->direction,
+           m->extent, m->duration, m->diversion, text);
+}
+
+static void
+removeTmcMessage(RdsDecoder *dec, int i) {
+  const TmcMessage *m = &dec->tmc.active[i];
+
+  rdsEvent(dec, RDS_EVENT_TMC_EXPIRED, m->events[0], m->location, m->direction);
+  dec->tmc.active[i] = dec->tmc.active[--dec->tmc.activeCount];
+}
+
+static void
+expireTmcMessages(RdsDecoder *dec, uint64_t now) {
+  for (int i = 0; i < dec->tmc.activeCount; ) {
+    if (dec->tmc.active[i].expires <= now) removeTmcMessage(dec, i);
+    else i++;
+  }
+}
+
+static int
+sameTmcContent(const TmcMessage *a, const TmcMessage *b) {
+  if (a->eventCount != b->eventCount || a->extent != b->extent
+   || a->diversion != b->diversion || a->duration != b->duration) return 0;
+  for (int i = 0; i < a->eventCount; i++) {
+    if (a->events[i] != b->events[i]) return 0;
+  }
+  return 1;
+}
+
+/* Messages about the same event at the same place replace each other */
+static void
+activateTmcMessage(RdsDecoder *dec, TmcMessage *m) {
+  const uint64_t now = monotonicTime() / 1000000;
+  int i, soonest = 0;
+
+  m->expires = now + tmcLifetime(m->duration);
+  for (i = 0; i < dec->tmc.activeCount; i++) {
+    TmcMessage *active = &dec->tmc.active[i];
+
+    if (active->location == m->location && active->direction == m->direction
+     && active->events[0] == m->events[0]) {
+      if (!sameTmcContent(active, m)) reportTmcMessage(dec, m);
+      *active = *m;
+      return;
+    }
+    if (active->expires < dec->tmc.active[soonest].expires) soonest = i;
+  }
+  if (dec->tmc.activeCount == TMC_MAX_MESSAGES) removeTmcMessage(dec, soonest);
+  dec->tmc.active[dec->tmc.activeCount++] = *m;
+  reportTmcMessage(dec, m);
+}
+
+static uint32_t
+tmcBits(const TmcAssembly *a, int position, int length) {
+  uint32_t value = 0;
+
+  for (int i = position; i < position + length; i++) {
+    value = (value << 1) | ((a->chunks[i / 28] >> (27 - i % 28)) & 1);
+  }
+  return value;
+}
+
+/* Apply the optional content of the subsequent groups */
+static void
+decodeTmcFreeFormat(TmcAssembly *a) {
+  static const uint8_t labelBits[16] = {
+    3, 3, 5, 5, 5, 8, 8, 8, 8, 11, 16, 16, 16, 16, 0, 0
+  };
+  const int bits = 28*a->chunkCount;
+  int position = 0;
+
+  while (position + 4 <= bits) {
+    int label, zeros = 1;
+
+    /* Unused bits at the end are zero */
+    for (int i = position; i < bits && zeros; i++) {
+      zeros = tmcBits(a, i, 1) == 0;
+    }
+    if (zeros) break;
+    label = tmcBits(a, position, 4);
+    position += 4;
+    if (label == 15 || position + labelBits[label] > bits) break;
+    switch (label) {
+    case 0:
+      a->message.duration = tmcBits(a, position, 3);
+      break;
+    case 9:
+      if (a->message.eventCount < TMC_MAX_EVENTS)
+        a->message.events[a->message.eventCount++] = tmcBits(a, position, 11);
+      break;
+    }
+    position += labelBits[label];
+  }
+}
+
+static void
+decodeGroup8A(RdsDecoder *dec, const unsigned char *groupData) {
+  const int tuning = (groupData[3]&0X10)==0X10;
+  const int single = (groupData[3]&0X08)==0X08;
+  const int CI = groupData[3]&0X07;
+  TmcMessage m = {
+    .events = { ((groupData[4]&0X07)<<8)|groupData[5] },
+    .eventCount = 1,
+    .location = groupData[6]<<8|groupData[7],
+    .extent = (groupData[4]&0X38)>>3,
+    .direction = (groupData[4]&0X40)==0X40
+  };
+
+  if (tuning) {
+    if (verbose) rdsPrintf(dec, "TMC: system/tuning information %X, "
+                           "%02X%02X%02X%02X\n", groupData[3]&0X0F,
+                           groupData[4], groupData[5], groupData[6],
+                           groupData[7]);
+    return;
+  }
+  expireTmcMessages(dec, monotonicTime() / 1000000);
+
+  if (single) {
+    m.diversion = (groupData[4]&0X80)==0X80;
+    m.duration = CI;
+    activateTmcMessage(dec, &m);
+  } else if (groupData[4]&0X80) {
+    TmcAssembly *a = &dec->tmc.assembly[CI];
+
+    memset(a, 0, sizeof(*a));
+    a->receiving = 1;
+    a->message = m;
+  } else {
+    TmcAssembly *a = &dec->tmc.assembly[CI];
+    const int second = (groupData[4]&0X40)==0X40;
+    const int remaining = (groupData[4]&0X30)>>4;
+
+    if (!a->receiving) return;
+    if ((second? a->chunkCount != 0
+               : a->chunkCount == 0 || remaining != a->remaining - 1)
+     || a->chunkCount == TMC_MAX_SUBSEQUENT) {
+      /* A group was missed */
+      a->receiving = 0;
+      return;
+    }
+    a->chunks[a->chunkCount++] = ((groupData[4]&0X0F)<<24) | (groupData[5]<<16)
+                               | (groupData[6]<<8) | groupData[7];
+    a->remaining = remaining;
+    if (remaining == 0) {
+      decodeTmcFreeFormat(a);
+      activateTmcMessage(dec, &a->message);
+      a->receiving = 0;
+    }
+  }
+}
+
+static void
+decodeGroup14A(RdsDecoder *dec, const unsigned char *groupData) {
+  int TPON = (groupData[3]&0X10)==0X10;
+  int variantType = groupData[3]&0X0F;
+  int info = (groupData[4]<<8)|(groupData[5]);
+  int PION = (groupData[6]<<8)|(groupData[7]);
+  ProgramData *otherProgram = getProgram(dec->tuner->programs, PION);
+  switch (variantType) {
+  case 0:
+  case 1:
+  case 2:
+  case 3: {
+    otherProgram->name[2*variantType] = groupData[4];
+    otherProgram->name[2*variantType+1] = groupData[5];
+    break;
+  }
+  case 5: {
+    uint8_t lsb = groupData[5];
+    uint8_t msb = groupData[4];
+    if (dec->thisProgram != NULL
+     && EONAF_handleFrequencyPair(dec->tuner,
+                                  dec->thisProgram, otherProgram,
+                                  ((100*(msb-1))+87600)/1000.0,
+                                  ((100*(lsb-1))+87600)/1000.0)) {
+      rdsEvent(dec, RDS_EVENT_EON_FREQ, PION,
+               (int)(otherProgram->freq*1000 + .5), otherProgram->name);
+    }
+    break;
+  }
+  case 0XD: {
+    int TAON = groupData[5]&0X01;
+    if (TPON && TAON) {
+      if (TAON != otherProgram->ta) {
+        rdsEvent(dec, RDS_EVENT_EON_TA, PION, TAON, otherProgram->name);
+        otherProgram->ta = TAON;
+      }
+    }
+    break;
+  }
+  default:
+    if (verbose) rdsPrintf(dec, "EON: TPON=%d, v=%X, info=%X, PION=%X\n",
+                        TPON, variantType, info, PION);
+
+    break;
+  }
+}
+
+/* RadioText Plus tags ranges of the current RadioText */
+
+static void
+decodeRtPlusTag(RdsDecoder *dec, int n, int type, int start, int length) {
+  char tag[4*0X10 + 1];
+
+  if (type == 0 || start + length > 4*0X10) return;
+  if (start + length > strlen(dec->rt.complete)) return;
+  memcpy(tag, dec->rt.complete + start, length);
+  tag[length] = 0;
+  if (strcmp(tag, dec->rtPlus.tag[n]) != 0) {
+    strcpy(dec->rtPlus.tag[n], tag);
+    rdsEvent(dec, RDS_EVENT_RTPLUS, type, tag);
+  }
+}
+
+static void
+decodeRtPlus(RdsDecoder *dec, const unsigned char *groupData) {
+  const char toggle = (groupData[3]&0X10)==0X10;
+  const char running = (groupData[3]&0X08)==0X08;
+  const int type1 = ((groupData[3]&0X07)<<3) | (groupData[4]>>5);
+  const int start1 = ((groupData[4]&0X1F)<<1) | (groupData[5]>>7);
+  const int length1 = ((groupData[5]>>1)&0X3F) + 1;
+  const int type2 = ((groupData[5]&0X01)<<5) | (groupData[6]>>3);
+  const int start2 = ((groupData[6]&0X07)<<3) | (groupData[7]>>5);
+  const int length2 = (groupData[7]&0X1F) + 1;
+
+  if (toggle != dec->rtPlus.toggle) {
+    dec->rtPlus.toggle = toggle;
+    dec->rtPlus.tag[0][0] = dec->rtPlus.tag[1][0] = 0;
+  }
+  if (!running) return;
+  decodeRtPlusTag(dec, 0, type1, start1, length1);
+  decodeRtPlusTag(dec, 1, type2, start2, length2);
+}
+
+static void
+dumpGroup(RdsDecoder *dec, const unsigned char *groupData) {
+  rdsPrintf(dec, "Group(%X): %02X%02X-%02X%02X-%02X%02X-%02X%02X\n",
+         dec->groupType,
+         groupData[0], groupData[1], groupData[2], groupData[3],
+         groupData[4], groupData[5], groupData[6], groupData[7]);
+}
+
+static void
+setupGroupDecoders() {
+  if (verbose > 1) {
+    for (int i = 0; i < RDS_GROUP_TYPES; i++)
+      registerGroupDecoder(i, dumpGroup);
+  }
+  registerGroupDecoder(TYPE_0A, decodeGroup0A);
+  registerGroupDecoder(TYPE_2A, decodeGroup2A);
+  registerGroupDecoder(TYPE_2B, decodeGroup2B);
+  registerGroupDecoder(TYPE_3A, decodeGroup3A);
+  registerGroupDecoder(TYPE_4A, decodeGroup4A);
+  registerGroupDecoder(TYPE_8A, decodeGroup8A);
+  registerGroupDecoder(TYPE_14A, decodeGroup14A);
+
+  registerOdaDecoder(0X4BD7, "RT+", decodeRtPlus);
+}
+
+static void
+initRdsDecoder(RdsDecoder *dec, Tuner *tuner) {
+  memset(dec, 0, sizeof(*dec));
+  dec->tuner = tuner;
+  memcpy(dec->groupDecoders, groupDecoders, sizeof(dec->groupDecoders));
+  resetText(&dec->ps, 8);
+  resetText(&dec->rt, 4*0X10);
+}
+
+static void
+freeRdsDecoder(RdsDecoder *dec) {
+  /* The decoder owns no memory at the moment */
+}
+
+/* Repeat suppression
+ *
+ * Stations repeat every group all the time, interleaved with others, so
+ * the decoders would mostly see what they already know.  Groups decoded
+ * in the last RDS_REPEAT_TIMEOUT are kept in a hash table by content.
+ * Immediate repeats are always dropped.  The first repeat after other
+ * groups is still decoded, since the text assembler trusts a segment
+ * only once it arrived twice; later ones are skipped until the entry is
+ * older than the timeout.  The time is counted in blocks, i.e. on air,
+ * so replays behave like live reception.
+ */
+
+static inline RdsGroupCacheEntry *
+groupCacheEntry(RdsDecoder *dec, const unsigned char *groupData) {
+  uint64_t key;
+
+  memcpy(&key, groupData, sizeof(key));
+  return &dec->groupCache[(key * 0X9E3779B97F4A7C15ULL) >> 56
+                          & (RDS_GROUP_CACHE - 1)];
+}
+
+/* Whether the group can be skipped, remembers it otherwise */
+static int
+repeatedGroup(RdsDecoder *dec, const unsigned char *groupData) {
+  RdsGroupCacheEntry *e = groupCacheEntry(dec, groupData);
+
+  if (memcmp(groupData, dec->lastGroupData, sizeof(dec->lastGroupData)) == 0)
+    return 1;
+  memcpy(dec->lastGroupData, groupData, sizeof(dec->lastGroupData));
+  if (memcmp(e->data, groupData, sizeof(e->data)) == 0
+      && dec->blockCount - e->block < RDS_REPEAT_TIMEOUT) {
+    return e->repeats++ > 0;
+  }
+  memcpy(e->data, groupData, sizeof(e->data));
+  e->block = dec->blockCount;
+  e->repeats = 0;
+  return 0;
+}
+
+/**
+ * Feed one block into the group assembler, the group decoder is invoked
+ * once block D has been received.
+ */
+static void
+decodeRdsBlock(RdsDecoder *dec, const struct rds_data *rdsData) {
+  int blockNumber = rdsData->block & 0X07;
+  int error = (rdsData->block&0X80)==0X80;
+
+  dec->blockCount += 1;
+
+  if (error) {
+    dec->errorCount += 1;
+    if (verbose) rdsPrintf(dec, "%d dropped, %d recovered in %d blocks so far\n",
+                        dec->errorCount, dec->recoveredCount, dec->blockCount);
+    return;
+  }
+  if (rdsData->block & 0X40) dec->recoveredCount += 1;
+
+  if (blockNumber == 0) {
+    Tuner *t = dec->tuner;
+    ProgramData *pd = getProgram(t->programs, rdsData->msb<<8|rdsData->lsb);
+
+    if (pd != dec->textProgram) {
+      /* Another station, its texts start from scratch */
+      if (dec->textProgram != NULL) {
+        resetText(&dec->ps, 8);
+        resetText(&dec->rt, dec->rt.length);
+        dec->ps.complete[0] = dec->rt.complete[0] = 0;
+        /* or its segments would be skipped as repeats of what was cached
+         * when it was last received
+         */
+        memset(dec->groupCache, 0, sizeof(dec->groupCache));
+        memset(dec->lastGroupData, 0, sizeof(dec->lastGroupData));
+      }
+      dec->textProgram = pd;
+      startAcquisition(&dec->health, pd->id, dec->blockCount);
+    }
+    dec->thisProgram = pd;
+    setProgramFrequency(t->programs, dec->thisProgram, t->currentFrequency);
+  }
+  if (blockNumber == 1) {
+    int ptyCode = ((rdsData->msb << 3) & 0X18) | ((rdsData->lsb >> 5) & 0X07);
+    ProgramData *thisProgram = dec->thisProgram;
+
+    if (thisProgram != NULL && ptyCode != 0) {
+      if (thisProgram->type != ptyCode) {
+        thisProgram->type = ptyCode;
+        if (ptyCode > 0) rdsEvent(dec, RDS_EVENT_PTY, ptyCode);
       }
+    }
+    dec->groupType = (RDS_GroupType)rdsData->msb>>3;
+  }
+  if (blockNumber == 4) blockNumber = 2; /* C' */
+  if (blockNumber > 3) return;
+  dec->groupData[2*blockNumber] = rdsData->msb;
+  dec->groupData[2*blockNumber+1] = rdsData->lsb;
+  if (blockNumber == 3) {
+    dec->groupCount += 1;
+    if (repeatedGroup(dec, dec->groupData)) {
+      dec->repeatCount += 1;
     } else {
-      printf("Access type not available for capture: %s\n", snd_strerror(err));
+      RdsGroupDecoder decoder = dec->groupDecoders[dec->groupType];
+      if (decoder != NULL) decoder(dec, dec->groupData);
+    }
+    memset(dec->groupData, 0, sizeof(dec->groupData));
+  }
+}
+
+/* Block synchronisation and error correction for raw RDS bitstreams
+ *
+ * The si470x corrects blocks in hardware and only reports the result,
+ * but a raw stream (for instance demodulated by an SDR) still carries
+ * the 10 bit checkword of each 26 bit block.  The checkword is the
+ * remainder of the data word times x^10 modulo the generator polynomial
+ * plus an offset word identifying the block position, so the remainder
+ * of a received block is its offset word exactly when it is error free.
+ * Otherwise the difference is looked up in a table of the syndromes of
+ * all error bursts up to 5 bits long, which the code corrects uniquely.
+ */
+
+#define RDS_POLY 0X5B9 /* x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1 */
+#define RDS_BLOCK_BITS 26
+#define RDS_MAX_BURST 5
+#define RDS_SYNC_LOSS 10 /* consecutive uncorrectable blocks */
+
+/* Indexed by V4L2 block number, A, B, C, D and C' */
+static const uint16_t rdsOffsetWords[5] = {
+  0X0FC, 0X198, 0X168, 0X1B4, 0X350
+};
+
+static uint32_t rdsErrorPatterns[1 << 10];
+
+static uint16_t
+rdsSyndrome(uint32_t block) {
+  for (int bit = RDS_BLOCK_BITS - 1; bit >= 10; bit--)
+    if (block & (1UL << bit)) block ^= (uint32_t)RDS_POLY << (bit - 10);
+  return block & 0X3FF;
+}
+
+static void
+setupRdsErrorPatterns() {
+  for (int length = 1; length <= RDS_MAX_BURST; length++) {
+    const uint32_t ends = (1U << (length - 1)) | 1;
+    for (uint32_t inner = 0; inner < (length > 2? 1U << (length - 2) : 1); inner++) {
+      const uint32_t burst = ends | (inner << 1);
+      for (int shift = 0; shift <= RDS_BLOCK_BITS - length; shift++) {
+        const uint16_t syndrome = rdsSyndrome(burst << shift);
+        if (rdsErrorPatterns[syndrome] == 0)
+          rdsErrorPatterns[syndrome] = burst << shift;
+      }
+    }
+  }
+}
+
+typedef struct {
+  uint32_t reg;        /* the last 26 bits received */
+  unsigned long bitCount;
+  unsigned long lastSeen[5]; /* bit position an offset word was last seen at */
+  int synced;
+  int bits;            /* bits since the last block boundary */
+  int expected;        /* block number expected next */
+  int badBlocks;
+} RdsSync;
+
+/* Distance between block positions in the A, B, C, D cycle */
+static inline int
+rdsBlockDistance(int from, int to) {
+  if (from == 4) from = 2;
+  if (to == 4) to = 2;
+  return (to - from + 4) % 4;
+}
+
+/**
+ * Check and correct the block in the shift register, returning the
+ * V4L2 block byte for it.
+ */
+static uint8_t
+correctRdsBlock(RdsSync *sync, uint32_t *block) {
+  const uint16_t syndrome = rdsSyndrome(*block);
+  int blockNumber = sync->expected;
+
+  if (blockNumber == 2 && syndrome == rdsOffsetWords[4]) blockNumber = 4;
+  if (syndrome == rdsOffsetWords[blockNumber]) return blockNumber;
+
+  {
+    uint32_t pattern = rdsErrorPatterns[syndrome ^ rdsOffsetWords[blockNumber]];
+
+    if (pattern == 0 && blockNumber == 2) {
+      pattern = rdsErrorPatterns[syndrome ^ rdsOffsetWords[4]];
+      if (pattern) blockNumber = 4;
+    }
+    if (pattern) {
+      *block ^= pattern;
+      return blockNumber | 0X40;
+    }
+  }
+
+  return blockNumber | 0X80;
+}
+
+static void
+rdsSyncBit(RdsSync *sync, RdsDecoder *dec, int bit) {
+  sync->reg = ((sync->reg << 1) | bit) & ((1UL << RDS_BLOCK_BITS) - 1);
+  sync->bitCount += 1;
+
+  if (!sync->synced) {
+    const uint16_t syndrome = rdsSyndrome(sync->reg);
+
+    if (sync->bitCount < RDS_BLOCK_BITS) return;
+    for (int n = 0; n < 5; n++) {
+      if (syndrome != rdsOffsetWords[n]) continue;
+      /* Two offset words at matching distance establish synchronisation */
+      for (int m = 0; m < 5; m++) {
+        unsigned long distance = sync->bitCount - sync->lastSeen[m];
+        int blocks = rdsBlockDistance(m, n);
+        if (sync->lastSeen[m] && blocks
+         && distance == (unsigned long)blocks * RDS_BLOCK_BITS) {
+          if (verbose) printf("RDS sync acquired at bit %lu\n", sync->bitCount);
+          sync->synced = 1;
+          sync->expected = (n == 4)? 3 : (n + 1) % 4;
+          sync->bits = 0;
+          sync->badBlocks = 0;
+          break;
+        }
+      }
+      sync->lastSeen[n] = sync->bitCount;
+      if (sync->synced) {
+        struct rds_data rdsData = {
+          .lsb = (sync->reg >> 10) & 0XFF, .msb = (sync->reg >> 18) & 0XFF,
+          .block = n
+        };
+        decodeRdsBlock(dec, &rdsData);
+      }
+      return;
+    }
+  } else if (++sync->bits == RDS_BLOCK_BITS) {
+    uint32_t block = sync->reg;
+    struct rds_data rdsData;
+
+    rdsData.block = correctRdsBlock(sync, &block);
+    rdsData.lsb = (block >> 10) & 0XFF;
+    rdsData.msb = (block >> 18) & 0XFF;
+    sync->bits = 0;
+    sync->expected = (sync->expected + 1) % 4;
+    if (rdsData.block & 0X80) {
+      if (++sync->badBlocks >= RDS_SYNC_LOSS) {
+        if (verbose) printf("RDS sync lost at bit %lu\n", sync->bitCount);
+        memset(sync->lastSeen, 0, sizeof(sync->lastSeen));
+        sync->synced = 0;
+      }
+    } else {
+      sync->badBlocks = 0;
+    }
+    decodeRdsBlock(dec, &rdsData);
+  }
+}
+
+/**
+ * Decode a raw RDS bitstream given as ASCII '0' and '1' characters,
+ * anything else in the input is ignored.
+ */
+static int
+decodeRawRds(const char *fileName) {
+  int fd = strcmp(fileName, "-") == 0? STDIN_FILENO : open(fileName, O_RDONLY);
+  ProgramTable programs;
+  Tuner tuner = { .device = fileName, .fd = -1, .programs = &programs };
+  RdsDecoder decoder;
+  RdsSync sync;
+  char buffer[4096];
+  ssize_t count;
+
+  if (fd == -1) {
+    perror(fileName);
+    return 0;
+  }
+
+  setupGroupDecoders();
+  setupRdsErrorPatterns();
+  initProgramTable(&programs);
+  initRdsDecoder(&decoder, &tuner);
+  memset(&sync, 0, sizeof(sync));
+
+  while ((count = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (count == -1) {
+      if (errno == EINTR) continue;
+      perror("read");
+      break;
+    }
+    for (ssize_t i = 0; i < count; i++) {
+      if (buffer[i] == '0' || buffer[i] == '1')
+        rdsSyncBit(&sync, &decoder, buffer[i] - '0');
+    }
+    flushEventSink();
+  }
+
+  rdsPrintf(&decoder, "%d blocks, %d recovered, %d dropped, "
+            "%d of %d groups repeated\n", decoder.blockCount,
+            decoder.recoveredCount, decoder.errorCount, decoder.repeatCount,
+            decoder.groupCount);
+  closeEventSink();
+  freeRdsDecoder(&decoder);
+  if (fd != STDIN_FILENO) close(fd);
+  return count == 0;
+}
+
+/* The driver buffers RDS blocks, so drain as many triplets as it has
+ * queued with a single read() instead of one syscall per block.
+ */
+typedef struct {
+  union {
+    struct rds_data blocks[RDS_READ_BLOCKS];
+    uint8_t bytes[RDS_READ_BLOCKS*sizeof(struct rds_data)];
+  } buffer;
+  size_t fill;
+  FILE *capture; /* receives everything read if not NULL */
+} RdsReadBuffer;
+
+/**
+ * Read what the driver has queued and decode all complete blocks, a
+ * trailing partial triplet is kept for the next read.  Returns the
+ * result of read().
+ */
+static ssize_t
+readRdsBlocks(int fd, RdsReadBuffer *rds, RdsDecoder *dec) {
+  ssize_t count = read(fd, rds->buffer.bytes + rds->fill,
+                       sizeof(rds->buffer) - rds->fill);
+
+  if (count > 0) {
+    const int blocksRead = (rds->fill + count) / sizeof(struct rds_data);
+    const size_t used = blocksRead * sizeof(struct rds_data);
+
+    if (rds->capture != NULL)
+      fwrite(rds->buffer.bytes + rds->fill, 1, count, rds->capture);
+    rds->fill += count;
+    for (int b = 0; b < blocksRead; b++)
+      decodeRdsBlock(dec, &rds->buffer.blocks[b]);
+    memmove(rds->buffer.bytes, rds->buffer.bytes + used, rds->fill - used);
+    rds->fill -= used;
+  }
+  return count;
+}
+
+/* Drop blocks which were queued before the last tune */
+static void
+discardRdsBlocks(int fd) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  char buffer[RDS_READ_BLOCKS*sizeof(struct rds_data)];
+
+  while (poll(&pfd, 1, 0) == 1 && read(fd, buffer, sizeof(buffer)) > 0);
+}
+
+/* Forget what belongs to the station received in the last epoch */
+static void
+newRdsEpoch(RdsDecoder *dec, unsigned int epoch) {
+  dec->epoch = epoch;
+  dec->thisProgram = NULL;
+  dec->freqCounter = 0;
+  memset(dec->groupData, 0, sizeof(dec->groupData));
+  memset(dec->lastGroupData, 0, sizeof(dec->lastGroupData));
+  /* A station tuned back to would have its groups skipped as repeats */
+  memset(dec->groupCache, 0, sizeof(dec->groupCache));
+  memset(dec->tmc.assembly, 0, sizeof(dec->tmc.assembly));
+  /* Texts of the station before which were not complete never will be */
+  dec->health.acquiring = NULL;
+}
+
+/* Alternative frequencies
+ *
+ * The AF lists of 0A groups are kept with each program.  Once the signal
+ * drops below afSwitchSignal the tuner moves to the strongest alternative
+ * of the program it is receiving.  Measurements are remembered for each
+ * frequency for AF_QUALITY_LIFETIME.  A check switches to the best one
+ * measured lately, or else probes the alternative measured longest ago,
+ * so there is at most one short tune away per AF_CHECK_INTERVAL.
+ */
+
+#define AF_CHECK_INTERVAL 1000    /* ms */
+#define AF_QUALITY_LIFETIME 30000 /* ms */
+#define AF_SWITCH_MARGIN 0X0800   /* of 0XFFFF, over the current signal */
+#define AF_TUNE_TIMEOUT 100       /* ms until the tuner reports the channel */
+#define AF_SETTLE_TIME 20         /* ms for the RSSI after the tune */
+
+static int afSwitchSignal = 0; /* of 0XFFFF, 0 turns switching off */
+
+/**
+ * Tune to freq and measure its signal once the tune has completed,
+ * returns -1 if it could not be tuned or measured.
+ */
+static int
+probeTunerSignal(Tuner *t, float freq, int *stereo) {
+  const uint64_t start = monotonicTime() / 1000000;
+  float tuned;
+
+  setTunerFrequency(t, freq);
+  if (t->currentFrequency != freq) return -1;
+  /* The driver may give up waiting for the seek/tune complete bit, the
+   * channel read back only changes once it is set
+   */
+  while ((tuned = getTunerFrequency(t)) < freq-.01 || tuned > freq+.01) {
+    if (monotonicTime() / 1000000 - start >= AF_TUNE_TIMEOUT) return -1;
+    usleep(5000);
+  }
+  usleep(AF_SETTLE_TIME*1000);
+  return getTunerSignal(t, stereo);
+}
+
+/**
+ * Sample the signal at most every AF_CHECK_INTERVAL and switch to an
+ * alternative frequency if it is too weak.  rds is the buffer the tuner
+ * is read into, NULL if it is read on a thread of its own.
+ */
+static void
+checkAlternativeFrequencies(Tuner *t, RdsDecoder *dec, RdsReadBuffer *rds) {
+  const uint64_t now = monotonicTime() / 1000000;
+  const float current = t->currentFrequency;
+  const int currentCode = afCode(current);
+  ProgramData *pd = dec->thisProgram;
+  int signal, stereo, best = 0, bestSignal, stale = 0, probed = 0;
+
+  if (afSwitchSignal == 0 || now - t->afChecked < AF_CHECK_INTERVAL) return;
+  t->afChecked = now;
+  if ((signal = getTunerSignal(t, &stereo)) < 0) return;
+  if (currentCode) {
+    t->afQuality[currentCode].signal = signal;
+    t->afQuality[currentCode].sampled = now;
+  }
+  /* The program must have been received here, not before the last tune */
+  if (signal >= afSwitchSignal || pd == NULL || pd->afCount == 0
+   || pd->freq < current-.04 || pd->freq > current+.04) return;
+
+  bestSignal = signal + AF_SWITCH_MARGIN;
+  for (int i = 0; i < pd->afCount; i++) {
+    const int code = pd->af[i];
+    const float freq = afFrequency(code);
+
+    if (code == currentCode || freq < t->minFrequency || freq > t->maxFrequency)
+      continue;
+    if (t->afQuality[code].sampled == 0
+     || now - t->afQuality[code].sampled > AF_QUALITY_LIFETIME) {
+      if (stale == 0
+       || t->afQuality[code].sampled < t->afQuality[stale].sampled)
+        stale = code;
+    } else if (t->afQuality[code].signal > bestSignal) {
+      best = code;
+      bestSignal = t->afQuality[code].signal;
+    }
+  }
+  if (best == 0 && stale) {
+    const int probe = probeTunerSignal(t, afFrequency(stale), &stereo);
+
+    probed = 1;
+    if (probe >= 0) {
+      t->afQuality[stale].signal = probe;
+      t->afQuality[stale].sampled = now;
+      if (probe > bestSignal) {
+        best = stale;
+        bestSignal = probe;
+      }
+    }
+  }
+
+  if (best) {
+    rdsEvent(dec, RDS_EVENT_AF_SWITCH, (int)(current*1000 + .5),
+             (int)(afFrequency(best)*1000 + .5), signal, bestSignal, pd->name);
+    if (t->currentFrequency != afFrequency(best))
+      setTunerFrequency(t, afFrequency(best));
+  } else if (probed) {
+    setTunerFrequency(t, current);
+  } else {
+    return;
+  }
+  /* Without a read buffer the blocks are read by rdsIntakeThread(),
+   * which drops them by the tune epoch
+   */
+  if (rds != NULL) {
+    discardRdsBlocks(t->fd);
+    rds->fill = 0;
+    newRdsEpoch(dec, t->tuneEpoch);
+  }
+}
+
+/**
+ * Decode a capture of struct rds_data triplets as written by -W, as fast
+ * as possible, and report decoder throughput.  Returns 0 on read errors.
+ */
+static int
+replayRds(const char *fileName) {
+  int fd = strcmp(fileName, "-") == 0? STDIN_FILENO : open(fileName, O_RDONLY);
+  ProgramTable programs;
+  Tuner tuner = { .device = fileName, .fd = -1, .programs = &programs };
+  RdsReadBuffer rds = { .fill = 0 };
+  RdsDecoder decoder;
+  ssize_t count;
+  uint64_t start;
+  double seconds;
+
+  if (fd == -1) {
+    perror(fileName);
+    return 0;
+  }
+
+  setupGroupDecoders();
+  initProgramTable(&programs);
+  initRdsDecoder(&decoder, &tuner);
+
+  start = monotonicTime();
+  while ((count = readRdsBlocks(fd, &rds, &decoder)) != 0) {
+    if (count == -1) {
+      if (errno == EINTR) continue;
+      perror("read");
+      break;
+    }
+    flushEventSink();
+  }
+  seconds = (monotonicTime() - start) / 1e9;
+
+  closeEventSink();
+  fprintf(stderr, "%d blocks, %d groups in %.3fs: %.0f blocks/s, "
+          "%.0f groups/s (%.0fx real time)\n",
+          decoder.blockCount, decoder.groupCount, seconds,
+          decoder.blockCount / seconds, decoder.groupCount / seconds,
+          decoder.blockCount / RDS_BLOCKS_PER_SECOND / seconds);
+  fprintf(stderr, "%d groups skipped as repeats (%.0f%%)\n",
+          decoder.repeatCount, decoder.groupCount?
+          100.0 * decoder.repeatCount / decoder.groupCount : 0.0);
+  if (decoder.psBlock)
+    fprintf(stderr, "PS complete after %d blocks (%.1fs on air)\n",
+            decoder.psBlock, decoder.psBlock / RDS_BLOCKS_PER_SECOND);
+  else
+    fprintf(stderr, "PS never complete\n");
+  freeRdsDecoder(&decoder);
+  if (fd != STDIN_FILENO) close(fd);
+  return count == 0;
+}
+
+static FILE *rdsCapture = NULL; /* for decodeRds(), see -W */
+
+/* Interactive reception
+ *
+ * Three threads share the work, so that neither keyboard input nor a
+ * slow tune ever delays reading the radio device:
+ *
+ * - rdsIntakeThread() reads the blocks, stamps them with the time and
+ *   the tune epoch and passes them on through a pipe.
+ * - The decoder, on the calling thread, drops blocks of an epoch which
+ *   is over and starts station state afresh in a new one.  It also runs
+ *   the requests queued by the control thread and serves the control
+ *   socket (-U), tuning included.
+ * - controlThread() turns keys on stdin into requests on a second pipe.
+ *
+ * Blocks read while a tune was in progress belong to no epoch and are
+ * dropped, and so is what the driver had queued when a new epoch began.
+ */
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_CLIENTS 8
+#define CONTROL_LINE_MAX 128
+#define CONTROL_REPLY_MAX 0X10000
+#define FREQUENCY_STEP .05
+
+typedef struct {
+  struct rds_data data;
+  unsigned int epoch;
+  uint64_t time; /* monotonicTime() when it was read */
+} RdsBlock;
+
+typedef enum {
+  CONTROL_TUNE, CONTROL_STEP, CONTROL_NEXT
+} ControlCommand;
+
+typedef struct {
+  ControlCommand command;
+  float value; /* MHz to tune to or step by */
+} ControlRequest;
+
+typedef struct {
+  Tuner *tuner;
+  RdsReadBuffer rds;
+  int pipe;            /* write end for RdsBlock records */
+  unsigned long dropped;
+  pthread_t thread;
+} RdsIntake;
+
+typedef struct {
+  int pipe;            /* write end for ControlRequest records */
+  pthread_t thread;
+} ControlChannel;
+
+static char *controlSocket = NULL; /* -U */
+
+/* Listen on the TCP address of spec, [HOST]:PORT */
+static int
+listenTcp(const char *spec, const char *colon) {
+  const struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                                  .ai_socktype = SOCK_STREAM };
+  const char *name = spec;
+  size_t length = colon - spec;
+  struct addrinfo *addrs, *a;
+  char host[256];
+  int fd = -1, err;
+
+  if (length >= 2 && name[0] == '[' && name[length-1] == ']') {
+    name += 1;
+    length -= 2;
+  }
+  if (length >= sizeof(host)) {
+    fprintf(stderr, "Host name too long: %s\n", spec);
+    return -1;
+  }
+  memcpy(host, name, length);
+  host[length] = 0;
+  /* Only loopback without a host, requests are not authenticated */
+  if ((err = getaddrinfo(length? host : "127.0.0.1", colon + 1, &hints,
+                         &addrs)) != 0) {
+    fprintf(stderr, "%s: %s\n", spec, gai_strerror(err));
+    return -1;
+  }
+  for (a = addrs; a != NULL && fd < 0; a = a->ai_next) {
+    const int on = 1;
+
+    if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, a->ai_addr, a->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) perror(spec);
+  return fd;
+}
+
+/* Listen on the Unix socket path spec, replacing a stale socket */
+static int
+listenUnix(const char *spec) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct stat st;
+  int fd;
+
+  if (strlen(spec) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", spec);
+    return -1;
+  }
+  if (lstat(spec, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", spec);
+      return -1;
+    }
+    unlink(spec);
+  }
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    perror("socket");
+    return -1;
+  }
+  strcpy(addr.sun_path, spec);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(spec);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Listen on a Unix socket path, or on TCP given as [HOST]:PORT, which
+ * is the loopback interface without a HOST.  Returns the socket or -1
+ * after reporting why.
+ */
+static int
+listenSocket(const char *spec) {
+  const char *colon = strrchr(spec, ':');
+  const int fd = colon != NULL && strchr(spec, '/') == NULL?
+    listenTcp(spec, colon) : listenUnix(spec);
+
+  if (fd < 0) return -1;
+  if (listen(fd, 4) < 0) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *
+rdsIntakeThread(void *arg) {
+  RdsIntake *in = arg;
+  Tuner *t = in->tuner;
+  RdsReadBuffer *rds = &in->rds;
+  unsigned int epoch = __atomic_load_n(&t->tuneEpoch, __ATOMIC_ACQUIRE);
+
+  prefaultStack();
+  while (1) {
+    struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+    RdsBlock blocks[RDS_READ_BLOCKS];
+    unsigned int current;
+    ssize_t count;
+    int blocksRead;
+    size_t used;
+
+    if (poll(&pfd, 1, 1000) <= 0) continue;
+    current = __atomic_load_n(&t->tuneEpoch, __ATOMIC_ACQUIRE);
+    if (current != epoch) {
+      /* Queued during the tune, or before it */
+      epoch = current;
+      if (!(epoch & 1)) discardRdsBlocks(t->fd);
+      rds->fill = 0;
+      continue;
+    }
+    count = read(t->fd, rds->buffer.bytes + rds->fill,
+                 sizeof(rds->buffer) - rds->fill);
+    if (count == 0) break;
+    if (count == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      perror("read");
+      break;
+    }
+    if (rds->capture != NULL)
+      fwrite(rds->buffer.bytes + rds->fill, 1, count, rds->capture);
+    rds->fill += count;
+    blocksRead = rds->fill / sizeof(struct rds_data);
+    used = blocksRead * sizeof(struct rds_data);
+
+    if (!(epoch & 1)
+        && __atomic_load_n(&t->tuneEpoch, __ATOMIC_ACQUIRE) == epoch) {
+      const uint64_t now = monotonicTime();
+
+      for (int b = 0; b < blocksRead; b++) {
+        blocks[b].data = rds->buffer.blocks[b];
+        blocks[b].epoch = epoch;
+        blocks[b].time = now;
+      }
+      /* At most PIPE_BUF bytes, so the records are never split */
+      if (blocksRead > 0
+          && write(in->pipe, blocks, blocksRead * sizeof(*blocks)) < 0)
+        in->dropped += blocksRead;
+    }
+    memmove(rds->buffer.bytes, rds->buffer.bytes + used, rds->fill - used);
+    rds->fill -= used;
+  }
+  close(in->pipe);
+
+  return NULL;
+}
+
+static int
+queueControlRequest(ControlChannel *c, ControlCommand command, float value) {
+  const ControlRequest r = { .command = command, .value = value };
+
+  return write(c->pipe, &r, sizeof(r)) == sizeof(r);
+}
+
+static void *
+controlThread(void *arg) {
+  ControlChannel *c = arg;
+  uint8_t key;
+
+  while (read(STDIN_FILENO, &key, 1) == 1) {
+    switch (key) {
+    case 'n': queueControlRequest(c, CONTROL_NEXT, 0); break;
+    case '+': queueControlRequest(c, CONTROL_STEP, FREQUENCY_STEP); break;
+    case '-': queueControlRequest(c, CONTROL_STEP, -FREQUENCY_STEP); break;
+    default:
+      printf("Keyboard: %d (%X)\n", key, key);
+    }
+  }
+
+  return NULL;
+}
+
+/* Returns 0 if the tuner did not move to the frequency requested */
+static int
+runControlRequest(Tuner *tuner, const ControlRequest *r) {
+  float freq = tuner->currentFrequency;
+
+  switch (r->command) {
+  case CONTROL_NEXT:
+    nextProgram(tuner);
+    return 1;
+  case CONTROL_STEP:
+    freq += r->value;
+    if (freq > tuner->maxFrequency) freq = tuner->minFrequency;
+    if (freq < tuner->minFrequency) freq = tuner->maxFrequency;
+    break;
+  case CONTROL_TUNE:
+    freq = r->value;
+    break;
+  }
+  setTunerFrequency(tuner, freq);
+  if (tuner->currentFrequency != freq) return 0;
+  printf("Frequency tuned to %.2f\n", freq);
+  return 1;
+}
+
+/* Take a health sample if HEALTH_INTERVAL has passed, now is in ms */
+static void
+sampleRdsHealth(RdsDecoder *dec, uint64_t now) {
+  RdsHealth *h = &dec->health;
+  HealthSample *s;
+  struct v4l2_tuner tuner;
+
+  if (h->lastSample != 0 && now - h->lastSample < HEALTH_INTERVAL) return;
+  s = &h->samples[h->next];
+  h->next = (h->next + 1) % HEALTH_SAMPLES;
+  if (h->count < HEALTH_SAMPLES) h->count += 1;
+
+  memset(&tuner, 0, sizeof(tuner));
+  if (ioctl(dec->tuner->fd, VIDIOC_G_TUNER, &tuner) == 0) {
+    s->signal = tuner.signal;
+    s->stereo = (tuner.rxsubchans & V4L2_TUNER_SUB_STEREO) != 0;
+    s->audmode = tuner.audmode;
+  } else {
+    s->signal = -1;
+    s->stereo = s->audmode = 0;
+  }
+  s->time = now;
+  s->duration = h->lastSample != 0? now - h->lastSample : 0;
+  s->frequency = dec->tuner->currentFrequency;
+  s->pi = dec->thisProgram != NULL? dec->thisProgram->id : 0;
+  s->blocks = dec->blockCount - h->lastBlocks;
+  s->errors = dec->errorCount - h->lastErrors;
+  s->groups = dec->groupCount - h->lastGroups;
+  h->lastSample = now;
+  h->lastBlocks = dec->blockCount;
+  h->lastErrors = dec->errorCount;
+  h->lastGroups = dec->groupCount;
+}
+
+/* The nth latest sample, 0 is the latest one */
+static inline const HealthSample *
+healthSample(const RdsHealth *h, int n) {
+  return &h->samples[(h->next - 1 - n + 2*HEALTH_SAMPLES) % HEALTH_SAMPLES];
+}
+
+/* Block error rate and groups per second over the last HEALTH_WINDOW */
+static void
+rollingHealth(const RdsHealth *h, double *errorRate, double *groupRate) {
+  unsigned long blocks = 0, errors = 0, groups = 0, duration = 0;
+
+  for (int i = 0; i < HEALTH_WINDOW && i < h->count; i++) {
+    const HealthSample *s = healthSample(h, i);
+
+    if (s->duration == 0) continue;
+    blocks += s->blocks;
+    errors += s->errors;
+    groups += s->groups;
+    duration += s->duration;
+  }
+  *errorRate = blocks > 0? (double)errors / blocks : 0;
+  *groupRate = duration > 0? 1000.0 * groups / duration : 0;
+}
+
+/* Control protocol
+ *
+ * Clients of the control socket send requests as lines of text, which
+ * "@N " in front addresses to the Nth tuner given by -T.  Each reply is
+ * ended by a line "ok" or "error: REASON" and may have data lines
+ * before it:
+ *
+ *   tune FREQ        tune to FREQ MHz
+ *   seek up|down     seek the next station, replies "frequency FREQ"
+ *   up, down         step by FREQUENCY_STEP
+ *   next             tune to the next station known
+ *   volume PERCENT   0 mutes
+ *   stations         "PI FREQ SIGNAL NAME" for every station
+ *   stats            "tuner N" and KEY VALUE pairs for every tuner,
+ *                    or the one addressed
+ *   history [COUNT]  "tuner N", then the last COUNT health samples as
+ *                    "TIME FREQ SIGNAL STEREO AUDMODE PI BLOCKS ERRORS
+ *                    GROUPS", oldest first
+ *   health           "tuner N", then "PI ACQUISITIONS PS_LAST PS_MEAN
+ *                    RT_LAST RT_MEAN" for every station, latencies in ms
+ *                    and -1 if there is none
+ *
+ * Clients are served from the loop that decodes RDS.  A client which
+ * does not read its replies is disconnected, rather than stalling it.
+ */
+
+typedef struct {
+  Tuner *tuner;
+  RdsDecoder *decoder;
+} ControlTarget;
+
+typedef struct {
+  int fd;
+  size_t fill;
+  char line[CONTROL_LINE_MAX];
+} ControlClient;
+
+typedef struct {
+  int listenFd;
+  int clientCount;
+  ControlClient clients[CONTROL_CLIENTS];
+} ControlServer;
+
+typedef struct {
+  char buffer[CONTROL_REPLY_MAX];
+  size_t fill;
+  int truncated;
+} ControlReply;
+
+static void
+replyPrintf(ControlReply *r, const char *format, ...) {
+  const size_t space = sizeof(r->buffer) - r->fill;
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(r->buffer + r->fill, space, format, args);
+  va_end(args);
+  if (n < 0 || (size_t)n >= space) r->truncated = 1;
+  else r->fill += n;
+}
+
+static void
+replyStats(ControlReply *r, int index, ControlTarget *target) {
+  Tuner *t = target->tuner;
+  const RdsDecoder *dec = target->decoder;
+  int stereo = 0;
+  const int signal = getTunerSignal(t, &stereo);
+  int station;
+
+  replyPrintf(r, "tuner %d frequency %.2f signal %d stereo %d",
+              index, t->currentFrequency, signal, stereo);
+  if (dec != NULL) {
+    replyPrintf(r, " blocks %d errors %d recovered %d groups %d repeats %d",
+                dec->blockCount, dec->errorCount, dec->recoveredCount,
+                dec->groupCount, dec->repeatCount);
+    if (dec->thisProgram != NULL)
+      replyPrintf(r, " pi %04X", dec->thisProgram->id);
+    if (dec->health.count > 0) {
+      double errorRate, groupRate;
+
+      rollingHealth(&dec->health, &errorRate, &groupRate);
+      replyPrintf(r, " bler %.4f group_rate %.1f", errorRate, groupRate);
+    }
+    if (dec->thisProgram != NULL &&
+        (station = findStationHealth(&dec->health, dec->thisProgram->id))
+        >= 0)
+      replyPrintf(r, " ps_latency %d rt_latency %d",
+                  dec->health.stations[station].psLatency,
+                  dec->health.stations[station].rtLatency);
+  }
+  replyPrintf(r, "\n");
+}
+
+static void
+replyHistory(ControlReply *r, int index, const RdsHealth *h, int count) {
+  replyPrintf(r, "tuner %d\n", index);
+  if (count > h->count) count = h->count;
+  for (int i = count - 1; i >= 0; i--) {
+    const HealthSample *s = healthSample(h, i);
+
+    replyPrintf(r, "%llu %.2f %d %u %u %04X %u %u %u\n",
+                (unsigned long long)s->time, s->frequency, s->signal,
+                s->stereo, s->audmode, s->pi, s->blocks, s->errors,
+                s->groups);
+  }
+}
+
+static void
+replyHealth(ControlReply *r, int index, const RdsHealth *h) {
+  replyPrintf(r, "tuner %d\n", index);
+  for (int i = 0; i < h->stationCount; i++) {
+    const StationHealth *s = &h->stations[i];
+
+    replyPrintf(r, "%04X %d %d %d %d %d\n", s->pi, s->acquisitions,
+                s->psLatency, s->psCount? (int)(s->psTotal / s->psCount) : -1,
+                s->rtLatency, s->rtCount? (int)(s->rtTotal / s->rtCount) : -1);
+  }
+}
+
+static void
+runControlLine(ControlTarget *targets, int count, const char *line,
+               ControlReply *r) {
+  int index = 0, addressed = 0, n = 0;
+  char word[8];
+  unsigned int volume;
+  float value;
+  Tuner *t;
+
+  if (sscanf(line, "@%d %n", &index, &n) == 1 && n > 0) {
+    line += n;
+    addressed = 1;
+  }
+  if (index < 0 || index >= count || targets[index].tuner->fd <= 0) {
+    replyPrintf(r, "error: no tuner %d\n", index);
+    return;
+  }
+  t = targets[index].tuner;
+
+  if (sscanf(line, "tune %f", &value) == 1) {
+    const ControlRequest request = { .command = CONTROL_TUNE, .value = value };
+
+    if (!runControlRequest(t, &request)) {
+      replyPrintf(r, "error: cannot tune to %.2f\n", value);
+      return;
+    }
+  } else if (strcmp(line, "up") == 0 || strcmp(line, "down") == 0) {
+    const ControlRequest request = {
+      .command = CONTROL_STEP,
+      .value = line[0] == 'u'? FREQUENCY_STEP : -FREQUENCY_STEP
+    };
+
+    runControlRequest(t, &request);
+    replyPrintf(r, "frequency %.2f\n", t->currentFrequency);
+  } else if (strcmp(line, "next") == 0) {
+    const ControlRequest request = { .command = CONTROL_NEXT };
+
+    runControlRequest(t, &request);
+    replyPrintf(r, "frequency %.2f\n", t->currentFrequency);
+  } else if (sscanf(line, "seek %7s", word) == 1
+             && (strcmp(word, "up") == 0 || strcmp(word, "down") == 0)) {
+    const float freq = seekTunerFrequency(t, word[0] == 'u');
+
+    if (freq < t->minFrequency/2) {
+      replyPrintf(r, "error: seek failed\n");
+      return;
+    }
+    t->currentFrequency = freq;
+    replyPrintf(r, "frequency %.2f\n", freq);
+  } else if (sscanf(line, "volume %u", &volume) == 1) {
+    setTunerVolume(t, volume);
+  } else if (strcmp(line, "stations") == 0) {
+    ProgramTable *table = t->programs;
+
+    if (!table->sorted) sortProgramsByFrequency(table);
+    for (int i = 0; i < table->count; i++) {
+      const ProgramData *pd = table->byFrequency[i];
+
+      replyPrintf(r, "%04X %.2f %u %s\n", pd->id, pd->freq, pd->signal,
+                  pd->name);
+    }
+  } else if (strcmp(line, "stats") == 0) {
+    for (int i = 0; i < count; i++) {
+      if ((addressed && i != index) || targets[i].tuner->fd <= 0) continue;
+      replyStats(r, i, &targets[i]);
+    }
+  } else if (strncmp(line, "history", 7) == 0 &&
+             (line[7] == 0 || line[7] == ' ')) {
+    int samples = HEALTH_SAMPLES;
+
+    if (line[7] == ' ' && (sscanf(line + 8, "%d", &samples) != 1 ||
+                           samples < 0)) {
+      replyPrintf(r, "error: bad sample count\n");
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      if ((addressed && i != index) || targets[i].tuner->fd <= 0 ||
+          targets[i].decoder == NULL) continue;
+      replyHistory(r, i, &targets[i].decoder->health, samples);
+    }
+  } else if (strcmp(line, "health") == 0) {
+    for (int i = 0; i < count; i++) {
+      if ((addressed && i != index) || targets[i].tuner->fd <= 0 ||
+          targets[i].decoder == NULL) continue;
+      replyHealth(r, i, &targets[i].decoder->health);
+    }
+  } else {
+    replyPrintf(r, "error: unknown request\n");
+    return;
+  }
+  replyPrintf(r, "ok\n");
+}
+
+static void
+closeControlClient(ControlServer *s, int index) {
+  close(s->clients[index].fd);
+  s->clients[index] = s->clients[--s->clientCount];
+}
+
+/* Returns the socket of the new client, or -1 */
+static int
+acceptControlClient(ControlServer *s) {
+  const int fd = accept(s->listenFd, NULL, NULL);
+
+  if (fd < 0) return -1;
+  if (s->clientCount == CONTROL_CLIENTS) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  s->clients[s->clientCount].fd = fd;
+  s->clients[s->clientCount++].fill = 0;
+  return fd;
+}
+
+/**
+ * Run the complete requests a client has sent, returns 0 once the
+ * client is gone and has been removed from s.
+ */
+static int
+serveControlClient(ControlServer *s, int index, ControlTarget *targets,
+                   int count) {
+  static ControlReply reply;
+  ControlClient *c = &s->clients[index];
+  char *end;
+  ssize_t n;
+
+  n = read(c->fd, c->line + c->fill, sizeof(c->line) - 1 - c->fill);
+  if (n == -1 && (errno == EINTR || errno == EAGAIN)) return 1;
+  if (n <= 0) {
+    closeControlClient(s, index);
+    return 0;
+  }
+  c->fill += n;
+  c->line[c->fill] = 0;
+  while ((end = strchr(c->line, '\n')) != NULL) {
+    *end = 0;
+    if (end > c->line && end[-1] == '\r') end[-1] = 0;
+    reply.fill = reply.truncated = 0;
+    runControlLine(targets, count, c->line, &reply);
+    if (reply.truncated) {
+      reply.fill = 0;
+      replyPrintf(&reply, "error: reply too long\n");
+    }
+    if (send(c->fd, reply.buffer, reply.fill, MSG_DONTWAIT|MSG_NOSIGNAL)
+        != (ssize_t)reply.fill) {
+      closeControlClient(s, index);
+      return 0;
+    }
+    c->fill -= end + 1 - c->line;
+    memmove(c->line, end + 1, c->fill + 1);
+  }
+  if (c->fill == sizeof(c->line) - 1) {
+    closeControlClient(s, index); /* not a line */
+    return 0;
+  }
+  return 1;
+}
+
+static void
+closeControlServer(ControlServer *s) {
+  while (s->clientCount > 0) closeControlClient(s, 0);
+  if (s->listenFd >= 0) close(s->listenFd);
+  s->listenFd = -1;
+}
+
+static inline void
+decodeRds(Tuner *tuner) {
+  RdsIntake intake = { .tuner = tuner,
+                       .rds = { .fill = 0, .capture = rdsCapture } };
+  ControlChannel control;
+  ControlServer server = { .listenFd = -1 };
+  ControlTarget target;
+  const int useStdin = isatty(STDIN_FILENO);
+  int blockPipe[2], controlPipe[2];
+  int controlStarted = 0, err;
+  RdsDecoder decoder;
+
+  if (pipe(blockPipe) != 0) {
+    perror("pipe");
+    return;
+  }
+  if (pipe(controlPipe) != 0) {
+    perror("pipe");
+    close(blockPipe[0]);
+    close(blockPipe[1]);
+    return;
+  }
+  /* Never block intake on a stalled decoder, or control on either */
+  fcntl(blockPipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(controlPipe[1], F_SETFL, O_NONBLOCK);
+  intake.pipe = blockPipe[1];
+  control.pipe = controlPipe[1];
+  if (controlSocket != NULL) server.listenFd = listenSocket(controlSocket);
+
+  lockMemory();
+  setupGroupDecoders();
+  initRdsDecoder(&decoder, tuner);
+  decoder.epoch = __atomic_load_n(&tuner->tuneEpoch, __ATOMIC_ACQUIRE);
+  target.tuner = tuner;
+  target.decoder = &decoder;
+
+  /* Before the terminal is changed, a failure would leave it so */
+  if ((err = pthread_create(&intake.thread, NULL, rdsIntakeThread,
+                            &intake)) != 0) {
+    fprintf(stderr, "cannot create RDS intake thread: %s\n", strerror(err));
+    closeControlServer(&server);
+    freeRdsDecoder(&decoder);
+    for (int i = 0; i < 2; i++) {
+      close(blockPipe[i]);
+      close(controlPipe[i]);
+    }
+    return;
+  }
+  setupRealtimeThread("RDS intake", intake.thread, &realtime.rds);
+  if (useStdin) {
+    disableCannonicalMode();
+    controlStarted = pthread_create(&control.thread, NULL, controlThread,
+                                    &control) == 0;
+  }
+  reportRealtime("RDS reception");
+
+  while (1) {
+    struct pollfd fds[3 + CONTROL_CLIENTS] = {
+      { .fd = blockPipe[0], .events = POLLIN },
+      { .fd = controlPipe[0], .events = POLLIN },
+      { .fd = server.listenFd, .events = POLLIN }
+    };
+    const int clients = server.clientCount;
+    int pollval;
+
+    for (int i = 0; i < clients; i++)
+      fds[3 + i] = (struct pollfd){ .fd = server.clients[i].fd,
+                                    .events = POLLIN };
+    checkAlternativeFrequencies(tuner, &decoder, NULL);
+    sampleRdsHealth(&decoder, monotonicTime() / 1000000);
+    flushEventSink();
+    pollval = poll(fds, 3 + clients, 1000);
+
+    if (pollval == 0) {
+      if (verbose) printf("No RDS data\n");
+      continue;
+    } else if (pollval == -1) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      ControlRequest r;
+
+      if (read(controlPipe[0], &r, sizeof(r)) == sizeof(r))
+        runControlRequest(tuner, &r);
+    }
+    /* Backwards, as closing a client moves the last one into its place */
+    for (int i = clients - 1; i >= 0; i--) {
+      if (fds[3 + i].revents) serveControlClient(&server, i, &target, 1);
+    }
+    if (fds[2].revents & POLLIN) acceptControlClient(&server);
+    if (fds[0].revents & (POLLIN|POLLHUP)) {
+      RdsBlock blocks[RDS_READ_BLOCKS];
+      const ssize_t count = read(blockPipe[0], blocks, sizeof(blocks));
+      const unsigned int epoch = __atomic_load_n(&tuner->tuneEpoch,
+                                                 __ATOMIC_ACQUIRE);
+
+      if (count == 0) break; /* the radio device is gone */
+      for (int b = 0; b < count / (ssize_t)sizeof(*blocks); b++) {
+        if (blocks[b].epoch != decoder.epoch) {
+          if (blocks[b].epoch != epoch) continue; /* tuned away since */
+          newRdsEpoch(&decoder, epoch);
+        }
+        decodeRdsBlock(&decoder, &blocks[b].data);
+      }
+    }
+  }
+
+  pthread_join(intake.thread, NULL);
+  if (controlStarted) {
+    pthread_cancel(control.thread);
+    pthread_join(control.thread, NULL);
+  }
+  closeControlServer(&server);
+  /* The intake thread has closed the other end of blockPipe */
+  close(blockPipe[0]);
+  close(controlPipe[0]);
+  close(controlPipe[1]);
+  if (intake.dropped)
+    fprintf(stderr, "%lu RDS blocks dropped by a stalled decoder\n",
+            intake.dropped);
+  closeEventSink();
+  if (rdsCapture != NULL) fclose(rdsCapture);
+  freeRdsDecoder(&decoder);
+  if (useStdin) tcsetattr(0, TCSAFLUSH, &savedTerminalSettings);
+}
+
+/* Band scan
+ *
+ * Every channel of the band is tuned once.  Channels with neither a
+ * usable signal nor a stereo pilot are skipped right away, otherwise
+ * RDS is read until PI and PS are known or a timeout expires.  When
+ * several tuners are available, each one scans a slice of the band on
+ * a thread of its own.
+ */
+
+#define SCAN_STEP .1
+#define SCAN_MIN_SIGNAL 0X4000 /* of 0XFFFF */
+#define SCAN_PI_TIMEOUT 300    /* ms, to see block A at all */
+#define SCAN_PS_TIMEOUT 2000   /* ms, to collect all 4 PS segments */
+
+typedef struct {
+  Tuner *tuner;
+  float from, to;
+  ProgramTable programs;
+  float *strongest; /* frequency of the best signal by PI */
+  int found;
+  pthread_t thread;
+} ScanJob;
+
+/* Collect the PS name straight into the program in 0A and 0B groups */
+static void
+scanGroup0(RdsDecoder *dec, const unsigned char *groupData) {
+  int index = (groupData[3] & 0x03) << 1;
+
+  if (dec->thisProgram != NULL) {
+    dec->thisProgram->tp = (groupData[2] & 0x04) == 0X04;
+    dec->thisProgram->name[index] = groupData[6];
+    dec->thisProgram->name[index+1] = groupData[7];
+  }
+}
+
+/**
+ * Tune to freq and wait for PI and PS, returns the program received or
+ * NULL if there is none, and its signal in *signal.
+ */
+static ProgramData *
+scanFrequency(Tuner *t, RdsDecoder *dec, float freq, int *signal) {
+  const uint64_t start = monotonicTime();
+  uint64_t timeout = SCAN_PI_TIMEOUT;
+  RdsReadBuffer rds = { .fill = 0 };
+  int stereo = 0;
+
+  *signal = probeTunerSignal(t, freq, &stereo);
+  discardRdsBlocks(t->fd);
+  if (*signal < 0 || (*signal < SCAN_MIN_SIGNAL && !stereo)) return NULL;
+
+  dec->thisProgram = NULL;
+  memset(dec->groupData, 0, sizeof(dec->groupData));
+  memset(dec->lastGroupData, 0, sizeof(dec->lastGroupData));
+  memset(dec->groupCache, 0, sizeof(dec->groupCache));
+  while (1) {
+    struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+    const uint64_t elapsed = (monotonicTime() - start) / 1000000;
+    ProgramData *pd = dec->thisProgram;
+
+    if (pd != NULL) {
+      timeout = SCAN_PS_TIMEOUT;
+      if (strlen(pd->name) == 8) break;
+    }
+    if (elapsed >= timeout) break;
+    if (poll(&pfd, 1, timeout - elapsed) == 1 &&
+        readRdsBlocks(t->fd, &rds, dec) == -1 && errno != EINTR) {
+      perror("read");
+      break;
+    }
+  }
+
+  return dec->thisProgram;
+}
+
+/**
+ * Keep the strongest of the channels pd was received on in the scan as
+ * its frequency, the others become alternatives.
+ */
+static void
+keepStrongestFrequency(ScanJob *job, ProgramData *pd, float freq,
+                       int signal) {
+  float *strongest = &job->strongest[pd->id];
+
+  if (*strongest == 0 || signal > pd->signal) {
+    if (*strongest != 0) addAlternativeFrequency(pd, afCode(*strongest));
+    *strongest = freq;
+    pd->signal = signal;
+  } else {
+    addAlternativeFrequency(pd, afCode(freq));
+  }
+  /* The decoder moved it to freq on block A */
+  setProgramFrequency(&job->programs, pd, *strongest);
+}
+
+static void *
+scanThread(void *arg) {
+  ScanJob *job = arg;
+  Tuner *t = job->tuner;
+  ProgramTable *programs = t->programs;
+  RdsDecoder decoder;
+
+  initRdsDecoder(&decoder, t);
+  memset(decoder.groupDecoders, 0, sizeof(decoder.groupDecoders));
+  decoder.groupDecoders[TYPE_0A] = scanGroup0;
+  decoder.groupDecoders[TYPE_0B] = scanGroup0;
+  decoder.quiet = 1;
+
+  t->programs = &job->programs;
+  for (int i = 0; job->from + i*SCAN_STEP <= job->to + SCAN_STEP/2; i++) {
+    const float freq = job->from + i*SCAN_STEP;
+    ProgramData *pd;
+    int signal;
+
+    if (quit) break;
+    if ((pd = scanFrequency(t, &decoder, freq, &signal)) != NULL) {
+      job->found += 1;
+      keepStrongestFrequency(job, pd, freq, signal);
+      printf("%s: %.2fMHz %04X %-8s signal %5d%s\n", t->device, freq,
+             pd->id, pd->name, signal, pd->tp? " TP" : "");
+    } else if (verbose) {
+      printf("%s: %.2fMHz -\n", t->device, freq);
+    }
+  }
+  t->programs = programs;
+  freeRdsDecoder(&decoder);
+
+  return NULL;
+}
+
+/* Merge what is known about the stations in from into to */
+static void
+mergePrograms(ProgramTable *to, ProgramTable *from) {
+  for (int i = 0; i < from->count; i++) {
+    ProgramData *src = from->byFrequency[i];
+    ProgramData *pd = getProgram(to, src->id);
+
+    if (src->freq != 0 && (pd->freq == 0 || src->signal >= pd->signal)) {
+      if (pd->freq != 0) addAlternativeFrequency(pd, afCode(pd->freq));
+      setProgramFrequency(to, pd, src->freq);
+      pd->signal = src->signal;
+    } else if (src->freq != 0) {
+      addAlternativeFrequency(pd, afCode(src->freq));
+    }
+    if (strlen(src->name) > strlen(pd->name)) strcpy(pd->name, src->name);
+    if (src->type) pd->type = src->type;
+    pd->tp = pd->tp || src->tp;
+    for (int j = 0; j < src->afCount; j++)
+      addAlternativeFrequency(pd, src->af[j]);
+  }
+}
+
+/**
+ * Scan the band with all tuners in parallel and merge the stations
+ * found into programs, returns the number of channels with RDS.
+ */
+static int
+scanBand(Tuner **tuners, int count, ProgramTable *programs) {
+  const float minFrequency = tuners[0]->minFrequency;
+  const float maxFrequency = tuners[0]->maxFrequency;
+  const int channels = (maxFrequency - minFrequency) / SCAN_STEP + 1;
+  ScanJob *jobs = calloc(count, sizeof(*jobs));
+  int found = 0;
+
+  if (jobs == NULL) {
+    fprintf(stderr, "no memory for scan\n");
+    return 0;
+  }
+  for (int i = 0; i < count; i++) {
+    ScanJob *job = &jobs[i];
+    int err;
+
+    job->tuner = tuners[i];
+    job->from = minFrequency + (i*channels/count) * SCAN_STEP;
+    job->to = minFrequency + ((i+1)*channels/count - 1) * SCAN_STEP;
+    initProgramTable(&job->programs);
+    if ((job->strongest = calloc(0X10000, sizeof(float))) == NULL) {
+      fprintf(stderr, "no memory for scan\n");
+      job->tuner = NULL;
+    } else if (job->from < tuners[i]->minFrequency ||
+               job->to > maxFrequency ||
+               tuners[i]->maxFrequency != maxFrequency) {
+      fprintf(stderr, "%s: band differs from %s\n",
+              tuners[i]->device, tuners[0]->device);
+      job->tuner = NULL;
+    } else if ((err = pthread_create(&job->thread, NULL,
+                                     scanThread, job)) != 0) {
+      fprintf(stderr, "cannot create scan thread: %s\n", strerror(err));
+      job->tuner = NULL;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    if (jobs[i].tuner == NULL) continue;
+    pthread_join(jobs[i].thread, NULL);
+    mergePrograms(programs, &jobs[i].programs);
+    found += jobs[i].found;
+  }
+  for (int i = 0; i < count; i++) free(jobs[i].strongest);
+  free(jobs);
+
+  return found;
+}
+
+/* Station database
+ *
+ * A plain text file with one station per line: PI, frequency, PTY,
+ * TP and the PS name.
+ */
+
+static int
+loadStations(ProgramTable *programs, const char *fileName) {
+  FILE *file = fopen(fileName, "r");
+  char line[80];
+
+  if (file == NULL) {
+    if (errno == ENOENT) return 1;
+    perror(fileName);
+    return 0;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    unsigned int id;
+    int type, tp, nameStart = 0;
+    float freq;
+
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%4X %f %d %d %n", &id, &freq, &type, &tp,
+               &nameStart) >= 4 && nameStart > 0) {
+      ProgramData *pd = getProgram(programs, id);
+      size_t length = strcspn(line + nameStart, "\n");
+
+      setProgramFrequency(programs, pd, freq);
+      pd->type = type;
+      pd->tp = tp;
+      if (length > 8) length = 8;
+      memcpy(pd->name, line + nameStart, length);
+      pd->name[length] = 0;
+    }
+  }
+  fclose(file);
+  if (verbose) printf("%d stations loaded from %s\n", programs->count,
+                      fileName);
+  return 1;
+}
+
+/* Replace fileName by the given stations, sorted by frequency */
+static int
+saveStations(ProgramTable *programs, const char *fileName) {
+  char tmpName[FILENAME_MAX];
+  FILE *file;
+
+  snprintf(tmpName, sizeof(tmpName), "%s.tmp", fileName);
+  if ((file = fopen(tmpName, "w")) == NULL) {
+    perror(tmpName);
+    return 0;
+  }
+  if (!programs->sorted) sortProgramsByFrequency(programs);
+  fprintf(file, "# PI   MHz PTY TP PS\n");
+  for (int i = 0; i < programs->count; i++) {
+    ProgramData *pd = programs->byFrequency[i];
+
+    if (pd->freq == 0) continue;
+    fprintf(file, "%04X %6.2f %2d %d %s\n",
+            pd->id, pd->freq, pd->type, pd->tp, pd->name);
+  }
+  if (fclose(file) != 0 || rename(tmpName, fileName) != 0) {
+    perror(fileName);
+    unlink(tmpName);
+    return 0;
+  }
+  return 1;
+}
+
+#ifdef HAVE_AUDIO
+/* Audio I/O */
+
+#include <alsa/asoundlib.h>
+#include <samplerate.h>
+
+static unsigned int inputSampleRate = 96000;
+#ifdef SI470X_CHANNELS
+#if SI470X_CHANNELS < 1 || SI470X_CHANNELS > MAX_CHANNELS
+#error "SI470X_CHANNELS is 1 or 2"
+#endif
+static const char num_channels = SI470X_CHANNELS;
+#else
+static char num_channels = 2;
+#endif
+static unsigned int period_size = 2048, num_periods = 4; /* 85ms */
+static unsigned int avail_min = 2, start_threshold = 1; /* periods */
+
+static unsigned int resample_quality = 3; /* SRC converter 4-quality */
+
+/* Latency profiles (-p)
+ *
+ * A profile sets up capture, its wakeups and the resampler for one
+ * trade-off of latency against CPU and robustness.  The short ones
+ * capture at 48 kHz, which the si470x delivers as well as 96 kHz and
+ * which a 48 kHz JACK server takes without conversion.  A rate the
+ * driver rounds is taken over by set_hwparams().  Explicit options
+ * override the profile.
+ */
+typedef struct {
+  const char *name;
+  unsigned int rate, period, periods;
+  unsigned int availMin, startThreshold; /* periods */
+  unsigned int quality;
+  double targetDelay; /* periods of capture, 0 for half of the buffer */
+} LatencyProfile;
+
+static const LatencyProfile latencyProfiles[] = {
+  { "ultra-low", 48000, 128, 4, 1, 1, 2, 1.5 }, /* 11ms, SRC_SINC_FASTEST */
+  { "low", 48000, 256, 4, 1, 1, 2, 0 },         /* 21ms */
+  { "default", 96000, 2048, 4, 2, 1, 3, 0 },    /* 85ms */
+  { "archival", 96000, 8192, 4, 2, 2, 4, 0 }    /* 341ms, SRC_SINC_BEST */
+};
+
+static const LatencyProfile *latencyProfile = &latencyProfiles[2];
+
+static const LatencyProfile *
+findLatencyProfile(const char *name) {
+  for (int i = 0; i < sizeof(latencyProfiles)/sizeof(*latencyProfiles); i++) {
+    if (strcmp(latencyProfiles[i].name, name) == 0) return &latencyProfiles[i];
+  }
+  return NULL;
+}
+
+static void
+setLatencyProfile(const LatencyProfile *profile) {
+  latencyProfile = profile;
+  inputSampleRate = profile->rate;
+  period_size = profile->period;
+  num_periods = profile->periods;
+  avail_min = profile->availMin;
+  start_threshold = profile->startThreshold;
+  resample_quality = profile->quality;
+}
+
+#include <math.h>
+
+typedef struct {
+  snd_pcm_format_t format_id;
+  size_t sample_size;
+  void (*soundcard_to_jack) (float *dst, char *src,
+			     unsigned long nsamples, unsigned long src_skip);
+  /* Convert contiguous (interleaved) samples */
+  void (*to_float) (float *dst, const char *src, unsigned long nsamples);
+  /* Split interleaved stereo frames into two channels */
+  void (*deinterleave2) (float *left, float *right,
+			 const char *src, unsigned long nframes);
+} alsa_format_t;
+
+#define SAMPLE_16BIT_SCALING  32767.0f
+#define SAMPLE_24BIT_SCALING  8388607.0f
+#define SAMPLE_32BIT_SCALING  2147483647.0f
+
+static void
+sample_move_dS_s16(float *dst, char *src,
+		   unsigned long nsamples, unsigned long src_skip) 
+{
+  while (nsamples--) {
+    *dst = (*((short *)src)) / SAMPLE_16BIT_SCALING;
+    dst += 1, src += src_skip;
+  }
+}	
+
+static void
+sample_move_dS_s24_3le(float *dst, char *src,
+		       unsigned long nsamples, unsigned long src_skip)
+{
+  while (nsamples--) {
+    const unsigned char *b = (unsigned char *)src;
+    int32_t x = (uint32_t)b[0] << 8 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 24;
+    *dst = (x >> 8) / SAMPLE_24BIT_SCALING;
+    dst += 1, src += src_skip;
+  }
+}
+
+static void
+sample_move_dS_s32(float *dst, char *src,
+		   unsigned long nsamples, unsigned long src_skip)
+{
+  while (nsamples--) {
+    *dst = (*((int32_t *)src)) / SAMPLE_32BIT_SCALING;
+    dst += 1, src += src_skip;
+  }
+}
+
+static void
+sample_move_dS_float(float *dst, char *src,
+		     unsigned long nsamples, unsigned long src_skip)
+{
+  while (nsamples--) {
+    *dst = *((float *)src);
+    dst += 1, src += src_skip;
+  }
+}
+
+/* Generic versions of the contiguous and stereo converters built on the
+ * strided ones, the fallback when no vector unit is available.  A build
+ * for one format leaves those of the others unused.
+ */
+#define SCALAR_CONVERTERS(name, size)					\
+static void __attribute__((unused))					\
+name##_to_float(float *dst, const char *src,	\
+		unsigned long nsamples) {				\
+  sample_move_dS_##name(dst, (char *)src, nsamples, size);		\
+}									\
+static void __attribute__((unused))					\
+name##_deinterleave2(float *left, float *right,	\
+		     const char *src, unsigned long nframes) {		\
+  sample_move_dS_##name(left, (char *)src, nframes, 2*(size));		\
+  sample_move_dS_##name(right, (char *)src + (size), nframes, 2*(size)); \
+}
+
+SCALAR_CONVERTERS(s16, 2)
+SCALAR_CONVERTERS(s24_3le, 3)
+SCALAR_CONVERTERS(s32, 4)
+
+static void __attribute__((unused))
+float_to_float(float *dst, const char *src,
+	       unsigned long nsamples) {
+  memcpy(dst, src, nsamples * sizeof(*dst));
+}
+
+static void __attribute__((unused))
+float_deinterleave2(float *left, float *right,
+		    const char *src, unsigned long nframes) {
+  sample_move_dS_float(left, (char *)src, nframes, 2*sizeof(float));
+  sample_move_dS_float(right, (char *)src + sizeof(float), nframes,
+		       2*sizeof(float));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Each loader converts four consecutive samples, the slack is how many
+ * samples past those four it may read.
+ */
+
+static inline __m128 __attribute__((target("sse2")))
+s16_load4_sse2(const char *src) {
+  const __m128i v = _mm_loadl_epi64((const __m128i *)src);
+  return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)),
+		    _mm_set1_ps(1.0f / SAMPLE_16BIT_SCALING));
+}
+
+static inline __m128 __attribute__((target("ssse3")))
+s24_3le_load4_ssse3(const char *src) {
+  const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+					-1, 6, 7, 8, -1, 9, 10, 11);
+  const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src),
+				     shuffle);
+  return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(v, 8)),
+		    _mm_set1_ps(1.0f / SAMPLE_24BIT_SCALING));
+}
+
+static inline __m128 __attribute__((target("sse2")))
+s32_load4_sse2(const char *src) {
+  return _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)src)),
+		    _mm_set1_ps(1.0f / SAMPLE_32BIT_SCALING));
+}
+
+static inline __m128 __attribute__((target("sse2")))
+float_load4_sse2(const char *src) {
+  return _mm_loadu_ps((const float *)src);
+}
+
+#define SSE_TO_FLOAT(name, isa, size, slack)				\
+static void __attribute__((target(#isa)))				\
+name##_to_float_##isa(float *dst, const char *src, \
+		      unsigned long nsamples) {				\
+  unsigned long i = 0;							\
+  for (; i + 4 + (slack) <= nsamples; i += 4)				\
+    _mm_storeu_ps(dst + i, name##_load4_##isa(src + i*(size)));		\
+  sample_move_dS_##name(dst + i, (char *)src + i*(size), nsamples - i, size); \
+}
+
+#define SSE_DEINTERLEAVE2(name, isa, size, slack)			\
+static void __attribute__((target(#isa)))				\
+name##_deinterleave2_##isa(float *left, float *right,	\
+			   const char *src, unsigned long nframes) {	\
+  unsigned long i = 0;							\
+  for (; 2*i + 8 + (slack) <= 2*nframes; i += 4) {			\
+    const __m128 a = name##_load4_##isa(src + 2*i*(size));		\
+    const __m128 b = name##_load4_##isa(src + (2*i + 4)*(size));	\
+    _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))); \
+    _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))); \
+  }									\
+  sample_move_dS_##name(left + i, (char *)src + 2*i*(size), nframes - i, \
+			2*(size));					\
+  sample_move_dS_##name(right + i, (char *)src + (2*i + 1)*(size),	\
+			nframes - i, 2*(size));				\
+}
+
+SSE_TO_FLOAT(s16, sse2, 2, 0)
+SSE_TO_FLOAT(s24_3le, ssse3, 3, 2)
+SSE_TO_FLOAT(s32, sse2, 4, 0)
+SSE_DEINTERLEAVE2(s16, sse2, 2, 0)
+SSE_DEINTERLEAVE2(s24_3le, ssse3, 3, 2)
+SSE_DEINTERLEAVE2(s32, sse2, 4, 0)
+SSE_DEINTERLEAVE2(float, sse2, 4, 0)
+
+/* Stereo S16 frames are 32 bit lanes, left in the low half */
+static void __attribute__((target("avx2")))
+s16_deinterleave2_avx2(float *left, float *right,
+		       const char *src, unsigned long nframes) {
+  const __m256 scale = _mm256_set1_ps(1.0f / SAMPLE_16BIT_SCALING);
+  unsigned long i = 0;
+
+  for (; i + 8 <= nframes; i += 8) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4*i));
+    const __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+    const __m256i r = _mm256_srai_epi32(v, 16);
+    _mm256_storeu_ps(left + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+    _mm256_storeu_ps(right + i, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+  }
+  s16_deinterleave2_sse2(left + i, right + i, src + 4*i, nframes - i);
+}
+
+static void __attribute__((target("avx2")))
+s16_to_float_avx2(float *dst, const char *src,
+		  unsigned long nsamples) {
+  const __m256 scale = _mm256_set1_ps(1.0f / SAMPLE_16BIT_SCALING);
+  unsigned long i = 0;
+
+  for (; i + 8 <= nsamples; i += 8) {
+    const __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + 2*i)));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+  s16_to_float_sse2(dst + i, src + 2*i, nsamples - i);
+}
+
+static void __attribute__((target("avx2")))
+s32_to_float_avx2(float *dst, const char *src,
+		  unsigned long nsamples) {
+  const __m256 scale = _mm256_set1_ps(1.0f / SAMPLE_32BIT_SCALING);
+  unsigned long i = 0;
+
+  for (; i + 8 <= nsamples; i += 8) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4*i));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+  s32_to_float_sse2(dst + i, src + 4*i, nsamples - i);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static void
+s16_deinterleave2_neon(float *left, float *right,
+		       const char *src, unsigned long nframes) {
+  const float scale = 1.0f / SAMPLE_16BIT_SCALING;
+  unsigned long i = 0;
+
+  for (; i + 8 <= nframes; i += 8) {
+    const int16x8x2_t v = vld2q_s16((const int16_t *)(src + 4*i));
+    vst1q_f32(left + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[0]))), scale));
+    vst1q_f32(left + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[0]))), scale));
+    vst1q_f32(right + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[1]))), scale));
+    vst1q_f32(right + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[1]))), scale));
+  }
+  s16_deinterleave2(left + i, right + i, src + 4*i, nframes - i);
+}
+
+static void
+s16_to_float_neon(float *dst, const char *src,
+		  unsigned long nsamples) {
+  const float scale = 1.0f / SAMPLE_16BIT_SCALING;
+  unsigned long i = 0;
+
+  for (; i + 8 <= nsamples; i += 8) {
+    const int16x8_t v = vld1q_s16((const int16_t *)(src + 2*i));
+    vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+    vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+  }
+  s16_to_float(dst + i, src + 2*i, nsamples - i);
+}
+
+/* vld3 splits the three bytes of eight samples into separate vectors */
+static inline float32x4x2_t
+s24_3le_load8_neon(const char *src) {
+  const uint8x8x3_t b = vld3_u8((const uint8_t *)src);
+  const uint16x8_t b0 = vmovl_u8(b.val[0]);
+  const uint16x8_t b1 = vmovl_u8(b.val[1]);
+  const uint16x8_t b2 = vmovl_u8(b.val[2]);
+  const uint32x4_t lo = vorrq_u32(vorrq_u32(vshlq_n_u32(vmovl_u16(vget_low_u16(b0)), 8),
+					    vshlq_n_u32(vmovl_u16(vget_low_u16(b1)), 16)),
+				  vshlq_n_u32(vmovl_u16(vget_low_u16(b2)), 24));
+  const uint32x4_t hi = vorrq_u32(vorrq_u32(vshlq_n_u32(vmovl_u16(vget_high_u16(b0)), 8),
+					    vshlq_n_u32(vmovl_u16(vget_high_u16(b1)), 16)),
+				  vshlq_n_u32(vmovl_u16(vget_high_u16(b2)), 24));
+  float32x4x2_t f;
+  f.val[0] = vmulq_n_f32(vcvtq_f32_s32(vshrq_n_s32(vreinterpretq_s32_u32(lo), 8)),
+			 1.0f / SAMPLE_24BIT_SCALING);
+  f.val[1] = vmulq_n_f32(vcvtq_f32_s32(vshrq_n_s32(vreinterpretq_s32_u32(hi), 8)),
+			 1.0f / SAMPLE_24BIT_SCALING);
+  return f;
+}
+
+static void
+s24_3le_to_float_neon(float *dst, const char *src,
+		      unsigned long nsamples) {
+  unsigned long i = 0;
+
+  for (; i + 8 <= nsamples; i += 8) {
+    const float32x4x2_t f = s24_3le_load8_neon(src + 3*i);
+    vst1q_f32(dst + i, f.val[0]);
+    vst1q_f32(dst + i + 4, f.val[1]);
+  }
+  s24_3le_to_float(dst + i, src + 3*i, nsamples - i);
+}
+
+static void
+s24_3le_deinterleave2_neon(float *left, float *right,
+			   const char *src, unsigned long nframes) {
+  unsigned long i = 0;
+
+  for (; i + 4 <= nframes; i += 4) {
+    const float32x4x2_t f = s24_3le_load8_neon(src + 6*i);
+    const float32x4x2_t lr = vuzpq_f32(f.val[0], f.val[1]);
+    vst1q_f32(left + i, lr.val[0]);
+    vst1q_f32(right + i, lr.val[1]);
+  }
+  s24_3le_deinterleave2(left + i, right + i, src + 6*i, nframes - i);
+}
+
+static void
+s32_deinterleave2_neon(float *left, float *right,
+		       const char *src, unsigned long nframes) {
+  const float scale = 1.0f / SAMPLE_32BIT_SCALING;
+  unsigned long i = 0;
+
+  for (; i + 4 <= nframes; i += 4) {
+    const int32x4x2_t v = vld2q_s32((const int32_t *)(src + 8*i));
+    vst1q_f32(left + i, vmulq_n_f32(vcvtq_f32_s32(v.val[0]), scale));
+    vst1q_f32(right + i, vmulq_n_f32(vcvtq_f32_s32(v.val[1]), scale));
+  }
+  s32_deinterleave2(left + i, right + i, src + 8*i, nframes - i);
+}
+
+static void
+s32_to_float_neon(float *dst, const char *src,
+		  unsigned long nsamples) {
+  const float scale = 1.0f / SAMPLE_32BIT_SCALING;
+  unsigned long i = 0;
+
+  for (; i + 4 <= nsamples; i += 4)
+    vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vld1q_s32((const int32_t *)(src + 4*i))), scale));
+  s32_to_float(dst + i, src + 4*i, nsamples - i);
+}
+
+static void
+float_deinterleave2_neon(float *left, float *right,
+			 const char *src, unsigned long nframes) {
+  unsigned long i = 0;
+
+  for (; i + 4 <= nframes; i += 4) {
+    const float32x4x2_t v = vld2q_f32((const float *)(src + 8*i));
+    vst1q_f32(left + i, v.val[0]);
+    vst1q_f32(right + i, v.val[1]);
+  }
+  float_deinterleave2(left + i, right + i, src + 8*i, nframes - i);
+}
+#endif
+
+#define FORMAT_S32 { SND_PCM_FORMAT_S32, 4, sample_move_dS_s32, \
+                     s32_to_float, s32_deinterleave2 }
+#define FORMAT_S24_3LE { SND_PCM_FORMAT_S24_3LE, 3, sample_move_dS_s24_3le, \
+                         s24_3le_to_float, s24_3le_deinterleave2 }
+#define FORMAT_S16 { SND_PCM_FORMAT_S16, 2, sample_move_dS_s16, \
+                     s16_to_float, s16_deinterleave2 }
+#define FORMAT_FLOAT { SND_PCM_FORMAT_FLOAT_LE, 4, sample_move_dS_float, \
+                       float_to_float, float_deinterleave2 }
+
+/* Preferred formats first, the vector versions are picked at runtime
+ * by setupConverters().  A build for one format only has that one, and
+ * its sample size and the format index are constants.
+ */
+#if defined(SI470X_FORMAT_S32)
+static alsa_format_t formats[] = { FORMAT_S32 };
+#define SAMPLE_SIZE 4
+#elif defined(SI470X_FORMAT_S24_3LE)
+static alsa_format_t formats[] = { FORMAT_S24_3LE };
+#define SAMPLE_SIZE 3
+#elif defined(SI470X_FORMAT_S16)
+static alsa_format_t formats[] = { FORMAT_S16 };
+#define SAMPLE_SIZE 2
+#elif defined(SI470X_FORMAT_FLOAT)
+static alsa_format_t formats[] = { FORMAT_FLOAT };
+#define SAMPLE_SIZE 4
+#else
+static alsa_format_t formats[] = {
+  FORMAT_S32, FORMAT_S24_3LE, FORMAT_S16, FORMAT_FLOAT
+};
+#endif
+#define NUMFORMATS (sizeof(formats)/sizeof(formats[0]))
+#ifdef SAMPLE_SIZE
+static const int format = 0;
+#else
+static int format = 0;
+#endif
+
+/* Bytes per sample of the capture format */
+static inline size_t
+sampleSize() {
+#ifdef SAMPLE_SIZE
+  return SAMPLE_SIZE;
+#else
+  return formats[format].sample_size;
+#endif
+}
+
+static void
+setFormatConverters(snd_pcm_format_t id,
+                    void (*to_float) (float *, const char *, unsigned long),
+                    void (*deinterleave2) (float *, float *,
+                                           const char *, unsigned long)) {
+  for (int i = 0; i < NUMFORMATS; i++) {
+    if (formats[i].format_id == id) {
+      if (to_float) formats[i].to_float = to_float;
+      if (deinterleave2) formats[i].deinterleave2 = deinterleave2;
+    }
+  }
+}
+
+static void
+setupConverters() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    setFormatConverters(SND_PCM_FORMAT_S16,
+                        s16_to_float_sse2, s16_deinterleave2_sse2);
+    setFormatConverters(SND_PCM_FORMAT_S32,
+                        s32_to_float_sse2, s32_deinterleave2_sse2);
+    setFormatConverters(SND_PCM_FORMAT_FLOAT_LE,
+                        NULL, float_deinterleave2_sse2);
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    setFormatConverters(SND_PCM_FORMAT_S24_3LE,
+                        s24_3le_to_float_ssse3, s24_3le_deinterleave2_ssse3);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    setFormatConverters(SND_PCM_FORMAT_S16,
+                        s16_to_float_avx2, s16_deinterleave2_avx2);
+    setFormatConverters(SND_PCM_FORMAT_S32, s32_to_float_avx2, NULL);
+  }
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  setFormatConverters(SND_PCM_FORMAT_S16,
+                      s16_to_float_neon, s16_deinterleave2_neon);
+  setFormatConverters(SND_PCM_FORMAT_S24_3LE,
+                      s24_3le_to_float_neon, s24_3le_deinterleave2_neon);
+  setFormatConverters(SND_PCM_FORMAT_S32,
+                      s32_to_float_neon, s32_deinterleave2_neon);
+  setFormatConverters(SND_PCM_FORMAT_FLOAT_LE,
+                      NULL, float_deinterleave2_neon);
+#endif
+}
+
+static int
+set_hwformat(snd_pcm_t *handle, snd_pcm_hw_params_t *params) {
+  int err;
+
+  for (int i=0; i<NUMFORMATS; i++) {
+    err = snd_pcm_hw_params_set_format(handle, params, formats[i].format_id);
+#ifndef SAMPLE_SIZE
+    if (err == 0) {
+      format = i;
+      break;
+    }
+#endif
+  }
+
+  return err;
+}
+
+static int
+xrun_recovery(snd_pcm_t *handle, int err) {
+  if (err == -EPIPE) { /* under-run */
+    err = snd_pcm_prepare(handle);
+    if (err < 0)
+      printf("Can't recovery from underrun, prepare failed: %s\n",
+	     snd_strerror(err));
+  } else if (err == -EAGAIN) {
+    while ((err = snd_pcm_resume(handle)) == -EAGAIN)
+      usleep(100);	/* wait until the suspend flag is released */
+    if (err < 0) {
+      err = snd_pcm_prepare(handle);
+      if (err < 0)
+	printf("Can't recovery from suspend, prepare failed: %s\n",
+	       snd_strerror(err));
+    }
+  }
+  return err;
+}
+
+static inline int
+set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params,
+             snd_pcm_access_t access, unsigned int rate, unsigned int channels,
+             unsigned int period, unsigned int nperiods) {
+  int err, dir=0;
+  unsigned int buffer_time;
+  unsigned int period_time;
+  unsigned int rrate;
+
+  /* choose all parameters */
+  if ((err = snd_pcm_hw_params_any(handle, params)) == 0) {
+    if ((err = snd_pcm_hw_params_set_access(handle, params, access)) == 0) {
+      if ((err = set_hwformat(handle, params)) == 0) {
+#ifdef SI470X_CHANNELS
+	/* The build converts SI470X_CHANNELS only */
+	if ((err = snd_pcm_hw_params_set_channels(handle, params,
+						  channels)) == 0) {
+#else
+	unsigned int rchannels = channels;
+	if ((err = snd_pcm_hw_params_set_channels_near(handle, params,
+						       &rchannels)) == 0) {
+	  if (rchannels != channels) {
+	    printf("WARNING: channel count does not match (requested %d got %d)\n",
+		   channels, rchannels);
+	    num_channels = rchannels;
+	  }
+#endif
+	  rrate = rate;
+	  if ((err = snd_pcm_hw_params_set_rate_near(handle, params,
+						     &rrate, NULL)) >= 0) {
+	    if (rrate != rate) {
+	      printf("WARNING: Rate doesn't match (requested %iHz, get %iHz)\n", rate,
+		     rrate);
+	      inputSampleRate = rrate;
+	    }
+	    buffer_time = 1000000*(uint64_t)period*nperiods/rrate;
+            printf("buffer_time = %d\n", buffer_time);
+	    if ((err = snd_pcm_hw_params_set_buffer_time_near(handle, params,
+							      &buffer_time,
+							      &dir)) >= 0) {
+              snd_pcm_uframes_t real_buffer_size;
+	      if ((err = snd_pcm_hw_params_get_buffer_size(params,
+							   &real_buffer_size))
+		  >= 0) {
+                printf("Buffer size: %d\n", (int)real_buffer_size);
+		if (real_buffer_size != nperiods * period) {
+		  printf("WARNING: buffer size does not match: "
+			 "requested %d, got %d\n",
+			 nperiods * period, (int) real_buffer_size);
+		}
+		/* set the period time */
+		printf("period_time = %d\n", period_time = 1000000U*(uint64_t)period/rrate);
+		if ((err = snd_pcm_hw_params_set_period_time_near(handle,
+								  params,
+								  &period_time,
+								  &dir))
+		    == 0) {
+                  snd_pcm_uframes_t real_period_size;
+		  if ((err = snd_pcm_hw_params_get_period_size(params,
+							       &real_period_size, NULL))
+		      == 0) {
+                    printf("Period size: %d\n", (int)real_period_size);
+		    if (real_period_size != period) {
+		      printf("WARNING: period size does not match: "
+			     "requested %i, got %i\n",
+			     period, (int)real_period_size);
+		      period_size = real_period_size;
+		    }
+
+		    /* write the parameters to device */
+		    if ((err = snd_pcm_hw_params(handle, params)) == 0) {
+                      if (verbose)
+                        printf("Input buffer time: %.1fms\n",
+                               1000.0/(rrate/(float)real_buffer_size));
+		      return 0;
+		    } else {
+		      printf("Unable to set hw params for capture: %s\n",
+			     snd_strerror(err));
+		    }
+		  } else {
+		    printf("Unable to get period size back: %s\n",
+                           snd_strerror(err));
+		  }
+		} else {
+		  printf("Unable to set period time %i for capture: %s\n",
+			 (int)(1000000*(uint64_t)period/rate),
+                         snd_strerror(err));
+		}
+	      } else {
+		printf("Unable to get buffer size back: %s\n",
+		       snd_strerror(err));
+	      }
+	    } else {
+	      printf("Unable to set buffer time %i for capture: %s\n",
+		     (int)(1000000*(uint64_t)period*nperiods/rate),
+                     snd_strerror(err));
+	    }
+	  } else {
+	    printf("Rate %iHz not available for playback: %s\n",
+		   rate, snd_strerror(err));
+	  }
+	} else {
+	  printf("Channels count (%i) not available for record: %s\n",
+		 channels, snd_strerror(err));
+	}
+      } else {
+	printf("Sample format not available for playback: %s\n",
+	       snd_strerror(err));
+      }
+    } else {
+      printf("Access type not available for capture: %s\n", snd_strerror(err));
+    }
+  } else {
+    printf("No configurations available for capture: %s\n", snd_strerror(err));
+  }
+
+  return err;
+}
+
+static inline int
+set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams, int period) {
+  int err;
+
+  if ((err = snd_pcm_sw_params_current(handle, swparams)) == 0) {
+    /* start the transfer once start_threshold periods are in */
+    if ((err = snd_pcm_sw_params_set_start_threshold(handle, swparams,
+						     start_threshold*period))
+	>= 0) {
+      if ((err = snd_pcm_sw_params_set_stop_threshold(handle, swparams,
+						      -1)) >= 0) {
+	if ((err = snd_pcm_sw_params_set_avail_min(handle, swparams,
+						   avail_min*period)) >= 0) {
+	  if ((err = snd_pcm_sw_params(handle, swparams)) == 0) {
+	    return 0;
+	  } else {
+	    printf("Unable to set sw params for capture: %s\n",
+		   snd_strerror(err));
+	  }
+	} else {
+	  printf("Unable to set avail min for capture: %s\n",
+		 snd_strerror(err));
+	}
+      } else {
+	printf("Unable to set start threshold mode for capture: %s\n",
+	       snd_strerror(err));
+      }
+    } else {
+      printf("Unable to set start threshold mode for capture: %s\n",
+	     snd_strerror(err));
+    }
+  } else {
+    printf("Unable to determine current sw params for capture: %s\n",
+	   snd_strerror(err));
+  }
+
+  return err;
+}
+
+/* Capture straight from the DMA buffer when the device allows it */
+static snd_pcm_access_t captureAccess = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+/* Adopt the buffer the driver set up and report what it comes to */
+static void
+checkNegotiated(snd_pcm_hw_params_t *params, snd_pcm_access_t access) {
+  snd_pcm_uframes_t size;
+  unsigned int periods;
+
+  if (snd_pcm_hw_params_get_buffer_size(params, &size) != 0) return;
+  periods = size / period_size;
+  /* Half of an mmap buffer is kept for rewinds, see openAudioIn() */
+  if (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) periods /= 2;
+  if (periods < 2) periods = 2;
+  if (periods != num_periods) {
+    printf("WARNING: %u periods instead of %u\n", periods, num_periods);
+    num_periods = periods;
+  }
+  printf("Capture: %s profile, %u Hz, %u x %u frames (%.1fms)\n",
+         latencyProfile->name, inputSampleRate, num_periods, period_size,
+         1000.0 * num_periods * period_size / inputSampleRate);
+}
+
+/* The capture ring needs a power of two sized buffer */
+static int
+mmapBufferUsable(snd_pcm_hw_params_t *params) {
+  snd_pcm_uframes_t size;
+
+  return snd_pcm_hw_params_get_buffer_size(params, &size) == 0
+      && (size & (size - 1)) == 0;
+}
+
+static inline snd_pcm_t *
+openAudioIn(char *device, int rate, int channels, int period, int nperiods) {
+  int err;
+  snd_pcm_t *handle;
+
+  setupConverters();
+  if ((err = snd_pcm_open(&(handle), device,
+			  SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) == 0) {
+    snd_pcm_hw_params_t *hwparams;
+
+    snd_pcm_hw_params_alloca(&hwparams);
+    err = -1;
+    if (captureAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+      /* Twice the periods, half of the buffer is kept for rewinds */
+      if ((err = set_hwparams(handle, hwparams, captureAccess,
+                              rate, channels, period, 2*nperiods)) == 0 &&
+	  !mmapBufferUsable(hwparams)) {
+	printf("mmap buffer size is not a power of two\n");
+	err = -1;
+      }
+      if (err != 0) printf("Falling back to read/write access\n");
+    }
+    if (err != 0)
+      err = set_hwparams(handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
+			 rate, channels, period, nperiods);
+    if (err == 0) {
+      snd_pcm_sw_params_t *swparams;
+      snd_pcm_access_t access;
+
+      if (snd_pcm_hw_params_get_access(hwparams, &access) == 0)
+	checkNegotiated(hwparams, access);
+      snd_pcm_sw_params_alloca(&swparams);
+      if ((err = set_swparams(handle, swparams, period_size)) == 0) {
+	snd_pcm_start(handle);
+	snd_pcm_wait(handle, 100);
+
+	return handle;
+      } else {
+	printf("Setting of swparams failed: %s\n", snd_strerror(err));
+      }
+    } else {
+      printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+    }
+  } else {
+    printf("AudioIn open error: %s\n", snd_strerror(err));
+  }
+
+  return NULL;
+}
+
+/* Capture ring
+ *
+ * A capture thread moves frames from ALSA into a preallocated single
+ * producer, single consumer ring so that the JACK process() callback
+ * only ever consumes from memory.  Positions count frames and only
+ * ever grow, they are shared through acquire/release atomics.  The
+ * writer leaves the reserve frames behind the read position alone, so
+ * the reader may step back over them to repeat audio.
+ *
+ * With mmap access the ring is the ALSA DMA buffer itself.  Its capture
+ * thread only publishes the hardware position and hands frames back to
+ * the device once the reader and its reserve have moved past them.
+ *
+ * Several sinks can read one ring, each through a reader ring of its
+ * own which shares the data and has its own read position, see
+ * addFrameRingReader().  The writer keeps the reserve behind the
+ * slowest reader, unless that reader is a full ring behind: then it is
+ * marked lagging and left behind, and it skips to the write position
+ * the next time it looks at its fill.  A slow sink so only loses its
+ * own audio.  The reserve is what it has left to finish a read it was
+ * in the middle of.
+ */
+
+#define RING_READERS 4
+
+typedef struct FrameRing FrameRing;
+
+struct FrameRing {
+  char *data;
+  size_t frameSize;
+  unsigned long size;     /* frames, a power of two */
+  unsigned long reserve;
+  unsigned long readPos;
+  unsigned long writePos;
+  uint64_t writeTime;     /* CLOCK_MONOTONIC ns of the last write */
+  int mapped;             /* data belongs to the ALSA mmap area */
+
+  FrameRing *readers[RING_READERS];
+  int readerCount;
+  FrameRing *source;      /* the ring read, if this is a reader */
+  int lagging;            /* set by the writer, cleared by the reader */
+  unsigned long dropped;  /* frames skipped when lagging */
+};
+
+/* An ALSA capture device feeding a ring */
+typedef struct {
+  snd_pcm_t *pcm;
+  FrameRing ring;
+  unsigned long committed; /* ring position of the ALSA appl_ptr (mmap) */
+  unsigned long dropped;   /* frames lost because the ring was full */
+  unsigned long xruns;     /* device overruns, updated atomically */
+  pthread_t thread;
+} AudioCapture;
+
+static int
+initFrameRing(FrameRing *ring, unsigned long frames, size_t frameSize,
+              unsigned long reserve) {
+  unsigned long size = 1;
+
+  while (size < frames + reserve) size <<= 1;
+  memset(ring, 0, sizeof(*ring));
+  if ((ring->data = malloc(size * frameSize)) == NULL) {
+    fprintf(stderr, "no memory for capture ring\n");
+    return 0;
+  }
+  prefault("capture ring", ring->data, size * frameSize);
+  ring->frameSize = frameSize;
+  ring->size = size;
+  ring->reserve = reserve;
+  return 1;
+}
+
+/* Use the DMA buffer of an mmap capture device as the ring */
+static int
+initMappedFrameRing(FrameRing *ring, snd_pcm_t *handle, size_t frameSize) {
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t bufferSize, periodSize, offset, frames = 0;
+  int err;
+
+  memset(ring, 0, sizeof(*ring));
+  if ((err = snd_pcm_get_params(handle, &bufferSize, &periodSize)) < 0 ||
+      (err = snd_pcm_avail_update(handle)) < 0 ||
+      (err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames)) < 0) {
+    fprintf(stderr, "cannot access mmap area: %s\n", snd_strerror(err));
+    return 0;
+  }
+  if (areas[0].first != 0 || areas[0].step != frameSize*8) {
+    fprintf(stderr, "unexpected mmap area layout\n");
+    return 0;
+  }
+  ring->data = areas[0].addr;
+  ring->frameSize = frameSize;
+  ring->size = bufferSize;
+  ring->reserve = bufferSize / 2;
+  ring->mapped = 1;
+  return 1;
+}
+
+/**
+ * Set up reader to consume ring from its current write position on.
+ * All readers have to be added before the writer starts.
+ */
+static int
+addFrameRingReader(FrameRing *ring, FrameRing *reader) {
+  if (ring->readerCount == RING_READERS) {
+    fprintf(stderr, "too many readers of the capture ring\n");
+    return 0;
+  }
+  memset(reader, 0, sizeof(*reader));
+  reader->data = ring->data;
+  reader->frameSize = ring->frameSize;
+  reader->size = ring->size;
+  reader->reserve = ring->reserve;
+  reader->readPos = reader->writePos = ring->writePos;
+  reader->source = ring;
+  ring->readers[ring->readerCount++] = reader;
+  return 1;
+}
+
+static void
+freeFrameRing(FrameRing *ring) {
+  if (!ring->mapped && ring->source == NULL) free(ring->data);
+  ring->data = NULL;
+}
+
+/* Reader side, skip what the writer did not wait for */
+static void
+catchUpFrameRing(FrameRing *ring) {
+  const unsigned long writePos = __atomic_load_n(&ring->writePos,
+                                                 __ATOMIC_ACQUIRE);
+
+  __atomic_add_fetch(&ring->dropped, writePos - ring->readPos,
+                     __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->readPos, writePos, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->lagging, 0, __ATOMIC_RELEASE);
+}
+
+/* Frames available to the reader */
+static inline unsigned long
+frameRingFill(FrameRing *ring) {
+  if (ring->source != NULL && __atomic_load_n(&ring->lagging, __ATOMIC_ACQUIRE))
+    catchUpFrameRing(ring);
+  return __atomic_load_n(&ring->writePos, __ATOMIC_ACQUIRE)
+       - __atomic_load_n(&ring->readPos, __ATOMIC_RELAXED);
+}
+
+/**
+ * Writer side, the read position of the slowest reader which keeps up.
+ * Readers a full ring behind are marked lagging here.
+ */
+static inline unsigned long
+frameRingReadPos(FrameRing *ring) {
+  unsigned long readPos = ring->writePos;
+
+  if (ring->readerCount == 0)
+    return __atomic_load_n(&ring->readPos, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < ring->readerCount; i++) {
+    FrameRing *reader = ring->readers[i];
+    unsigned long pos;
+
+    if (__atomic_load_n(&reader->lagging, __ATOMIC_ACQUIRE)) continue;
+    pos = __atomic_load_n(&reader->readPos, __ATOMIC_ACQUIRE);
+    if (ring->writePos - pos + ring->reserve >= ring->size) {
+      __atomic_store_n(&reader->lagging, 1, __ATOMIC_RELEASE);
+      continue;
+    }
+    if (ring->writePos - pos > ring->writePos - readPos) readPos = pos;
+  }
+  return readPos;
+}
+
+/* Writer side, returns a pointer to the contiguous free space */
+static inline char *
+frameRingWriteSpace(FrameRing *ring, unsigned long *frames) {
+  const unsigned long writePos = ring->writePos;
+  const unsigned long used = writePos - frameRingReadPos(ring);
+  const unsigned long offset = writePos & (ring->size - 1);
+  unsigned long space = ring->size - ring->reserve - used;
+
+  if (used + ring->reserve > ring->size) space = 0;
+  if (space > ring->size - offset) space = ring->size - offset;
+  *frames = space;
+  return ring->data + offset * ring->frameSize;
+}
+
+static inline void
+frameRingWritten(FrameRing *ring, unsigned long frames) {
+  const unsigned long writePos = ring->writePos + frames;
+  const uint64_t now = monotonicTime();
+
+  __atomic_store_n(&ring->writePos, writePos, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->writeTime, now, __ATOMIC_RELEASE);
+  for (int i = 0; i < ring->readerCount; i++) {
+    __atomic_store_n(&ring->readers[i]->writePos, writePos, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->readers[i]->writeTime, now, __ATOMIC_RELEASE);
+  }
+}
+
+/* Reader side, returns a pointer to the frame at the given offset from
+ * the read position and how many frames follow it contiguously.
+ */
+static inline char *
+frameRingPeek(FrameRing *ring, unsigned long from, unsigned long *frames) {
+  const unsigned long offset = (ring->readPos + from) & (ring->size - 1);
+
+  *frames = ring->size - offset;
+  return ring->data + offset * ring->frameSize;
+}
+
+static inline void
+frameRingConsume(FrameRing *ring, unsigned long frames) {
+  __atomic_store_n(&ring->readPos, ring->readPos + frames, __ATOMIC_RELEASE);
+}
+
+/* Step the reader back over already consumed frames */
+static inline unsigned long
+frameRingRewind(FrameRing *ring, unsigned long frames) {
+  if (frames > ring->reserve) frames = ring->reserve;
+  if (frames > ring->readPos) frames = ring->readPos;
+  __atomic_store_n(&ring->readPos, ring->readPos - frames, __ATOMIC_RELEASE);
+  return frames;
+}
+
+/**
+ * Move what the device has captured into the ring without blocking.
+ * Returns the number of frames, -EAGAIN if there are none yet, -ENOBUFS
+ * if the ring is full or another negative error code if the device
+ * could not be recovered.
+ */
+static snd_pcm_sframes_t
+readCapture(AudioCapture *capture) {
+  unsigned long frames;
+  char *buf = frameRingWriteSpace(&capture->ring, &frames);
+  snd_pcm_sframes_t err;
+
+  if (frames == 0) return -ENOBUFS;
+  if (frames > period_size) frames = period_size;
+  err = snd_pcm_readi(capture->pcm, buf, frames);
+  if (err == -EAGAIN) return err;
+  if (err < 0) {
+    if (err == -EPIPE) __atomic_add_fetch(&capture->xruns, 1, __ATOMIC_RELAXED);
+    if (xrun_recovery(capture->pcm, err) < 0) {
+      printf("xrun_recover failed: %s\n", snd_strerror(err));
+      return err;
+    }
+    return -EAGAIN;
+  }
+  frameRingWritten(&capture->ring, err);
+  return err;
+}
+
+/**
+ * Publish the hardware position of an mmap capture device and give
+ * back what the reader is done with, and whatever the device has
+ * overrun anyway.  Returns a negative error code if the device could
+ * not be recovered.
+ */
+static int
+updateMappedCapture(AudioCapture *capture) {
+  FrameRing *ring = &capture->ring;
+  snd_pcm_sframes_t avail = snd_pcm_avail_update(capture->pcm);
+  unsigned long readPos, commit = 0;
+
+  if (avail < 0) {
+    if (avail == -EPIPE)
+      __atomic_add_fetch(&capture->xruns, 1, __ATOMIC_RELAXED);
+    if (xrun_recovery(capture->pcm, avail) < 0) {
+      printf("xrun_recover failed: %s\n", snd_strerror(avail));
+      return avail;
+    }
+    /* The device starts over at the beginning of its buffer */
+    capture->committed = (ring->writePos + ring->size - 1) & ~(ring->size - 1);
+    frameRingWritten(ring, capture->committed - ring->writePos);
+    snd_pcm_start(capture->pcm);
+    return 0;
+  }
+  if (capture->committed + avail > ring->writePos)
+    frameRingWritten(ring, capture->committed + avail - ring->writePos);
+
+  readPos = frameRingReadPos(ring);
+  if (readPos > capture->committed + ring->reserve)
+    commit = readPos - ring->reserve - capture->committed;
+  if (avail > ring->size && commit < avail - ring->size)
+    commit = avail - ring->size;
+  while (commit > 0) {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames = commit;
+    snd_pcm_sframes_t err;
+
+    if ((err = snd_pcm_mmap_begin(capture->pcm, &areas,
+                                  &offset, &frames)) < 0 ||
+	(err = snd_pcm_mmap_commit(capture->pcm, offset, frames)) < 0) {
+      printf("mmap commit failed: %s\n", snd_strerror(err));
+      break;
+    }
+    capture->committed += frames;
+    commit -= frames;
+  }
+  return 0;
+}
+
+static void *
+captureThread(void *arg) {
+  AudioCapture *capture = arg;
+  const uint64_t periodTime = 1000000*(uint64_t)period_size/inputSampleRate;
+
+  prefaultStack();
+  while (!quit) {
+    snd_pcm_sframes_t err;
+
+    if (capture->ring.mapped) {
+      if (updateMappedCapture(capture) < 0) quit = 1;
+      usleep(periodTime / 2);
+      continue;
+    }
+    err = readCapture(capture);
+    if (err == -ENOBUFS) {
+      /* Nobody is consuming, let ALSA run into an overrun */
+      usleep(periodTime);
+    } else if (err == -EAGAIN) {
+      snd_pcm_wait(capture->pcm, 1000);
+    } else if (err < 0) {
+      quit = 1;
+    }
+  }
+
+  return NULL;
+}
+
+/* Set up the ring for a device opened by openAudioIn() */
+static int
+initCapture(AudioCapture *capture, snd_pcm_t *pcm) {
+  const size_t frameSize = sampleSize() * num_channels;
+  const unsigned long bufferFrames = num_periods*period_size;
+  snd_pcm_hw_params_t *hwparams;
+  snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
+
+  memset(capture, 0, sizeof(*capture));
+  capture->pcm = pcm;
+  snd_pcm_hw_params_alloca(&hwparams);
+  if (snd_pcm_hw_params_current(pcm, hwparams) == 0)
+    snd_pcm_hw_params_get_access(hwparams, &access);
+  if (access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+    return initMappedFrameRing(&capture->ring, pcm, frameSize);
+  return initFrameRing(&capture->ring, 2*bufferFrames, frameSize, bufferFrames);
+}
+
+/* Start the capture thread of a ring set up by initCapture() */
+static int
+startCapture(AudioCapture *capture) {
+  int err;
+
+  if ((err = pthread_create(&capture->thread, NULL,
+                            captureThread, capture)) != 0) {
+    fprintf(stderr, "cannot create capture thread: %s\n", strerror(err));
+    return 0;
+  }
+  setupRealtimeThread("capture", capture->thread, &realtime.audio);
+  return 1;
+}
+
+static void
+stopCapture(AudioCapture *capture) {
+  quit = 1;
+  pthread_join(capture->thread, NULL);
+  freeFrameRing(&capture->ring);
+}
+
+/* The capture stage of runAudio(), read by all of its sinks */
+static AudioCapture audioCapture;
+
+#ifdef HAVE_JACK
+/* Convert frames of one channel from the ring, handling wrap around */
+static void
+convertFromRing(FrameRing *ring, float *dst, unsigned long frames,
+                int channel) {
+  unsigned long done = 0;
+
+  while (done < frames) {
+    unsigned long n;
+    char *src = frameRingPeek(ring, done, &n);
+
+    if (n > frames - done) n = frames - done;
+    formats[format].soundcard_to_jack(dst + done,
+                                      src + sampleSize()*channel,
+                                      n, ring->frameSize);
+    done += n;
+  }
+}
+
+/* Split stereo frames from the ring into two channels in one pass */
+static void
+deinterleaveFromRing(FrameRing *ring, float *left, float *right,
+                     unsigned long frames) {
+  unsigned long done = 0;
+
+  while (done < frames) {
+    unsigned long n;
+    char *src = frameRingPeek(ring, done, &n);
+
+    if (n > frames - done) n = frames - done;
+    formats[format].deinterleave2(left + done, right + done, src, n);
+    done += n;
+  }
+}
+#endif
+
+/* Convert interleaved frames of all channels from the ring */
+static void
+convertInterleavedFromRing(FrameRing *ring, float *dst, unsigned long frames) {
+  unsigned long done = 0;
+
+  while (done < frames) {
+    unsigned long n;
+    char *src = frameRingPeek(ring, done, &n);
+
+    if (n > frames - done) n = frames - done;
+    formats[format].to_float(dst + done*num_channels, src, n*num_channels);
+    done += n;
+  }
+}
+
+#ifdef HAVE_VORBIS
+/* Recording
+ *
+ * Frames are taken from the capture ring by an encoder thread, resampled
+ * to recordSampleRate and encoded to Ogg Vorbis in-process.
+ */
+
+#include <vorbis/vorbisenc.h>
+
+static const long recordSampleRate = 48000;
+static const float recordQuality = 0.5; /* oggenc -q 5 */
+
+typedef struct {
+  FrameRing *ring;
+  pthread_t thread;
+  int finished;           /* 1 when done, -1 after a write error */
+  FILE *file;
+  SRC_STATE *src;
+  float *in, *out;
+  unsigned long inFrames, outFrames;
+  ogg_stream_state os;
+  vorbis_info vi;
+  vorbis_comment vc;
+  vorbis_dsp_state vd;
+  vorbis_block vb;
+} Recorder;
+
+static int
+writeOggPages(Recorder *rec, int flush) {
+  ogg_page og;
+
+  while (flush? ogg_stream_flush(&rec->os, &og)
+              : ogg_stream_pageout(&rec->os, &og)) {
+    if (fwrite(og.header, 1, og.header_len, rec->file) != og.header_len ||
+        fwrite(og.body, 1, og.body_len, rec->file) != og.body_len) {
+      perror("fwrite");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Move finished Vorbis packets into Ogg pages */
+static int
+drainEncoder(Recorder *rec) {
+  ogg_packet op;
+
+  while (vorbis_analysis_blockout(&rec->vd, &rec->vb) == 1) {
+    vorbis_analysis(&rec->vb, NULL);
+    vorbis_bitrate_addblock(&rec->vb);
+    while (vorbis_bitrate_flushpacket(&rec->vd, &op)) {
+      ogg_stream_packetin(&rec->os, &op);
+      if (!writeOggPages(rec, 0)) return 0;
+    }
+  }
+  return 1;
+}
+
+/* Hand interleaved frames to the encoder */
+static void
+encodeFrames(Recorder *rec, const float *src, unsigned long frames) {
+  float **buffer = vorbis_analysis_buffer(&rec->vd, frames);
+  unsigned long i;
+  int chn;
+
+  for (i = 0; i < frames; i++)
+    for (chn = 0; chn < num_channels; chn++)
+      buffer[chn][i] = *src++;
+  vorbis_analysis_wrote(&rec->vd, frames);
+}
+
+/* Encode a chunk of frames from the ring, returns how many were used */
+static unsigned long
+recordFromRing(Recorder *rec, FrameRing *ring, unsigned long frames,
+               int last) {
+  if (frames > rec->inFrames) frames = rec->inFrames;
+  convertInterleavedFromRing(ring, rec->in, frames);
+  if (rec->src != NULL) {
+    SRC_DATA src_data = {
+      .data_in = rec->in,
+      .input_frames = frames,
+      .data_out = rec->out,
+      .output_frames = rec->outFrames,
+      .end_of_input = last,
+      .src_ratio = (double)recordSampleRate / inputSampleRate
+    };
+    int err;
+
+    if ((err = src_process(rec->src, &src_data)) != 0) {
+      fprintf(stderr, "src_process: %s\n", src_strerror(err));
+      return 0;
+    }
+    frames = src_data.input_frames_used;
+    if (src_data.output_frames_gen > 0)
+      encodeFrames(rec, rec->out, src_data.output_frames_gen);
+  } else if (frames > 0) {
+    encodeFrames(rec, rec->in, frames);
+  }
+  frameRingConsume(ring, frames);
+  return frames;
+}
+
+static void *
+encoderThread(void *arg) {
+  Recorder *rec = arg;
+  FrameRing *ring = rec->ring;
+  int ok = 1;
+
+  while (!quit && ok) {
+    unsigned long fill = frameRingFill(ring);
+
+    if (fill < period_size) {
+      usleep(500000*(uint64_t)period_size/inputSampleRate);
+      continue;
+    }
+    recordFromRing(rec, ring, fill, 0);
+    ok = drainEncoder(rec);
+  }
+
+  /* Encode what is left and close the stream */
+  if (ok) {
+    unsigned long fill;
+
+    while ((fill = frameRingFill(ring)) > 0)
+      if (recordFromRing(rec, ring, fill, 0) == 0) break;
+    if (rec->src != NULL) recordFromRing(rec, ring, 0, 1);
+    vorbis_analysis_wrote(&rec->vd, 0);
+    if (drainEncoder(rec)) writeOggPages(rec, 1);
+  }
+  __atomic_store_n(&rec->finished, ok? 1 : -1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+static int
+initRecorder(Recorder *rec, FrameRing *ring, const char *fileName) {
+  ogg_packet header, headerComment, headerCode;
+  int err;
+
+  memset(rec, 0, sizeof(*rec));
+  rec->ring = ring;
+  rec->inFrames = period_size;
+  rec->outFrames = period_size * recordSampleRate / inputSampleRate + 16;
+  if ((rec->in = malloc(rec->inFrames*num_channels*sizeof(float))) == NULL ||
+      (rec->out = malloc(rec->outFrames*num_channels*sizeof(float))) == NULL) {
+    fprintf(stderr, "no memory for recording buffers\n");
+    free(rec->in);
+    return 0;
+  }
+  prefault("recording input", rec->in, rec->inFrames*num_channels*sizeof(float));
+  prefault("recording output", rec->out,
+           rec->outFrames*num_channels*sizeof(float));
+  if (inputSampleRate != recordSampleRate &&
+      (rec->src = src_new(4-resample_quality, num_channels, &err)) == NULL) {
+    fprintf(stderr, "src_new: %s\n", src_strerror(err));
+  } else {
+    vorbis_info_init(&rec->vi);
+    if ((err = vorbis_encode_init_vbr(&rec->vi, num_channels,
+                                      recordSampleRate, recordQuality)) == 0) {
+      if ((rec->file = fopen(fileName, "wb")) != NULL) {
+        vorbis_comment_init(&rec->vc);
+        vorbis_comment_add_tag(&rec->vc, "ENCODER", "linux-si470x");
+        vorbis_analysis_init(&rec->vd, &rec->vi);
+        vorbis_block_init(&rec->vd, &rec->vb);
+        ogg_stream_init(&rec->os, rand());
+
+        vorbis_analysis_headerout(&rec->vd, &rec->vc,
+                                  &header, &headerComment, &headerCode);
+        ogg_stream_packetin(&rec->os, &header);
+        ogg_stream_packetin(&rec->os, &headerComment);
+        ogg_stream_packetin(&rec->os, &headerCode);
+        if (writeOggPages(rec, 1)) return 1;
+
+        ogg_stream_clear(&rec->os);
+        vorbis_block_clear(&rec->vb);
+        vorbis_dsp_clear(&rec->vd);
+        vorbis_comment_clear(&rec->vc);
+        fclose(rec->file);
+      } else {
+        perror(fileName);
+      }
+    } else {
+      fprintf(stderr, "cannot set up Vorbis encoder (%d)\n", err);
+    }
+    vorbis_info_clear(&rec->vi);
+    if (rec->src != NULL) src_delete(rec->src);
+  }
+  free(rec->in);
+  free(rec->out);
+
+  return 0;
+}
+
+static int
+freeRecorder(Recorder *rec) {
+  int ok = fclose(rec->file) == 0;
+
+  ogg_stream_clear(&rec->os);
+  vorbis_block_clear(&rec->vb);
+  vorbis_dsp_clear(&rec->vd);
+  vorbis_comment_clear(&rec->vc);
+  vorbis_info_clear(&rec->vi);
+  if (rec->src != NULL) src_delete(rec->src);
+  free(rec->in);
+  free(rec->out);
+
+  return ok;
+}
+
+/* Encode frames from ring into fileName on an encoder thread */
+static int
+startRecorder(Recorder *rec, FrameRing *ring, const char *fileName) {
+  int err;
+
+  if (!initRecorder(rec, ring, fileName)) return 0;
+  if ((err = pthread_create(&rec->thread, NULL, encoderThread, rec)) != 0) {
+    fprintf(stderr, "cannot create encoder thread: %s\n", strerror(err));
+    freeRecorder(rec);
+    return 0;
+  }
+  return 1;
+}
+
+/* Wait for the encoder thread to finish after quit has been set */
+static int
+stopRecorder(Recorder *rec) {
+  pthread_join(rec->thread, NULL);
+  return freeRecorder(rec) && rec->finished > 0;
+}
+#endif
+
+#ifdef HAVE_OPUS
+/* RTP streaming (-r HOST:PORT)
+ *
+ * A sink of the capture ring which is resampled to RTP_SAMPLE_RATE like
+ * a recording, encoded as Opus packets of rtpFrameTime ms and sent over
+ * UDP as RTP (RFC 7587).  The packets encoded in one wakeup go out
+ * with a single sendmmsg().  Their counters and the send jitter, the
+ * RFC 3550 interarrival jitter of the send times against the RTP
+ * timestamps, are served with the metrics of -M.
+ */
+
+#include <opus/opus.h>
+
+#define RTP_SAMPLE_RATE 48000
+#define RTP_PAYLOAD_TYPE 111  /* dynamic */
+#define RTP_HEADER_SIZE 12
+#define RTP_PACKET_MAX 1200   /* fits any path MTU */
+#define RTP_BATCH 8           /* packets per sendmmsg() */
+#define RTP_BITRATE 128000
+
+static char *rtpDestination = NULL; /* -r */
+static FrameRing rtpRing;           /* reader of the capture ring */
+static int rtpFrameTime = 20;       /* ms, -O */
+
+static struct {
+  unsigned long packets, bytes, batches, errors;
+  double jitter; /* s */
+} rtpStats;
+
+typedef struct {
+  FrameRing *ring;
+  int fd;
+  pthread_t thread;
+  SRC_STATE *src;
+  OpusEncoder *encoder;
+  float *in, *out;
+  unsigned long inFrames, outFrames;
+  unsigned long outFill;  /* frames in out not yet encoded */
+  int frameSize;          /* frames per packet */
+
+  uint16_t sequence;
+  uint32_t timestamp, ssrc;
+  uint64_t start;         /* monotonicTime() of the first packet */
+  unsigned long sent;
+  double transit;         /* of the last packet sent */
+  double jitter;          /* both in RTP_SAMPLE_RATE units */
+
+  unsigned char packets[RTP_BATCH][RTP_PACKET_MAX];
+  unsigned long timestamps[RTP_BATCH]; /* frames since the first packet */
+  struct iovec iov[RTP_BATCH];
+  struct mmsghdr msgs[RTP_BATCH];
+} RtpStreamer;
+
+/* Send the first count packets, returns 0 if the socket failed */
+static int
+sendRtpBatch(RtpStreamer *r, int count) {
+  const uint64_t now = monotonicTime();
+  double jitter;
+  int sent = 0;
+
+  while (sent < count) {
+    int n = sendmmsg(r->fd, r->msgs + sent, count - sent, 0);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != ECONNREFUSED) {
+        perror(rtpDestination);
+        return 0;
+      }
+      /* Nobody listening yet is no reason to stop */
+      __atomic_add_fetch(&rtpStats.errors, 1, __ATOMIC_RELAXED);
+      n = count - sent;
+    }
+    sent += n;
+  }
+  __atomic_add_fetch(&rtpStats.batches, 1, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < count; i++) {
+    const double transit = (now - r->start) * (RTP_SAMPLE_RATE / 1e9)
+                         - r->timestamps[i];
+
+    if (r->sent++ > 0)
+      r->jitter += (fabs(transit - r->transit) - r->jitter) / 16;
+    r->transit = transit;
+    __atomic_add_fetch(&rtpStats.bytes, r->iov[i].iov_len, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&rtpStats.packets, count, __ATOMIC_RELAXED);
+  jitter = r->jitter / RTP_SAMPLE_RATE;
+  __atomic_store(&rtpStats.jitter, &jitter, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Encode the next frameSize frames of out into packet slot */
+static int
+encodeRtpPacket(RtpStreamer *r, int slot) {
+  unsigned char *p = r->packets[slot];
+  const int length = opus_encode_float(r->encoder, r->out, r->frameSize,
+                                       p + RTP_HEADER_SIZE,
+                                       RTP_PACKET_MAX - RTP_HEADER_SIZE);
+
+  if (length < 0) {
+    fprintf(stderr, "opus_encode_float: %s\n", opus_strerror(length));
+    return 0;
+  }
+  if (r->start == 0) r->start = monotonicTime();
+  p[0] = 0X80;                                   /* version 2 */
+  p[1] = RTP_PAYLOAD_TYPE | (r->sent + slot == 0? 0X80 : 0); /* marker */
+  p[2] = r->sequence >> 8;
+  p[3] = r->sequence;
+  p[4] = r->timestamp >> 24;
+  p[5] = r->timestamp >> 16;
+  p[6] = r->timestamp >> 8;
+  p[7] = r->timestamp;
+  p[8] = r->ssrc >> 24;
+  p[9] = r->ssrc >> 16;
+  p[10] = r->ssrc >> 8;
+  p[11] = r->ssrc;
+  r->iov[slot].iov_len = RTP_HEADER_SIZE + length;
+  r->timestamps[slot] = (r->sent + slot) * r->frameSize;
+  r->sequence += 1;
+  r->timestamp += r->frameSize;
+
+  r->outFill -= r->frameSize;
+  memmove(r->out, r->out + r->frameSize*num_channels,
+          r->outFill*num_channels*sizeof(*r->out));
+  return 1;
+}
+
+/* Resample what the ring has into out, returns 0 on errors */
+static int
+resampleForRtp(RtpStreamer *r, unsigned long fill) {
+  unsigned long frames = fill < r->inFrames? fill : r->inFrames;
+  float *out = r->out + r->outFill*num_channels;
+
+  convertInterleavedFromRing(r->ring, r->src != NULL? r->in : out, frames);
+  if (r->src != NULL) {
+    SRC_DATA src_data = {
+      .data_in = r->in,
+      .input_frames = frames,
+      .data_out = out,
+      .output_frames = r->outFrames - r->outFill,
+      .src_ratio = (double)RTP_SAMPLE_RATE / inputSampleRate
+    };
+    int err;
+
+    if ((err = src_process(r->src, &src_data)) != 0) {
+      fprintf(stderr, "src_process: %s\n", src_strerror(err));
+      return 0;
+    }
+    frames = src_data.input_frames_used;
+    r->outFill += src_data.output_frames_gen;
+  } else {
+    r->outFill += frames;
+  }
+  frameRingConsume(r->ring, frames);
+  return 1;
+}
+
+static void *
+rtpThread(void *arg) {
+  RtpStreamer *r = arg;
+  const useconds_t wait = 500 * rtpFrameTime;
+  int ok = 1;
+
+  while (!quit) {
+    unsigned long fill = frameRingFill(r->ring);
+    int count = 0;
+
+    if (fill == 0) {
+      usleep(wait);
+      continue;
+    }
+    if (!resampleForRtp(r, fill)) break;
+    /* An encoder error leaves the frame in out, so it stops the stream */
+    while (r->outFill >= r->frameSize && (ok = encodeRtpPacket(r, count))) {
+      if (++count == RTP_BATCH) {
+        ok = sendRtpBatch(r, count);
+        count = 0;
+        if (!ok) break;
+      }
+    }
+    if (!ok || (count > 0 && !sendRtpBatch(r, count))) break;
+  }
+  quit = 1;
+
+  return NULL;
+}
+
+/* Connect a UDP socket to HOST:PORT */
+static int
+openRtpSocket(const char *destination) {
+  const struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                                  .ai_socktype = SOCK_DGRAM };
+  const char *colon = strrchr(destination, ':');
+  struct addrinfo *addrs, *a;
+  char host[256];
+  int fd = -1, err;
+
+  if (colon == NULL || colon - destination >= sizeof(host)) {
+    fprintf(stderr, "RTP destination is not HOST:PORT: %s\n", destination);
+    return -1;
+  }
+  memcpy(host, destination, colon - destination);
+  host[colon - destination] = 0;
+  if ((err = getaddrinfo(host, colon + 1, &hints, &addrs)) != 0) {
+    fprintf(stderr, "%s: %s\n", destination, gai_strerror(err));
+    return -1;
+  }
+  for (a = addrs; a != NULL && fd < 0; a = a->ai_next) {
+    if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) >= 0 &&
+        connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) perror(destination);
+  return fd;
+}
+
+static void
+freeRtpStreamer(RtpStreamer *r) {
+  if (r->encoder != NULL) opus_encoder_destroy(r->encoder);
+  if (r->src != NULL) src_delete(r->src);
+  if (r->fd >= 0) close(r->fd);
+  free(r->in);
+  free(r->out);
+}
+
+static int
+initRtpStreamer(RtpStreamer *r, FrameRing *ring, const char *destination) {
+  int err;
+
+  memset(r, 0, sizeof(*r));
+  r->ring = ring;
+  r->frameSize = RTP_SAMPLE_RATE * rtpFrameTime / 1000;
+  r->inFrames = period_size;
+  r->outFrames = period_size * RTP_SAMPLE_RATE / inputSampleRate + 16
+               + r->frameSize;
+  r->ssrc = rand();
+  r->sequence = rand();
+  r->timestamp = rand();
+  for (int i = 0; i < RTP_BATCH; i++) {
+    r->iov[i].iov_base = r->packets[i];
+    r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+    r->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  if ((r->fd = openRtpSocket(destination)) < 0) return 0;
+
+  if ((r->in = malloc(r->inFrames*num_channels*sizeof(float))) == NULL ||
+      (r->out = malloc(r->outFrames*num_channels*sizeof(float))) == NULL) {
+    fprintf(stderr, "no memory for RTP buffers\n");
+  } else if (inputSampleRate != RTP_SAMPLE_RATE &&
+             (r->src = src_new(4-resample_quality, num_channels, &err))
+             == NULL) {
+    fprintf(stderr, "src_new: %s\n", src_strerror(err));
+  } else if ((r->encoder = opus_encoder_create(RTP_SAMPLE_RATE, num_channels,
+                                               OPUS_APPLICATION_AUDIO, &err))
+             == NULL) {
+    fprintf(stderr, "opus_encoder_create: %s\n", opus_strerror(err));
+  } else {
+    opus_encoder_ctl(r->encoder, OPUS_SET_BITRATE(RTP_BITRATE));
+    prefault("RTP input", r->in, r->inFrames*num_channels*sizeof(float));
+    prefault("RTP output", r->out, r->outFrames*num_channels*sizeof(float));
+    return 1;
+  }
+  freeRtpStreamer(r);
+  return 0;
+}
+
+static int
+startRtpStreamer(RtpStreamer *r, FrameRing *ring, const char *destination) {
+  int err;
+
+  if (!initRtpStreamer(r, ring, destination)) return 0;
+  if ((err = pthread_create(&r->thread, NULL, rtpThread, r)) != 0) {
+    fprintf(stderr, "cannot create RTP thread: %s\n", strerror(err));
+    freeRtpStreamer(r);
+    return 0;
+  }
+  return 1;
+}
+
+/* Wait for the RTP thread to finish after quit has been set */
+static void
+stopRtpStreamer(RtpStreamer *r) {
+  pthread_join(r->thread, NULL);
+  freeRtpStreamer(r);
+}
+#endif
+
+#ifdef HAVE_JACK
+#include <jack/jack.h>
+
+static jack_client_t *jackClient;
+static FrameRing jackRing; /* reader of the capture ring */
+static jack_port_t *jackPorts[MAX_CHANNELS];
+static SRC_STATE *srcs[MAX_CHANNELS];
+
+static int jackSampleRate, jackBufferSize;
+
+static double resample_mean = 1.0;
+static double static_resample_factor = 1.0;
+
+static double *offset_array;
+static double *window_array;
+static int offset_differential_index = 0;
+static double offset_integral = 0;
+
+static int target_delay = 0; /* the delay which the program should try to approach. */
+static int max_diff = 0;     /* the diff value, when a hard readpointer skip should occur */
+static int catch_factor = 100000, catch_factor2 = 10000;
+static double pclamp = 15.0;
+static double controlquant = 10000.0;
+static const int smooth_size = 512;
+
+/* Adaptive control (-c adaptive)
+ *
+ * The PI gains are scheduled: the controller starts with LOCK_GAIN
+ * times the bandwidth and halves it whenever the smoothed offset stayed
+ * within LOCK_BAND for LOCK_CYCLES, down to the fixed gains.  A large
+ * offset doubles it again.  Proportional and integral gain are scaled
+ * together, by gain and gain squared, which keeps the damping of the
+ * loop.  Both the loop gain per cycle and the delay of the smoothing
+ * grow with the JACK period, so above LOCK_PERIOD frames the lock gain
+ * is reduced by the square of the ratio to keep the loop stable.
+ *
+ * Offsets beyond max_diff are absorbed by a ratio up to CATCHUP_LIMIT
+ * off resample_mean instead of a skip; only a ring about to overflow or
+ * run dry is skipped or rewound.  The capture clock measured when
+ * settled can be kept per device in a file (-K), static_resample_factor
+ * then starts from it.
+ */
+#define LOCK_GAIN 8.0
+#define LOCK_PERIOD 64
+#define LOCK_BAND (4*pclamp)
+#define LOCK_CYCLES (2*smooth_size)
+#define CATCHUP_LIMIT 0.005
+
+static int adaptive_control = 0;
+static double control_gain = 1.0;
+static int control_settled = 0; /* cycles within LOCK_BAND */
+static double clock_ratio = 1.0; /* capture clock relative to nominal */
+
+/* Telemetry
+ *
+ * process() pushes one record per cycle into a single producer, single
+ * consumer ring and never waits: when the ring is full the record is
+ * counted as lost.  The main thread drains the ring into counters and
+ * histograms every TELEMETRY_INTERVAL.  With -M they are served in the
+ * Prometheus text format, on a Unix socket or as HTTP on a TCP port.
+ */
+
+#define TELEMETRY_RING_SIZE 4096 /* records, a power of two */
+#define TELEMETRY_INTERVAL 250   /* ms */
+
+typedef enum { CYCLE_NORMAL = 0, CYCLE_SKIP, CYCLE_REWIND } CycleEvent;
+
+typedef struct {
+  uint64_t time;          /* monotonicTime() at the start of the cycle */
+  uint32_t cycleTime;     /* ns spent in process() */
+  int32_t delay;          /* frames, before a skip or rewind */
+  uint32_t eventFrames;   /* skipped or rewound */
+  uint8_t event;          /* CycleEvent */
+  float factor;
+  float mean;             /* resample_mean */
+  float offset;           /* delay - target_delay */
+  float diff;             /* smoothed and clamped offset */
+  float integral;
+} TelemetryRecord;
+
+static struct {
+  TelemetryRecord records[TELEMETRY_RING_SIZE];
+  unsigned long head, tail;
+  unsigned long lost;
+} telemetryRing;
+
+static inline void
+pushTelemetry(const TelemetryRecord *record) {
+  const unsigned long head = telemetryRing.head;
+
+  if (head - __atomic_load_n(&telemetryRing.tail, __ATOMIC_ACQUIRE)
+      == TELEMETRY_RING_SIZE) {
+    __atomic_store_n(&telemetryRing.lost, telemetryRing.lost + 1,
+                     __ATOMIC_RELAXED);
+    return;
+  }
+  telemetryRing.records[head & (TELEMETRY_RING_SIZE - 1)] = *record;
+  __atomic_store_n(&telemetryRing.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer side, returns 0 if the ring is empty */
+static inline int
+popTelemetry(TelemetryRecord *record) {
+  const unsigned long tail = telemetryRing.tail;
+
+  if (tail == __atomic_load_n(&telemetryRing.head, __ATOMIC_ACQUIRE)) return 0;
+  *record = telemetryRing.records[tail & (TELEMETRY_RING_SIZE - 1)];
+  __atomic_store_n(&telemetryRing.tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Smoothed offset and integral of the last controlResampleFactor() */
+static double control_diff = 0.0;
+
+#define MIN_RESAMPLE_FACTOR 0.25
+#define MAX_RESAMPLE_FACTOR 4.0
+
+/* Run one converter over interleaved frames instead of one per channel */
+static int interleaved_resampling = 0;
+
+/* Preallocated by alloc_ports() for the largest possible read */
+static float *resampbuf;
+static int resampbufFrames;
+static float *resampout;
+
+/* Resample all channels in one pass and deinterleave into the ports */
+static unsigned long
+resampleInterleaved(FrameRing *ring, jack_nframes_t nframes, int rlen,
+                    double factor) {
+  SRC_DATA src;
+  int channel;
+
+  convertInterleavedFromRing(ring, resampbuf, rlen);
+
+  src.data_in = resampbuf;
+  src.input_frames = rlen;
+  src.data_out = resampout;
+  src.output_frames = nframes;
+  src.end_of_input = 0;
+  src.src_ratio = factor;
+
+  src_process(srcs[0], &src);
+
+  for (channel = 0; channel < num_channels; channel++) {
+    float *buf = jack_port_get_buffer(jackPorts[channel], nframes);
+    const float *in = resampout + channel;
+
+    for (long i = 0; i < src.output_frames_gen; i++, in += num_channels)
+      buf[i] = *in;
+    if (src.output_frames_gen < nframes)
+      memset(buf + src.output_frames_gen, 0,
+             (nframes - src.output_frames_gen) * sizeof(*buf));
+  }
+
+  return src.input_frames_used;
+}
+
+/* Smoothing of the delay offset
+ *
+ * The reference is a FIR lowpass with a Hann window over the last
+ * smooth_size offsets, which costs smooth_size multiply-adds per cycle.
+ * The alternatives reach a comparable response in constant time: two
+ * cascaded moving averages of half the length (a triangular window),
+ * or two cascaded one-pole lowpasses with the same group delay.  Both
+ * are scaled to the DC gain of the Hann window.
+ */
+typedef enum { SMOOTH_HANN = 0, SMOOTH_CMA, SMOOTH_IIR } smoothing_t;
+static smoothing_t smoothing = SMOOTH_HANN;
+static const char *smoothingNames[] = { "hann", "cma", "iir" };
+
+static double window_gain; /* DC gain of the Hann window */
+static double iir_coefficient;
+static double smooth_state[3];
+static int smooth_count = 0;
+
+static void
+resetSmoothing() {
+  if (smoothing == SMOOTH_HANN) {
+    for (int i=0; i<smooth_size; i++) offset_array[i] = 0.0;
+  } else {
+    /* Unfilled history reads as zero, see smoothOffset() */
+    smooth_count = 0;
+    smooth_state[0] = smooth_state[1] = smooth_state[2] = 0.0;
+  }
+}
+
+static inline double
+smoothOffset(double offset) {
+  switch (smoothing) {
+  case SMOOTH_CMA: {
+    /* offset_array holds the history of both averages, half each */
+    const int len = smooth_size / 2;
+    const int idx = smooth_count % len;
+    double average;
+
+    if (smooth_count >= len) smooth_state[0] -= offset_array[idx];
+    offset_array[idx] = offset;
+    smooth_state[0] += offset;
+    average = smooth_state[0] / len;
+    if (smooth_count >= len) smooth_state[1] -= offset_array[len + idx];
+    offset_array[len + idx] = average;
+    smooth_state[1] += average;
+    if (++smooth_count == 2*len) smooth_count = len;
+    return smooth_state[1] / len * window_gain;
+  }
+  case SMOOTH_IIR:
+    smooth_state[0] += iir_coefficient * (offset - smooth_state[0]);
+    smooth_state[1] += iir_coefficient * (smooth_state[0] - smooth_state[1]);
+    return smooth_state[1] * window_gain;
+  case SMOOTH_HANN:
+  default: {
+    int i;
+
+    // Save offset.
+    offset_array[(offset_differential_index++)%smooth_size] = offset;
+
+    // Build the mean of the windowed offset array
+    // basically fir lowpassing.
+    double smooth_offset = 0.0;
+    for (i=0; i<smooth_size; i++)
+      smooth_offset += offset_array[(i + offset_differential_index-1)
+				    % smooth_size] * window_array[i];
+    return smooth_offset / (double)smooth_size;
+  }
+  }
+}
+
+static double
+lockGain() {
+  const double periods = (double)jackBufferSize / LOCK_PERIOD;
+  const double gain = LOCK_GAIN / (periods * periods);
+
+  return gain < 1.0? 1.0 : gain > LOCK_GAIN? LOCK_GAIN : gain;
+}
+
+/* Start controlling at the given nominal jack/capture rate ratio */
+static void
+initControl(double nominal) {
+  static_resample_factor = resample_mean = nominal / clock_ratio;
+  /* A saved clock leaves nothing to lock to, large offsets still raise
+   * the gain
+   */
+  control_gain = adaptive_control && clock_ratio == 1.0? lockGain() : 1.0;
+  control_settled = 0;
+  offset_integral = 0;
+  offset_differential_index = 0;
+  resetSmoothing();
+}
+
+/* Whether resample_mean is worth keeping as the clock of the device */
+static int
+controlSettled(unsigned long cycles) {
+  return adaptive_control? control_gain == 1.0 : cycles > 5 / 0.0001;
+}
+
+/* Clock file
+ *
+ * One line per capture device: its name and the ratio of its clock to
+ * the nominal rate, as measured against the JACK clock.
+ */
+
+static double
+loadClockRatio(const char *fileName, const char *device) {
+  FILE *file = fopen(fileName, "r");
+  char line[256], name[200];
+  double ratio = 1.0, value;
+
+  if (file == NULL) {
+    if (errno != ENOENT) perror(fileName);
+    return ratio;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%199s %lf", name, &value) == 2
+        && strcmp(name, device) == 0 && value > 0.99 && value < 1.01)
+      ratio = value;
+  }
+  fclose(file);
+  if (verbose) printf("%s: clock %+.2fppm\n", device, (ratio - 1) * 1e6);
+  return ratio;
+}
+
+/* Replace the entry of device in fileName, keeping the others */
+static int
+saveClockRatio(const char *fileName, const char *device, double ratio) {
+  char tmpName[FILENAME_MAX], line[256], name[200];
+  FILE *file, *old = fopen(fileName, "r");
+
+  snprintf(tmpName, sizeof(tmpName), "%s.tmp", fileName);
+  if ((file = fopen(tmpName, "w")) == NULL) {
+    perror(tmpName);
+    if (old != NULL) fclose(old);
+    return 0;
+  }
+  fprintf(file, "# device clock/nominal\n");
+  while (old != NULL && fgets(line, sizeof(line), old) != NULL) {
+    if (line[0] == '#' || (sscanf(line, "%199s", name) == 1
+                           && strcmp(name, device) == 0))
+      continue;
+    fputs(line, file);
+  }
+  if (old != NULL) fclose(old);
+  fprintf(file, "%s %.9f\n", device, ratio);
+  if (fclose(file) != 0 || rename(tmpName, fileName) != 0) {
+    perror(fileName);
+    unlink(tmpName);
+    return 0;
+  }
+  return 1;
+}
+
+/* Delay range outside which process() skips or rewinds */
+static void
+controlLimits(unsigned long ringSize, jack_nframes_t nframes,
+              long *low, long *high) {
+  if (adaptive_control) {
+    *low = nframes / (resample_mean * (1 - CATCHUP_LIMIT)) + 2;
+    *high = ringSize - period_size;
+  } else {
+    *low = target_delay - max_diff;
+    *high = target_delay + max_diff;
+  }
+}
+
+/**
+ * Set the target_delay and max_diff not given as options for a JACK
+ * period of nframes, after initControl().  The adaptive controller
+ * rewinds below a delay of about two periods of input, which may be
+ * above half of a small capture buffer, so the target is raised to
+ * half a JACK period above it.
+ */
+static void
+setupTargetDelay(jack_nframes_t nframes) {
+  long low, high;
+
+  if (!target_delay && latencyProfile->targetDelay > 0)
+    target_delay = latencyProfile->targetDelay*period_size + nframes/2;
+  if (!target_delay)
+    target_delay = (num_periods*period_size / 2) + nframes/2;
+  controlLimits(num_periods*period_size, nframes, &low, &high);
+  if (adaptive_control && target_delay < low + nframes/2)
+    target_delay = low + nframes/2;
+  if (!max_diff)
+    max_diff = num_periods*period_size - target_delay;
+}
+
+/* Change the gain without a jump in the integral term */
+static void
+setControlGain(double gain) {
+  offset_integral *= control_gain * control_gain / (gain * gain);
+  control_gain = gain;
+  control_settled = 0;
+}
+
+static void
+scheduleControlGain(double smooth_offset) {
+  if (fabs(smooth_offset) > max_diff / 2.0) {
+    if (control_gain < lockGain())
+      setControlGain(fmin(control_gain * 2, lockGain()));
+  } else if (fabs(smooth_offset) >= LOCK_BAND) {
+    control_settled = 0;
+  } else if (control_gain > 1.0 && ++control_settled >= LOCK_CYCLES) {
+    setControlGain(fmax(control_gain / 2, 1.0));
+  }
+}
+
+/* A skip or rewind starts a new control cycle */
+static void
+restartControl() {
+  if (adaptive_control) control_gain = lockGain();
+  control_settled = 0;
+  // Set the resample_rate... we need to adjust the offset integral, to do this.
+  offset_integral = - (resample_mean - static_resample_factor)
+                  * catch_factor * catch_factor2
+                  / (control_gain * control_gain);
+  // Also clear the filter history. we are beginning a new control cycle.
+  resetSmoothing();
+}
+
+/**
+ * Run the PI controller on the current delay offset and return the
+ * resample factor to use for this cycle.
+ */
+static double
+controlResampleFactor(double offset) {
+  double smooth_offset = smoothOffset(offset);
+
+  if (adaptive_control) scheduleControlGain(smooth_offset);
+  const double catch1 = catch_factor / control_gain;
+  const double catch2 = catch_factor2 / control_gain;
+
+  // this is the integral of the smoothed_offset
+  offset_integral += smooth_offset;
+
+  // Clamp offset.
+  // the smooth offset still contains unwanted noise
+  // which would go straigth onto the resample coeff.
+  // it only used in the P component and the I component is used for the fine tuning anyways.
+  if (fabs(smooth_offset) < pclamp) smooth_offset = 0.0;
+
+  // ok. now this is the PI controller. 
+  // u(t) = K * ( e(t) + 1/T \int e(t') dt' )
+  // K = 1/catch_factor and T = catch_factor2
+  double current_resample_factor = static_resample_factor
+                                 - smooth_offset / catch1
+                                 - offset_integral / catch1 / catch2;
+
+  if (adaptive_control) {
+    const double limit = resample_mean * CATCHUP_LIMIT;
+
+    /* Stop integrating while the ratio is held at the limit */
+    if (fabs(current_resample_factor - resample_mean) > limit) {
+      offset_integral -= smooth_offset;
+      current_resample_factor = resample_mean
+        + (current_resample_factor > resample_mean? limit : -limit);
+    }
+  }
+
+  // quantize around resample_mean, so that noise in the integral component doesnt hurt.
+  current_resample_factor = floor((current_resample_factor - resample_mean)
+				  * controlquant + 0.5)
+                          / controlquant + resample_mean;
+
+  control_diff = smooth_offset;
+
+  // Clamp a bit.
+  if (current_resample_factor < MIN_RESAMPLE_FACTOR)
+    current_resample_factor = MIN_RESAMPLE_FACTOR;
+  else if (current_resample_factor > MAX_RESAMPLE_FACTOR)
+    current_resample_factor = MAX_RESAMPLE_FACTOR;
+
+  // Calculate resample_mean so we can init ourselves to saner values.
+  resample_mean += 0.0001 * control_gain
+                 * (current_resample_factor - resample_mean);
+
+  return current_resample_factor;
+}
+
+/* One cycle of process(), describes what happened in record */
+static void
+processCycle(jack_nframes_t nframes, TelemetryRecord *record) {
+  FrameRing *ring = &jackRing;
+  const uint64_t writeTime = __atomic_load_n(&ring->writeTime, __ATOMIC_ACQUIRE);
+  unsigned long fill = frameRingFill(ring);
+  long delay = fill, low, high;
+
+  /* Frames which arrived in ALSA since the capture thread last read */
+  if (writeTime) delay += (monotonicTime() - writeTime)
+                        * inputSampleRate / 1000000000;
+  delay -= jack_frames_since_cycle_start(jackClient);
+  record->delay = delay;
+  controlLimits(ring->size, nframes, &low, &high);
+  if (delay > high) {
+    unsigned long skipFrames = delay-target_delay;
+    if (skipFrames > fill) skipFrames = fill;
+    frameRingConsume(ring, skipFrames);
+    fill -= skipFrames;
+    record->event = CYCLE_SKIP;
+    record->eventFrames = skipFrames;
+
+    delay -= skipFrames;
+
+    restartControl();
+  }
+  if (delay < low) {
+    /* low may be above target_delay with the adaptive controller */
+    const long goal = target_delay > low? target_delay : low;
+    unsigned long rewound = frameRingRewind(ring, goal - delay);
+
+    record->event = CYCLE_REWIND;
+    record->eventFrames = rewound;
+    delay += rewound;
+    fill += rewound;
+
+    restartControl();
+  }
+  /* ok... now we should have target_delay +- max_diff on the alsa side.
+   *
+   * calculate the number of frames, we want to get.
+   */
+
+  double current_resample_factor = controlResampleFactor(delay - target_delay);
+
+  record->factor = current_resample_factor;
+  record->mean = resample_mean;
+  record->offset = delay - target_delay;
+  record->diff = control_diff;
+  record->integral = offset_integral;
+  {
+    int rlen = ceil(((double)nframes) / current_resample_factor)+2;
+    int channel = 0;
+    SRC_DATA src;
+    int usedFrames = 0;
+    assert(rlen > 2);
+
+    if (rlen > resampbufFrames) rlen = resampbufFrames;
+    if (rlen > fill) rlen = fill; /* underrun, the rest is silence */
+
+    if (interleaved_resampling) {
+      frameRingConsume(ring, resampleInterleaved(ring, nframes, rlen,
+                                                 current_resample_factor));
+      return;
+    }
+
+    if (num_channels == 2)
+      deinterleaveFromRing(ring, resampbuf, resampbuf + resampbufFrames, rlen);
+
+    for (channel = 0; channel < num_channels; channel++) {
+      float *buf = jack_port_get_buffer(jackPorts[channel], nframes);
+      SRC_STATE *src_state = srcs[channel];
+      float *in = resampbuf;
+
+      if (num_channels == 2) in += channel * resampbufFrames;
+      else convertFromRing(ring, in, rlen, channel);
+
+      src.data_in = in;
+      src.input_frames = rlen;
+
+      src.data_out = buf;
+      src.output_frames = nframes;
+      src.end_of_input = 0;
+      src.src_ratio = current_resample_factor;
+
+      src_process(src_state, &src);
+
+      if (src.output_frames_gen < nframes)
+        memset(buf + src.output_frames_gen, 0,
+               (nframes - src.output_frames_gen) * sizeof(*buf));
+      usedFrames = src.input_frames_used;
+    }
+
+    /* Frames the resampler did not use stay in the ring */
+    frameRingConsume(ring, usedFrames);
+  }
+}
+
+static int process(jack_nframes_t nframes, void *arg) {
+  TelemetryRecord record = { .time = monotonicTime() };
+
+  processCycle(nframes, &record);
+  record.cycleTime = monotonicTime() - record.time;
+  pushTelemetry(&record);
+
+  return 0;
+}
+
+/**
+ * Allocate the necessary jack ports...
+ */
+static void
+alloc_ports(int n_capture) {
+  for (int chn = 0; chn < n_capture; chn++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf) - 1, "capture_%u", chn+1);
+
+    jack_port_t *port = jack_port_register(jackClient, buf,
+					   JACK_DEFAULT_AUDIO_TYPE,
+                                           JackPortIsOutput, 0);
+
+    if (port == NULL) {
+      printf("cannot register port %s\n", buf);
+      exit(EXIT_FAILURE);
     }
-  } else {
-    printf("No configurations available for capture: %s\n", snd_strerror(err));
+
+    if (!interleaved_resampling)
+      srcs[chn] = src_new(4-resample_quality, 1, NULL);
+    jackPorts[chn] = port;
   }
 
-  return err;
+  resampbufFrames = ceil(jackBufferSize / MIN_RESAMPLE_FACTOR) + 2;
+  if (interleaved_resampling) {
+    srcs[0] = src_new(4-resample_quality, n_capture, NULL);
+    resampbuf = malloc(resampbufFrames * n_capture * sizeof(*resampbuf));
+    resampout = malloc(jackBufferSize * n_capture * sizeof(*resampout));
+  } else {
+    /* Room for both channels when stereo is split in one pass */
+    resampbuf = malloc(resampbufFrames * MAX_CHANNELS * sizeof(*resampbuf));
+    resampout = NULL;
+  }
+  if (resampbuf == NULL || (interleaved_resampling && resampout == NULL)) {
+    printf("no memory for resampling buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  prefault("resampling input", resampbuf, resampbufFrames
+           * (interleaved_resampling? n_capture : MAX_CHANNELS)
+           * sizeof(*resampbuf));
+  prefault("resampling output", resampout,
+           jackBufferSize * n_capture * sizeof(*resampout));
 }
 
-static inline int
-set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams, int period) {
-  int err;
+static void
+jack_shutdown(void *arg) {
+  exit(1);
+}
 
-  if ((err = snd_pcm_sw_params_current(handle, swparams)) == 0) {
-    /* start the transfer when the buffer is full */
-    if ((err = snd_pcm_sw_params_set_start_threshold(handle, swparams,
-						     period)) >= 0) {
-      if ((err = snd_pcm_sw_params_set_stop_threshold(handle, swparams,
-						      -1)) >= 0) {
-	if ((err = snd_pcm_sw_params_set_avail_min(handle, swparams,
-						   2*period)) >= 0) {
-	  if ((err = snd_pcm_sw_params(handle, swparams)) == 0) {
-	    return 0;
-	  } else {
-	    printf("Unable to set sw params for capture: %s\n",
-		   snd_strerror(err));
-	  }
-	} else {
-	  printf("Unable to set avail min for capture: %s\n",
-		 snd_strerror(err));
-	}
-      } else {
-	printf("Unable to set start threshold mode for capture: %s\n",
-	       snd_strerror(err));
+static inline double hann(double x) { return 0.5 * (1.0 - cos(2*M_PI * x)); }
+static int
+setupSmoothing() {
+  if ((offset_array = malloc(sizeof(double) * smooth_size)) != NULL) {
+    if ((window_array = malloc(sizeof(double) * smooth_size)) != NULL) {
+      int i;
+      window_gain = 0.0;
+      for (i=0; i<smooth_size; i++) {
+	offset_array[i] = 0.0;
+	window_array[i] = hann((double)i / ((double) smooth_size - 1.0));
+	window_gain += window_array[i];
       }
+      window_gain /= (double)smooth_size;
+      /* Two poles with (smooth_size-1)/2 samples of group delay */
+      iir_coefficient = 4.0 / (smooth_size + 3.0);
+      resetSmoothing();
+      prefault("offset_array", offset_array, sizeof(double) * smooth_size);
+      prefault("window_array", window_array, sizeof(double) * smooth_size);
+
+      return 1;
     } else {
-      printf("Unable to set start threshold mode for capture: %s\n",
-	     snd_strerror(err));
+      fprintf(stderr, "no memory for window_array\n");
     }
   } else {
-    printf("Unable to determine current sw params for capture: %s\n",
-	   snd_strerror(err));
+    fprintf(stderr, "no memory for offset_array\n");
   }
+  return 0;
+}
 
-  return err;
+/* Telemetry aggregation, on the main thread */
+
+#define CYCLE_BUCKETS 15  /* 1 us - 8 ms and +Inf */
+#define OFFSET_BUCKETS 18 /* 1 - 65536 frames and +Inf */
+
+static struct {
+  unsigned long cycles, skips, rewinds;
+  unsigned long skippedFrames, rewoundFrames;
+  unsigned long jackXruns;
+  unsigned long cycleBuckets[CYCLE_BUCKETS];
+  unsigned long offsetBuckets[OFFSET_BUCKETS];
+  double cycleSum, offsetSum;
+  TelemetryRecord last;
+} telemetry;
+
+static int
+jackXrun(void *arg) {
+  __atomic_add_fetch(&telemetry.jackXruns, 1, __ATOMIC_RELAXED);
+  return 0;
 }
 
-static inline snd_pcm_t *
-openAudioIn(char *device, int rate, int channels, int period, int nperiods) {
-  int err;
-  snd_pcm_t *handle;
+/* Bucket i holds the values up to 2^i */
+static int
+log2Bucket(double value, int buckets) {
+  int i = 0;
 
-  if ((err = snd_pcm_open(&(handle), device,
-			  SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) == 0) {
-    snd_pcm_hw_params_t *hwparams;
+  while (i < buckets - 1 && value > (double)(1UL << i)) i++;
+  return i;
+}
 
-    snd_pcm_hw_params_alloca(&hwparams);
-    if ((err = set_hwparams(handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
-			    rate, channels, period, nperiods)) == 0) {
-      snd_pcm_sw_params_t *swparams;
+static void
+drainTelemetry() {
+  TelemetryRecord record;
+
+  while (popTelemetry(&record)) {
+    const double offset = fabs(record.offset);
+
+    telemetry.cycles++;
+    telemetry.cycleSum += record.cycleTime / 1e9;
+    telemetry.cycleBuckets[log2Bucket(record.cycleTime / 1e3,
+                                      CYCLE_BUCKETS)]++;
+    telemetry.offsetSum += offset;
+    telemetry.offsetBuckets[log2Bucket(offset, OFFSET_BUCKETS)]++;
+    if (record.event == CYCLE_SKIP) {
+      telemetry.skips++;
+      telemetry.skippedFrames += record.eventFrames;
+      if (verbose > 0)
+        printf("Skipped %u frames, delay was %d\n",
+               record.eventFrames, record.delay);
+    } else if (record.event == CYCLE_REWIND) {
+      telemetry.rewinds++;
+      telemetry.rewoundFrames += record.eventFrames;
+      if (verbose > 0)
+        printf("Rewound %u frames, delay was %d\n",
+               record.eventFrames, record.delay);
+    }
+    telemetry.last = record;
+  }
+}
 
-      snd_pcm_sw_params_alloca(&swparams);
-      if ((err = set_swparams(handle, swparams, period)) == 0) {
-	snd_pcm_start(handle);
-	snd_pcm_wait(handle, 100);
+static int
+writeHistogram(char *buf, size_t size, const char *name, const char *help,
+               const unsigned long *buckets, int count, double scale,
+               double sum) {
+  unsigned long total = 0;
+  int len = snprintf(buf, size, "# HELP %s %s\n# TYPE %s histogram\n",
+                     name, help, name);
+
+  for (int i = 0; i < count; i++) {
+    total += buckets[i];
+    if (i < count - 1)
+      len += snprintf(buf + len, size - len, "%s_bucket{le=\"%g\"} %lu\n",
+                      name, (double)(1UL << i) * scale, total);
+    else
+      len += snprintf(buf + len, size - len, "%s_bucket{le=\"+Inf\"} %lu\n",
+                      name, total);
+  }
+  len += snprintf(buf + len, size - len, "%s_sum %g\n%s_count %lu\n",
+                  name, sum, name, total);
+  return len;
+}
 
-	return handle;
-      } else {
-	printf("Setting of swparams failed: %s\n", snd_strerror(err));
-      }
-    } else {
-      printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+/* Prometheus text format of the current state, returns its length */
+static int
+formatMetrics(char *buf, size_t size) {
+  const TelemetryRecord *last = &telemetry.last;
+  const double mean = last->mean > 0? last->mean : static_resample_factor;
+  int len = snprintf(buf, size,
+    "# TYPE si470x_cycles_total counter\n"
+    "si470x_cycles_total %lu\n"
+    "# TYPE si470x_skips_total counter\n"
+    "si470x_skips_total %lu\n"
+    "# TYPE si470x_skipped_frames_total counter\n"
+    "si470x_skipped_frames_total %lu\n"
+    "# TYPE si470x_rewinds_total counter\n"
+    "si470x_rewinds_total %lu\n"
+    "# TYPE si470x_rewound_frames_total counter\n"
+    "si470x_rewound_frames_total %lu\n"
+    "# TYPE si470x_capture_xruns_total counter\n"
+    "si470x_capture_xruns_total %lu\n"
+    "# TYPE si470x_capture_dropped_frames_total counter\n"
+    "si470x_capture_dropped_frames_total %lu\n"
+    "# TYPE si470x_jack_xruns_total counter\n"
+    "si470x_jack_xruns_total %lu\n"
+    "# TYPE si470x_telemetry_lost_total counter\n"
+    "si470x_telemetry_lost_total %lu\n"
+    "# TYPE si470x_delay_frames gauge\n"
+    "si470x_delay_frames %d\n"
+    "# TYPE si470x_offset_frames gauge\n"
+    "si470x_offset_frames %g\n"
+    "# TYPE si470x_smoothed_offset_frames gauge\n"
+    "si470x_smoothed_offset_frames %g\n"
+    "# TYPE si470x_offset_integral gauge\n"
+    "si470x_offset_integral %g\n"
+    "# TYPE si470x_resample_factor gauge\n"
+    "si470x_resample_factor %.9f\n"
+    "# TYPE si470x_resample_mean gauge\n"
+    "si470x_resample_mean %.9f\n"
+    "# HELP si470x_drift_ppm Capture clock drift against JACK\n"
+    "# TYPE si470x_drift_ppm gauge\n"
+    "si470x_drift_ppm %.3f\n",
+    telemetry.cycles, telemetry.skips, telemetry.skippedFrames,
+    telemetry.rewinds, telemetry.rewoundFrames,
+    __atomic_load_n(&audioCapture.xruns, __ATOMIC_RELAXED),
+    __atomic_load_n(&jackRing.dropped, __ATOMIC_RELAXED),
+    __atomic_load_n(&telemetry.jackXruns, __ATOMIC_RELAXED),
+    __atomic_load_n(&telemetryRing.lost, __ATOMIC_RELAXED),
+    last->delay, last->offset, last->diff, last->integral,
+    last->factor, mean,
+    (static_resample_factor * clock_ratio / mean - 1.0) * 1e6);
+
+  len += writeHistogram(buf + len, size - len, "si470x_cycle_seconds",
+                        "Time spent in the JACK process callback",
+                        telemetry.cycleBuckets, CYCLE_BUCKETS, 1e-6,
+                        telemetry.cycleSum);
+  len += writeHistogram(buf + len, size - len, "si470x_offset_abs_frames",
+                        "Distance of the ring delay from its target",
+                        telemetry.offsetBuckets, OFFSET_BUCKETS, 1,
+                        telemetry.offsetSum);
+#ifdef HAVE_OPUS
+  if (rtpDestination != NULL) {
+    double jitter;
+
+    __atomic_load(&rtpStats.jitter, &jitter, __ATOMIC_RELAXED);
+    len += snprintf(buf + len, size - len,
+      "# TYPE si470x_rtp_packets_total counter\n"
+      "si470x_rtp_packets_total %lu\n"
+      "# TYPE si470x_rtp_bytes_total counter\n"
+      "si470x_rtp_bytes_total %lu\n"
+      "# HELP si470x_rtp_batches_total Calls of sendmmsg()\n"
+      "# TYPE si470x_rtp_batches_total counter\n"
+      "si470x_rtp_batches_total %lu\n"
+      "# TYPE si470x_rtp_send_errors_total counter\n"
+      "si470x_rtp_send_errors_total %lu\n"
+      "# TYPE si470x_rtp_dropped_frames_total counter\n"
+      "si470x_rtp_dropped_frames_total %lu\n"
+      "# HELP si470x_rtp_jitter_seconds Send time jitter (RFC 3550)\n"
+      "# TYPE si470x_rtp_jitter_seconds gauge\n"
+      "si470x_rtp_jitter_seconds %.6f\n",
+      __atomic_load_n(&rtpStats.packets, __ATOMIC_RELAXED),
+      __atomic_load_n(&rtpStats.bytes, __ATOMIC_RELAXED),
+      __atomic_load_n(&rtpStats.batches, __ATOMIC_RELAXED),
+      __atomic_load_n(&rtpStats.errors, __ATOMIC_RELAXED),
+      __atomic_load_n(&rtpRing.dropped, __ATOMIC_RELAXED),
+      jitter);
+  }
+#endif
+  return len;
+}
+
+/* Metrics endpoint of -M, a socket path or [HOST]:PORT for HTTP */
+static int metricsFd = -1;
+static int metricsHttp = 0;
+
+static int
+openMetrics(const char *spec) {
+  if ((metricsFd = listenSocket(spec)) < 0) return 0;
+  metricsHttp = spec[0] == ':';
+  return 1;
+}
+
+static void
+serveMetrics() {
+  static char buf[8192];
+  int client, len = 0;
+
+  if ((client = accept(metricsFd, NULL, NULL)) < 0) return;
+  if (metricsHttp) {
+    /* Any request gets the metrics, read what has arrived of it */
+    struct pollfd request = { .fd = client, .events = POLLIN };
+    char discard[1024];
+
+    if (poll(&request, 1, 100) > 0) read(client, discard, sizeof(discard));
+    len = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+  }
+  len += formatMetrics(buf + len, sizeof(buf) - len);
+  for (int done = 0, n; done < len; done += n)
+    if ((n = write(client, buf + done, len - done)) <= 0) break;
+  close(client);
+}
+
+/**
+ * Drains the telemetry every TELEMETRY_INTERVAL until quit is set or the
+ * sink whose status finished points to, if any, has ended.
+ */
+static void
+runTelemetry(const int *finished) {
+  uint64_t next = monotonicTime();
+
+  while (!quit &&
+         !(finished != NULL && __atomic_load_n(finished, __ATOMIC_ACQUIRE))) {
+    struct pollfd fd = { .fd = metricsFd, .events = POLLIN };
+    const int64_t wait = (int64_t)(next - monotonicTime()) / 1000000;
+
+    if (poll(&fd, metricsFd >= 0, wait > 0? wait : 0) > 0) serveMetrics();
+    if ((int64_t)(monotonicTime() - next) < 0) continue;
+    next += TELEMETRY_INTERVAL * 1000000ULL;
+
+    drainTelemetry();
+    if (verbose > 1)
+      printf("srcfactor: %f, diff = %f, offset = %f, integral=%f\n",
+             telemetry.last.factor, telemetry.last.diff,
+             telemetry.last.offset, telemetry.last.integral);
+  }
+}
+
+static int
+openJack(const char *device, const char *clockFile) {
+  const char *jack_name = "si470x";
+
+  if (!setupSmoothing()) return 0;
+  if ((jackClient = jack_client_open(jack_name, JackNullOption, NULL))
+      == NULL) {
+    fprintf (stderr, "jack server not running?\n");
+    return 0;
+  }
+  jack_set_process_callback(jackClient, process, 0);
+  jack_on_shutdown(jackClient, jack_shutdown, 0);
+  jack_set_xrun_callback(jackClient, jackXrun, 0);
+  jackSampleRate = jack_get_sample_rate(jackClient);
+
+  if (clockFile != NULL)
+    clock_ratio = loadClockRatio(clockFile, device);
+  initControl((double)jackSampleRate / (double)inputSampleRate);
+
+  jackBufferSize = jack_get_buffer_size(jackClient);
+  setupTargetDelay(jackBufferSize);
+
+  if (verbose > 1)
+    printf("target_delay=%d\nmax_diff=%d\n", target_delay, max_diff);
+  alloc_ports(num_channels);
+  return 1;
+}
+
+/* Start process() and connect to the first playback ports */
+static int
+activateJack() {
+  const char **port;
+
+  if (jack_activate(jackClient) != 0) {
+    fprintf(stderr, "cannot activate JACK client\n");
+    return 0;
+  }
+  setupRealtimeThread("JACK process", jack_client_thread_id(jackClient),
+                      &(RealtimeThread){ realtime.audio.cpu, 0 });
+  port = jack_get_ports(jackClient, NULL, NULL, JackPortIsInput);
+  for (int i = 0; port != NULL && i < num_channels && *port; i++) {
+    if (*port[0]) {
+      jack_connect(jackClient, jack_port_name(jackPorts[i]), *port);
+      port++;
     }
-  } else {
-    printf("AudioIn open error: %s\n", snd_strerror(err));
   }
+  return 1;
+}
 
-  return NULL;
+static void
+closeJack(const char *device, const char *clockFile, int active) {
+  if (active) {
+    jack_deactivate(jackClient);
+    drainTelemetry();
+    if (clockFile != NULL && controlSettled(telemetry.cycles))
+      saveClockRatio(clockFile, device,
+                     static_resample_factor * clock_ratio / resample_mean);
+  }
+  jack_client_close(jackClient);
+  for (int i = 0; i < MAX_CHANNELS; i++)
+    if (srcs[i] != NULL) src_delete(srcs[i]);
 }
+#endif
 
-#define MIN_RESAMPLE_FACTOR 0.25
-#define MAX_RESAMPLE_FACTOR 4.0
+/* PCM streaming (-N)
+ *
+ * Clients of the socket get the captured frames as they are, after a
+ * line with the ALSA format name, the rate and the number of channels.
+ * Whole frames are sent, up to a period at a time, and a client which
+ * cannot take them without blocking is disconnected.
+ */
 
-static int process(jack_nframes_t nframes, void *arg) {
-  int err;
-  snd_pcm_sframes_t delay = snd_pcm_avail(pcmIn);
-  int i;
+#define STREAM_CLIENTS 4
 
-  delay -= jack_frames_since_cycle_start(jackClient);
-  if (delay > (target_delay+max_diff)) {
-    const int skipFrames = delay-target_delay;
-    char tmp[skipFrames * formats[format].sample_size * num_channels]; 
-    printf("Skipping %d frames\n", skipFrames);
-    int count = skipFrames;
-    while (count > 0) {
-      int amount = snd_pcm_readi(pcmIn, tmp, skipFrames);
-      if (amount == -EAGAIN) continue;
-      if (amount < 0) {
-	xrun_recovery(pcmIn, amount);
-	continue;
-      }
-      count -= amount;
+typedef struct {
+  FrameRing *ring;
+  int listenFd;
+  int clients[STREAM_CLIENTS];
+  int clientCount;
+  pthread_t thread;
+} PcmStreamer;
+
+static char *streamSocket = NULL; /* -N */
+
+static void
+acceptStreamClient(PcmStreamer *s) {
+  const int fd = accept(s->listenFd, NULL, NULL);
+  char header[64];
+  int length;
+
+  if (fd < 0) return;
+  length = snprintf(header, sizeof(header), "%s %u %d\n",
+                    snd_pcm_format_name(formats[format].format_id),
+                    inputSampleRate, num_channels);
+  if (s->clientCount == STREAM_CLIENTS ||
+      send(fd, header, length, MSG_DONTWAIT|MSG_NOSIGNAL) != length) {
+    close(fd);
+    return;
+  }
+  s->clients[s->clientCount++] = fd;
+}
+
+static void
+sendToStreamClients(PcmStreamer *s, const char *data, size_t size) {
+  for (int i = s->clientCount - 1; i >= 0; i--) {
+    if (send(s->clients[i], data, size, MSG_DONTWAIT|MSG_NOSIGNAL)
+        != (ssize_t)size) {
+      close(s->clients[i]);
+      s->clients[i] = s->clients[--s->clientCount];
+    }
+  }
+}
+
+static void *
+streamerThread(void *arg) {
+  PcmStreamer *s = arg;
+  FrameRing *ring = s->ring;
+  const int periodTime = 1000*(uint64_t)period_size/inputSampleRate; /* ms */
+
+  while (!quit) {
+    struct pollfd pfd = { .fd = s->listenFd, .events = POLLIN };
+    unsigned long fill;
+
+    if (poll(&pfd, 1, periodTime/2) > 0) acceptStreamClient(s);
+    /* Without clients the frames are consumed all the same */
+    while ((fill = frameRingFill(ring)) > 0) {
+      unsigned long frames;
+      const char *src = frameRingPeek(ring, 0, &frames);
+
+      if (frames > fill) frames = fill;
+      if (frames > period_size) frames = period_size;
+      sendToStreamClients(s, src, frames * ring->frameSize);
+      frameRingConsume(ring, frames);
     }
-    output_new_delay = (int)delay;
+  }
+  while (s->clientCount > 0) close(s->clients[--s->clientCount]);
+
+  return NULL;
+}
 
-    delay += skipFrames;
+static int
+startPcmStreamer(PcmStreamer *s, FrameRing *ring, const char *spec) {
+  int err;
 
-    // Set the resample_rate... we need to adjust the offset integral, to do this.
-    // first look at the PI controller, this code is just a special case, which should never execute once
-    // everything is swung in. 
-    offset_integral = - (resample_mean - static_resample_factor)
-                    * catch_factor * catch_factor2;
-    // Also clear the array. we are beginning a new control cycle.
-    for (i=0; i<smooth_size; i++) offset_array[i] = 0.0;
+  memset(s, 0, sizeof(*s));
+  s->ring = ring;
+  if ((s->listenFd = listenSocket(spec)) < 0) return 0;
+  if ((err = pthread_create(&s->thread, NULL, streamerThread, s)) != 0) {
+    fprintf(stderr, "cannot create streamer thread: %s\n", strerror(err));
+    close(s->listenFd);
+    return 0;
   }
-  if (delay < (target_delay-max_diff)) {
-    int rewound = snd_pcm_rewind(pcmIn, target_delay - delay);
-    printf("Rewound %d, delay was %d\n", rewound, (int)delay);
+  return 1;
+}
 
-    output_new_delay = (int)delay;
-    delay += rewound;
+/* Wait for the streamer thread to finish after quit has been set */
+static void
+stopPcmStreamer(PcmStreamer *s) {
+  pthread_join(s->thread, NULL);
+  close(s->listenFd);
+}
+
+/* Audio fan-out
+ *
+ * One capture stage feeds every sink asked for, each reading the ring
+ * of audioCapture through a reader of its own, see addFrameRingReader().
+ */
+
+static void
+reportDropped(const char *sink, FrameRing *ring) {
+  if (ring->dropped)
+    printf("%s: %lu frames dropped\n", sink, ring->dropped);
+}
 
-    // Set the resample_rate... we need to adjust the offset integral, to do this.
-    offset_integral = - (resample_mean - static_resample_factor)
-                    * catch_factor * catch_factor2;
-    for (i=0; i<smooth_size; i++) offset_array[i] = 0.0;
+/**
+ * Capture from the ALSA device until SIGTERM or SIGINT, for JACK if
+ * useJack, into an Ogg Vorbis file if outFile is not NULL and for the
+ * clients of streamSocket if it is set.  Returns 0 if one of them could
+ * not be started.
+ */
+static int
+runAudio(char *device, const char *outFile, int useJack,
+         const char *clockFile) {
+  AudioCapture *capture = &audioCapture;
+  PcmStreamer streamer;
+  FrameRing streamRing;
+#ifdef HAVE_VORBIS
+  Recorder rec;
+  FrameRing recordRing;
+  int recording = 0;
+#endif
+#ifdef HAVE_OPUS
+  static RtpStreamer rtp;
+  int rtpStreaming = 0;
+#endif
+#ifdef HAVE_JACK
+  int jack = 0, jackActive = 0;
+#endif
+  int streaming = 0, capturing = 0, ok = 1;
+  snd_pcm_t *pcm;
+
+  lockMemory();
+  if ((pcm = openAudioIn(device, inputSampleRate, num_channels,
+                         period_size, num_periods)) == NULL)
+    return 0;
+  if (!initCapture(capture, pcm)) {
+    snd_pcm_close(pcm);
+    return 0;
   }
-  /* ok... now we should have target_delay +- max_diff on the alsa side.
-   *
-   * calculate the number of frames, we want to get.
-   */
 
-  double offset = delay - target_delay;
+  if (useJack) {
+#ifdef HAVE_JACK
+    ok = jack = addFrameRingReader(&capture->ring, &jackRing)
+             && openJack(device, clockFile);
+#else
+    printf("Jack support not compiled in\n");
+    ok = 0;
+#endif
+  }
+#ifdef HAVE_VORBIS
+  if (ok && outFile != NULL)
+    ok = recording = addFrameRingReader(&capture->ring, &recordRing)
+                  && startRecorder(&rec, &recordRing, outFile);
+#endif
+  if (ok && streamSocket != NULL)
+    ok = streaming = addFrameRingReader(&capture->ring, &streamRing)
+                  && startPcmStreamer(&streamer, &streamRing, streamSocket);
+#ifdef HAVE_OPUS
+  if (ok && rtpDestination != NULL)
+    ok = rtpStreaming = addFrameRingReader(&capture->ring, &rtpRing)
+                     && startRtpStreamer(&rtp, &rtpRing, rtpDestination);
+#endif
+
+  if (ok) ok = capturing = startCapture(capture);
+  if (ok) {
+    signal(SIGTERM, sigterm_handler);
+    signal(SIGINT, sigterm_handler);
+#ifdef HAVE_JACK
+    if (jack) ok = jackActive = activateJack();
+#endif
+  }
+  if (ok) {
+    /* A recording which has ended for a write error ends the run */
+    const int *finished = NULL;
 
-  // Save offset.
-  offset_array[(offset_differential_index++)%smooth_size] = offset;
+#ifdef HAVE_VORBIS
+    if (recording) finished = &rec.finished;
+#endif
+    reportRealtime("audio capture");
+#ifdef HAVE_JACK
+    if (jack || metricsFd >= 0) {
+      runTelemetry(finished);
+    } else
+#endif
+    {
+      while (!quit && !(finished != NULL &&
+                        __atomic_load_n(finished, __ATOMIC_ACQUIRE)))
+        usleep(250000);
+    }
+  }
+  quit = 1;
 
-  // Build the mean of the windowed offset array
-  // basically fir lowpassing.
-  double smooth_offset = 0.0;
-  for (i=0; i<smooth_size; i++)
-    smooth_offset += offset_array[(i + offset_differential_index-1)
-				  % smooth_size] * window_array[i];
-  smooth_offset /= (double)smooth_size;
+#ifdef HAVE_JACK
+  if (jack) {
+    closeJack(device, clockFile, jackActive);
+    reportDropped("JACK", &jackRing);
+  }
+#endif
+#ifdef HAVE_VORBIS
+  if (recording) {
+    if (!stopRecorder(&rec)) {
+      perror(outFile);
+      ok = 0;
+    }
+    reportDropped(outFile, &recordRing);
+  }
+#endif
+  if (streaming) {
+    stopPcmStreamer(&streamer);
+    reportDropped(streamSocket, &streamRing);
+  }
+#ifdef HAVE_OPUS
+  if (rtpStreaming) {
+    stopRtpStreamer(&rtp);
+    reportDropped(rtpDestination, &rtpRing);
+  }
+#endif
+  if (capturing) stopCapture(capture);
+  else freeFrameRing(&capture->ring);
+  snd_pcm_close(pcm);
 
-  // this is the integral of the smoothed_offset
-  offset_integral += smooth_offset;
+  return ok;
+}
+#endif
 
-  // Clamp offset.
-  // the smooth offset still contains unwanted noise
-  // which would go straigth onto the resample coeff.
-  // it only used in the P component and the I component is used for the fine tuning anyways.
-  if (fabs(smooth_offset) < pclamp) smooth_offset = 0.0;
+/* Daemon mode
+ *
+ * Several tuners are driven from a single epoll loop, which decodes the
+ * RDS of every radio device and serves the control socket.  The audio of
+ * every capture device is moved into its ring by a second epoll loop on
+ * a thread of its own, so that tuning, which blocks for an AF probe or a
+ * seek, does not hold up the capture of any tuner.  The kernel queues the
+ * RDS blocks meanwhile.  Each recording is encoded on a thread of its
+ * own.
+ */
 
-  // ok. now this is the PI controller. 
-  // u(t) = K * ( e(t) + 1/T \int e(t') dt' )
-  // K = 1/catch_factor and T = catch_factor2
-  double current_resample_factor = static_resample_factor
-                                 - smooth_offset / (double)catch_factor
-                                 - offset_integral / (double)catch_factor
-                                 / (double)catch_factor2;
+#include <sys/epoll.h>
 
-  // quantize around resample_mean, so that noise in the integral component doesnt hurt.
-  current_resample_factor = floor((current_resample_factor - resample_mean)
-				  * controlquant + 0.5)
-                          / controlquant + resample_mean;
+#define DAEMON_EVENTS 64
 
-  output_resampling_factor = (float)current_resample_factor;
-  output_diff = (float) smooth_offset;
-  output_integral = (float) offset_integral;
-  output_offset = (float) offset;
+typedef struct {
+  char *radioDevice, *audioDevice, *outFile;
+  float frequency;
 
-  // Clamp a bit.
-  if (current_resample_factor < MIN_RESAMPLE_FACTOR)
-    current_resample_factor = MIN_RESAMPLE_FACTOR;
-  else if (current_resample_factor > MAX_RESAMPLE_FACTOR)
-    current_resample_factor = MAX_RESAMPLE_FACTOR;
+  Tuner tuner;
+  RdsDecoder decoder;
+  RdsReadBuffer rds;
 
-  // Calculate resample_mean so we can init ourselves to saner values.
-  resample_mean = 0.9999 * resample_mean + 0.0001 * current_resample_factor;
+#ifdef HAVE_AUDIO
+  AudioCapture capture;
+  struct pollfd *pcmFds;
+  int pcmFdCount;
+#endif
+#ifdef HAVE_VORBIS
+  Recorder recorder;
+  int recording;
+#endif
+} DaemonTuner;
+
+/* epoll data of a descriptor, slot 0 is RDS and slot n the nth PCM fd */
+#define DAEMON_EVENT_DATA(tuner, slot) ((uint64_t)(tuner) << 8 | (slot))
+/* or of a control socket, with its descriptor */
+#define DAEMON_CONTROL_EVENT ((uint64_t)1 << 63)
+
+static char *
+nextSpecField(char **spec) {
+  char *field = *spec, *comma;
+
+  if (field == NULL) return NULL;
+  if ((comma = strchr(field, ',')) != NULL) {
+    *comma = 0;
+    *spec = comma + 1;
+  } else {
+    *spec = NULL;
+  }
+  return *field? field : NULL;
+}
+
+/* Parse RADIO[,ALSADEV[,FREQ[,OUT.ogg]]] */
+static int
+parseDaemonTuner(DaemonTuner *dt, char *spec) {
+  char *frequency;
+
+  memset(dt, 0, sizeof(*dt));
+  dt->radioDevice = nextSpecField(&spec);
+  dt->audioDevice = nextSpecField(&spec);
+  if ((frequency = nextSpecField(&spec)) != NULL)
+    dt->frequency = strtof(frequency, (char **)NULL);
+  dt->outFile = nextSpecField(&spec);
+
+  return dt->radioDevice != NULL;
+}
+
+static int
+watchDescriptor(int epfd, int fd, uint32_t events, uint64_t data) {
+  struct epoll_event event = { .events = events, .data.u64 = data };
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    perror("epoll_ctl");
+    return 0;
+  }
+  return 1;
+}
 
-  {
-    char *outbuf;
-    float *resampbuf;
-    int rlen = ceil(((double)nframes) / current_resample_factor)+2;
-    int framesToRead = rlen;
-    int readOffset = 0;
-    assert(rlen > 2);
+#ifdef HAVE_AUDIO
+static void
+stopDaemonAudio(int epfd, DaemonTuner *dt) {
+  for (int k = 0; k < dt->pcmFdCount; k++)
+    epoll_ctl(epfd, EPOLL_CTL_DEL, dt->pcmFds[k].fd, NULL);
+  dt->pcmFdCount = 0;
+}
 
-    outbuf = alloca(rlen * formats[format].sample_size * num_channels);
+static int
+openDaemonAudio(int epfd, DaemonTuner *dt, int index) {
+  static int negotiated = 0, firstFormat;
+  static unsigned int firstRate;
+  static char firstChannels;
+  snd_pcm_t *pcm;
+  int count;
+
+  if ((pcm = openAudioIn(dt->audioDevice, inputSampleRate, num_channels,
+                         period_size, num_periods)) == NULL)
+    return 0;
+
+  /* The converters and encoders are set up for one format */
+  if (!negotiated) {
+    firstFormat = format;
+    firstRate = inputSampleRate;
+    firstChannels = num_channels;
+    negotiated = 1;
+  } else if (format != firstFormat || inputSampleRate != firstRate ||
+             num_channels != firstChannels) {
+    fprintf(stderr, "%s: format differs from the first capture device\n",
+            dt->audioDevice);
+    snd_pcm_close(pcm);
+    return 0;
+  }
 
-    resampbuf = alloca(rlen * sizeof( float ));
+  if (initCapture(&dt->capture, pcm)) {
+    count = snd_pcm_poll_descriptors_count(pcm);
+    if (count > 0 && count < 0XFF &&
+        (dt->pcmFds = calloc(count, sizeof(*dt->pcmFds))) != NULL &&
+        (count = snd_pcm_poll_descriptors(pcm, dt->pcmFds, count)) > 0) {
+      for (dt->pcmFdCount = 0; dt->pcmFdCount < count; dt->pcmFdCount++) {
+        struct pollfd *pfd = &dt->pcmFds[dt->pcmFdCount];
 
-    // get the data...
-    int iterations = 10;
-    while (framesToRead > 0 && --iterations) {
-      err = snd_pcm_readi(pcmIn, outbuf+readOffset, framesToRead);
-      if (err == -EAGAIN) { usleep(100); continue; }
-      if (err < 0) {
-	if (xrun_recovery(pcmIn, err) < 0) {
-	  printf("xrun_recover failed: %s\n", snd_strerror(err));
-	  exit(EXIT_FAILURE);
-	}
-	continue;
+        if (!watchDescriptor(epfd, pfd->fd, pfd->events,
+                             DAEMON_EVENT_DATA(index, dt->pcmFdCount + 1)))
+          break;
+      }
+      if (dt->pcmFdCount == count) {
+#ifdef HAVE_VORBIS
+        if (dt->outFile != NULL)
+          dt->recording = startRecorder(&dt->recorder, &dt->capture.ring,
+                                        dt->outFile);
+#endif
+        return 1;
       }
-      readOffset += err * formats[format].sample_size * num_channels;
-      framesToRead -= err;
+      stopDaemonAudio(epfd, dt);
+    } else {
+      fprintf(stderr, "%s: no poll descriptors\n", dt->audioDevice);
     }
+    free(dt->pcmFds);
+    dt->pcmFds = NULL;
+    freeFrameRing(&dt->capture.ring);
+  }
+  snd_pcm_close(pcm);
+  dt->capture.pcm = NULL;
 
-    int channel = 0;
-    SRC_DATA src;
-    int unusedFrames = 0;
-    for (channel = 0; channel < num_channels; channel++) {
-      float *buf = jack_port_get_buffer(jackPorts[channel], nframes);
-      SRC_STATE *src_state = srcs[channel];
-
-      formats[format].soundcard_to_jack(resampbuf,
-					outbuf + format[formats].sample_size
-					* channel, rlen,
-					num_channels
-					* format[formats].sample_size);
-
-      src.data_in = resampbuf;
-      src.input_frames = rlen;
+  return 0;
+}
 
-      src.data_out = buf;
-      src.output_frames = nframes;
-      src.end_of_input = 0;
-      src.src_ratio = current_resample_factor;
+typedef struct {
+  DaemonTuner *tuners;
+  int epfd;
+  pthread_t thread;
+} DaemonAudio;
+
+/* Read everything the device has, dropping it when the ring is full */
+static snd_pcm_sframes_t
+drainCapture(AudioCapture *capture) {
+  snd_pcm_sframes_t err;
+
+  while ((err = readCapture(capture)) > 0);
+  if (err == -ENOBUFS) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(capture->pcm);
+
+    if (avail > 0 && (avail = snd_pcm_forward(capture->pcm, avail)) > 0)
+      capture->dropped += avail;
+    return 0;
+  }
+  return err == -EAGAIN? 0 : err;
+}
+#endif
 
-      src_process(src_state, &src);
+static void
+handleDaemonEvent(int epfd, DaemonTuner *dt, int slot, uint32_t events) {
+  if (slot == 0) {
+    ssize_t count = readRdsBlocks(dt->tuner.fd, &dt->rds, &dt->decoder);
 
-      unusedFrames = rlen - src.input_frames_used;
+    if (count == 0 || (count == -1 && errno != EINTR && errno != EAGAIN)) {
+      if (count == -1) perror(dt->radioDevice);
+      epoll_ctl(epfd, EPOLL_CTL_DEL, dt->tuner.fd, NULL);
     }
-
-    if (unusedFrames) {
-      if (verbose > 1) printf("putback = %d\n", unusedFrames);
-      snd_pcm_rewind(pcmIn, unusedFrames);
+  }
+#ifdef HAVE_AUDIO
+  else if (slot <= dt->pcmFdCount) {
+    unsigned short revents;
+
+    dt->pcmFds[slot-1].revents = events;
+    snd_pcm_poll_descriptors_revents(dt->capture.pcm, dt->pcmFds,
+                                     dt->pcmFdCount, &revents);
+    dt->pcmFds[slot-1].revents = 0;
+    if ((revents & (POLLIN|POLLERR)) && drainCapture(&dt->capture) < 0) {
+      fprintf(stderr, "%s: capture stopped\n", dt->audioDevice);
+      stopDaemonAudio(epfd, dt);
     }
   }
-
-  return 0;
+#endif
 }
 
-/**
- * Allocate the necessary jack ports...
- */
-static void
-alloc_ports(int n_capture) {
-  for (int chn = 0; chn < n_capture; chn++) {
-    char buf[32];
-    snprintf(buf, sizeof(buf) - 1, "capture_%u", chn+1);
+#ifdef HAVE_AUDIO
+/* The loop which moves the audio of all capture devices */
+static void *
+daemonAudioThread(void *arg) {
+  DaemonAudio *audio = arg;
+  struct epoll_event events[DAEMON_EVENTS];
 
-    jack_port_t *port = jack_port_register(jackClient, buf,
-					   JACK_DEFAULT_AUDIO_TYPE,
-                                           JackPortIsOutput, 0);
+  prefaultStack();
+  while (!quit) {
+    const int n = epoll_wait(audio->epfd, events, DAEMON_EVENTS, 1000);
 
-    if (port == NULL) {
-      printf("cannot register port %s\n", buf);
-      exit(EXIT_FAILURE);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
     }
+    for (int e = 0; e < n; e++) {
+      const uint64_t data = events[e].data.u64;
 
-    srcs[chn] = src_new(4-resample_quality, 1, NULL);
-    jackPorts[chn] = port;
+      handleDaemonEvent(audio->epfd, &audio->tuners[data >> 8], data & 0XFF,
+                        events[e].events);
+    }
   }
+  quit = 1;
+
+  return NULL;
 }
+#endif
 
 static void
-jack_shutdown(void *arg) {
-  exit(1);
+handleDaemonControl(int epfd, ControlServer *server, DaemonTuner *tuners,
+                    ControlTarget *targets, int count, int fd) {
+  if (fd == server->listenFd) {
+    if ((fd = acceptControlClient(server)) >= 0 &&
+        !watchDescriptor(epfd, fd, EPOLLIN, DAEMON_CONTROL_EVENT | fd))
+      closeControlClient(server, server->clientCount - 1);
+    return;
+  }
+  for (int i = 0; i < server->clientCount; i++) {
+    if (server->clients[i].fd != fd) continue;
+    serveControlClient(server, i, targets, count);
+    break;
+  }
+  /* There is no intake thread to drop the blocks of a tuner which has
+   * been tuned away, see rdsIntakeThread()
+   */
+  for (int i = 0; i < count; i++) {
+    DaemonTuner *dt = &tuners[i];
+
+    if (dt->tuner.fd > 0 && dt->tuner.tuneEpoch != dt->decoder.epoch) {
+      discardRdsBlocks(dt->tuner.fd);
+      dt->rds.fill = 0;
+      newRdsEpoch(&dt->decoder, dt->tuner.tuneEpoch);
+    }
+  }
 }
 
+/* Scan the band with all tuners into their shared station table */
 static void
-sigterm_handler(int signal) {
-  quit = 1;
+scanDaemonStations(DaemonTuner *tuners, int count, ProgramTable *programs,
+                   const char *stationFile) {
+  Tuner **scanners = calloc(count, sizeof(*scanners));
+  int scanning = 0;
+
+  for (int i = 0; i < count; i++) {
+    if (tuners[i].tuner.fd > 0 && scanners != NULL)
+      scanners[scanning++] = &tuners[i].tuner;
+  }
+  if (scanning > 0) {
+    printf("%d stations found\n", scanBand(scanners, scanning, programs));
+    if (stationFile != NULL) saveStations(programs, stationFile);
+  }
+  free(scanners);
 }
 
-static inline double hann(double x) { return 0.5 * (1.0 - cos(2*M_PI * x)); }
+/**
+ * Run all tuners until SIGTERM or SIGINT, returns 0 if none of them
+ * could be opened.  The tuners share programs, so that it can be backed
+ * by a single station cache.
+ */
 static int
-setupSmoothing() {
-  if ((offset_array = malloc(sizeof(double) * smooth_size)) != NULL) {
-    if ((window_array = malloc(sizeof(double) * smooth_size)) != NULL) {
-      int i;
-      for (i=0; i<smooth_size; i++) {
-	offset_array[i] = 0.0;
-	window_array[i] = hann((double)i / ((double) smooth_size - 1.0));
-      }
+runDaemon(DaemonTuner *tuners, int count, ProgramTable *programs,
+          const char *stationFile, int scan) {
+  struct epoll_event events[DAEMON_EVENTS];
+  ControlServer server = { .listenFd = -1 };
+  ControlTarget *targets;
+  int epfd, running = 0;
+#ifdef HAVE_AUDIO
+  DaemonAudio audio = { .tuners = tuners };
+  int audioStarted = 0;
+#endif
 
-      return 1;
+  if ((targets = calloc(count, sizeof(*targets))) == NULL) {
+    fprintf(stderr, "no memory for control targets\n");
+    return 0;
+  }
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("epoll_create1");
+    free(targets);
+    return 0;
+  }
+
+#ifdef HAVE_AUDIO
+  if ((audio.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("epoll_create1");
+    close(epfd);
+    free(targets);
+    return 0;
+  }
+  /* The mmap capture ring keeps frames from the device until they have
+   * been consumed, so the device descriptor would stay readable and
+   * could not be used to wait for new audio.
+   */
+  captureAccess = SND_PCM_ACCESS_RW_INTERLEAVED;
+#endif
+
+  lockMemory();
+  setupGroupDecoders();
+  for (int i = 0; i < count; i++) {
+    DaemonTuner *dt = &tuners[i];
+
+    if (openTuner(&dt->tuner, dt->radioDevice)) {
+      dt->tuner.programs = programs;
+      if (dt->frequency == 0) dt->frequency = dt->tuner.currentFrequency;
+    }
+  }
+  if (scan) scanDaemonStations(tuners, count, programs, stationFile);
+
+  for (int i = 0; i < count; i++) {
+    DaemonTuner *dt = &tuners[i];
+
+    if (dt->tuner.fd <= 0) continue;
+    setTunerFrequency(&dt->tuner, dt->frequency);
+    setTunerVolume(&dt->tuner, 100);
+
+    initRdsDecoder(&dt->decoder, &dt->tuner);
+    dt->decoder.epoch = dt->tuner.tuneEpoch;
+    if (count > 1) dt->decoder.label = dt->radioDevice;
+    if (dt->tuner.capabilities & V4L2_CAP_RDS_CAPTURE) {
+      watchDescriptor(epfd, dt->tuner.fd, EPOLLIN, DAEMON_EVENT_DATA(i, 0));
     } else {
-      fprintf(stderr, "no memory for window_array\n");
+      printf("%s: Radio Data System not supported\n", dt->radioDevice);
     }
-  } else {
-    fprintf(stderr, "no memory for offset_array\n");
+#ifdef HAVE_AUDIO
+    if (dt->audioDevice != NULL) openDaemonAudio(audio.epfd, dt, i);
+#else
+    if (dt->audioDevice != NULL)
+      printf("%s: audio support not compiled in\n", dt->audioDevice);
+#endif
+    running += 1;
   }
-  return 0;
-}
+
+  for (int i = 0; i < count; i++) {
+    targets[i].tuner = &tuners[i].tuner;
+    targets[i].decoder = &tuners[i].decoder;
+  }
+  if (running > 0 && controlSocket != NULL &&
+      (server.listenFd = listenSocket(controlSocket)) >= 0 &&
+      !watchDescriptor(epfd, server.listenFd, EPOLLIN,
+                       DAEMON_CONTROL_EVENT | server.listenFd))
+    closeControlServer(&server);
+
+  if (running > 0) {
+    signal(SIGTERM, sigterm_handler);
+    signal(SIGINT, sigterm_handler);
+#ifdef HAVE_AUDIO
+    for (int i = 0; i < count; i++) {
+      int err;
+
+      if (tuners[i].capture.pcm == NULL) continue;
+      if ((err = pthread_create(&audio.thread, NULL,
+                                daemonAudioThread, &audio)) != 0) {
+        fprintf(stderr, "cannot create audio thread: %s\n", strerror(err));
+        running = 0;
+      } else {
+        setupRealtimeThread("daemon audio", audio.thread, &realtime.audio);
+        audioStarted = 1;
+      }
+      break;
+    }
+#endif
+    setupRealtimeThread("daemon", pthread_self(), &realtime.rds);
+    prefaultStack();
+    reportRealtime("the daemon");
+  }
+  while (running > 0 && !quit) {
+    int n;
+
+    for (int i = 0; i < count; i++) {
+      if (tuners[i].tuner.fd > 0) {
+        checkAlternativeFrequencies(&tuners[i].tuner, &tuners[i].decoder,
+                                    &tuners[i].rds);
+        sampleRdsHealth(&tuners[i].decoder, monotonicTime() / 1000000);
+      }
+    }
+    flushEventSink();
+    n = epoll_wait(epfd, events, DAEMON_EVENTS, 1000);
+
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+    for (int e = 0; e < n; e++) {
+      const uint64_t data = events[e].data.u64;
+
+      if (data & DAEMON_CONTROL_EVENT)
+        handleDaemonControl(epfd, &server, tuners, targets, count,
+                            (int)(data & ~DAEMON_CONTROL_EVENT));
+      else
+        handleDaemonEvent(epfd, &tuners[data >> 8], data & 0XFF,
+                          events[e].events);
+    }
+  }
+  quit = 1;
+#ifdef HAVE_AUDIO
+  if (audioStarted) pthread_join(audio.thread, NULL);
+  close(audio.epfd);
+#endif
+  closeControlServer(&server);
+  free(targets);
+  closeEventSink();
+
+  for (int i = 0; i < count; i++) {
+    DaemonTuner *dt = &tuners[i];
+
+#ifdef HAVE_AUDIO
+    if (dt->capture.pcm != NULL) {
+#ifdef HAVE_VORBIS
+      if (dt->recording && !stopRecorder(&dt->recorder))
+        perror(dt->outFile);
+#endif
+      if (dt->capture.dropped)
+        printf("%s: %lu frames dropped\n", dt->audioDevice,
+               dt->capture.dropped);
+      free(dt->pcmFds);
+      freeFrameRing(&dt->capture.ring);
+      snd_pcm_close(dt->capture.pcm);
+    }
 #endif
+    if (dt->tuner.fd > 0) {
+      freeRdsDecoder(&dt->decoder);
+      close(dt->tuner.fd);
+    }
+  }
+  close(epfd);
+
+  return running > 0;
+}
 
+#ifndef SI470X_BENCH
 int
 main(int argc, char *argv[]) {
-  int fd, option;
+  int option;
   float newFreq = 0;
-  char *outFile = NULL;
   char *device = DEFAULT_RADIO_DEVICE;
+  char *rawRdsFile = NULL, *replayFile = NULL;
+  char *stationFile = NULL, *cacheFile = NULL;
+  DaemonTuner *daemonTuners = NULL;
+  int daemonTunerCount = 0;
+  int seekUp = 0, scan = 0;
+#ifdef HAVE_AUDIO
+  char *outFile = NULL, *clockFile = NULL;
   char *alsaDevice = DEFAULT_AUDIO_DEVICE;
-  int seekUp = 0, useJack = 0;
+  unsigned int rate = 0, period = 0, periods = 0;
+  int quality = -1, useJack = 0;
+#endif
+  Tuner tuner;
+  ProgramTable programs;
 
-  while ((option = getopt(argc, argv, "a:d:jF:o:sv")) != -1) {
+  while ((option = getopt(argc, argv, "a:A:B:c:C:d:E:f:i:jK:l:L:mM:n:N:F:o:O:p:P:q:r:R:sSt:T:U:vW:x:X:")) != -1) {
     switch (option) {
-    case 'a':
-      alsaDevice = optarg;
-      break;
     case 'd':
       device = optarg;
       break;
     case 'F':
       newFreq = strtof(optarg, (char **)NULL);
       break;
+    case 'X':
+      if (!parseRealtime(optarg)) {
+        fprintf(stderr, "Use CPU[:PRIORITY] with priorities 0 to %d\n",
+                sched_get_priority_max(SCHED_FIFO));
+        exit(EXIT_FAILURE);
+      }
+      break;
+#ifdef HAVE_AUDIO
+    case 'a':
+      alsaDevice = optarg;
+      break;
     case 'j':
       useJack = 1;
       break;
+    case 'N':
+      streamSocket = optarg;
+      break;
     case 'o':
       outFile = optarg;
       break;
+    case 'p':
+      if ((latencyProfile = findLatencyProfile(optarg)) == NULL) {
+        fprintf(stderr, "Unknown latency profile %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'i':
+      rate = atoi(optarg);
+      break;
+    case 'f':
+      period = atoi(optarg);
+      break;
+    case 'n':
+      periods = atoi(optarg);
+      break;
+    case 'q':
+      quality = atoi(optarg);
+      if (quality < 0 || quality > 4) {
+        fprintf(stderr, "Resample quality is 0 to 4\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+#endif
+#ifdef HAVE_JACK
+    case 'l': {
+      int i;
+      for (i = 0; i < sizeof(smoothingNames)/sizeof(*smoothingNames); i++) {
+        if (strcmp(optarg, smoothingNames[i]) == 0) break;
+      }
+      if (i == sizeof(smoothingNames)/sizeof(*smoothingNames)) {
+        fprintf(stderr, "Unknown smoothing filter %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      smoothing = i;
+      break;
+    }
+    case 'm':
+      interleaved_resampling = 1;
+      break;
+    case 'M':
+      if (!openMetrics(optarg)) exit(EXIT_FAILURE);
+      break;
+    case 't':
+      target_delay = atoi(optarg);
+      break;
+    case 'x':
+      max_diff = atoi(optarg);
+      break;
+    case 'c':
+      if (strcmp(optarg, "adaptive") == 0) {
+        adaptive_control = 1;
+      } else if (strcmp(optarg, "fixed") != 0) {
+        fprintf(stderr, "Unknown controller %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'K':
+      clockFile = optarg;
+      break;
+#endif
+#ifdef HAVE_OPUS
+    case 'r':
+      rtpDestination = optarg;
+      break;
+    case 'O':
+      rtpFrameTime = atoi(optarg);
+      if (rtpFrameTime != 10 && rtpFrameTime != 20) {
+        fprintf(stderr, "Opus frames are 10 or 20 ms\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+#endif
+    case 'L': {
+      char *locations = strchr(optarg, ',');
+
+      if (locations != NULL) *locations++ = 0;
+      if (!loadTmcTable(&tmcEvents, optarg)
+       || (locations != NULL && !loadTmcTable(&tmcLocations, locations)))
+        exit(EXIT_FAILURE);
+      break;
+    }
+    case 'A':
+      afSwitchSignal = atoi(optarg) * 0XFFFF / 100;
+      break;
+    case 'B':
+      replayFile = optarg;
+      break;
+    case 'C':
+      cacheFile = optarg;
+      break;
+    case 'E':
+      if (!openEventSink(optarg)) exit(EXIT_FAILURE);
+      break;
+    case 'P':
+      stationFile = optarg;
+      break;
+    case 'R':
+      rawRdsFile = optarg;
+      break;
     case 's':
       seekUp = 1;
       break;
+    case 'S':
+      scan = 1;
+      break;
+    case 'T': {
+      DaemonTuner *list = realloc(daemonTuners,
+                                  (daemonTunerCount+1)*sizeof(*list));
+      if (list == NULL) {
+        fprintf(stderr, "no memory for tuner list\n");
+        exit(EXIT_FAILURE);
+      }
+      daemonTuners = list;
+      if (!parseDaemonTuner(&daemonTuners[daemonTunerCount++], optarg)) {
+        fprintf(stderr, "No radio device in -T %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 'U':
+      controlSocket = optarg;
+      break;
     case 'v':
       verbose += 1;
       break;
+    case 'W':
+      if ((rdsCapture = fopen(optarg, "w")) == NULL) {
+        perror(optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
     default:
-      fprintf(stderr, "Usage: %s [-d DEVICE] [-a ALSADEV] [-F FREQ] "
-	              "[[-j] | [-o OUT.ogg]] [-v]\n"
+      fprintf(stderr, "Usage: %s [-d DEVICE] [-F FREQ] "
+	              "[-P FILE [-S]] [-C FILE]\n"
+	              "          [-A PERCENT] [-E SINK] [-L TABLES]\n"
+#ifdef HAVE_AUDIO
+	              "          [-a ALSADEV] [-o OUT.ogg] [-N SOCKET]\n"
+	              "          [-p PROFILE] [-i RATE] [-f FRAMES] [-n PERIODS] [-q QUALITY]\n"
+#endif
+#ifdef HAVE_JACK
+	              "          [-j [-m] [-l FILTER] [-c CONTROL] [-K FILE] [-M METRICS]\n"
+	              "              [-t FRAMES] [-x FRAMES]]\n"
+#endif
+#ifdef HAVE_OPUS
+	              "          [-r HOST:PORT [-O MS]]\n"
+#endif
+	              "          [-X AUDIO[,RDS]] [-U SOCKET] [-W FILE] [-v]\n"
+	              "       %s -T RADIO[,ALSADEV[,FREQ[,OUT.ogg]]] ... "
+	              "[-P FILE [-S]] [-C FILE] [-A PERCENT]\n"
+	              "          [-E SINK] [-L TABLES] [-X AUDIO[,RDS]] [-U SOCKET] [-v]\n"
+	              "       %s -R BITS|-B FILE [-E SINK] [-L TABLES] [-v]\n"
 	              "\n"
 	              "Options\n"
 	              "\t-d DEVICE\tRadio device (default %s)\n"
-	              "\t-a ALSADEV\tAudio device to read from (default %s)\n"
-	              "\t-j\t\tUse JACK for output\n"
-	              "\t-o FILE.ogg\tWrite output to file\n"
 	              "\t-F FREQ\t\tSet frequency (in MHz)\n"
+	              "\t-T SPEC\t\tRun all tuners given by -T in one process\n"
+	              "\t-P FILE\t\tStation database\n"
+	              "\t-S\t\tScan the band first (split across all tuners)\n"
+	              "\t-C FILE\t\tStation cache, kept up to date while running\n"
+	              "\t-A PERCENT\tSwitch to the best AF below this signal\n"
+	              "\t-R BITS\t\tDecode a raw RDS bitstream ('0'/'1', - for stdin)\n"
+	              "\t-U SOCKET\tServe control requests on a socket path,\n"
+	              "\t\t\tor [HOST]:PORT (loopback without HOST)\n"
+	              "\t-W FILE\t\tCapture the RDS blocks read from the tuner\n"
+	              "\t-B FILE\t\tReplay a capture as fast as possible\n"
+	              "\t-E SINK\t\tEvent output: text, json or binary[:FILE],\n"
+	              "\t\t\tor ring:FILE for a shared memory ring\n"
+	              "\t-L EVENTS[,LOCATIONS]\n"
+	              "\t\t\tTMC tables with CODE;TEXT lines\n"
+	              "\t-X AUDIO[,RDS]\tLock memory and run the audio and RDS threads\n"
+	              "\t\t\tas CPU[:PRIORITY] each, - for any CPU\n"
+	              "\t\t\t(default priorities 70 and 60)\n"
 	              "\t-v\t\tIncrease verbosity\n",
-              argv[0],
-	      DEFAULT_RADIO_DEVICE, DEFAULT_AUDIO_DEVICE);
+              argv[0], argv[0], argv[0], DEFAULT_RADIO_DEVICE);
+#ifdef HAVE_AUDIO
+      fprintf(stderr, "\t-a ALSADEV\tAudio device to read from (default %s)\n"
+	              "\t-o FILE.ogg\tWrite output to file\n"
+	              "\t-N SOCKET\tStream the captured audio to clients of a\n"
+	              "\t\t\tsocket path, or [HOST]:PORT\n"
+	              "\t-p PROFILE\tLatency profile: ultra-low, low, default or\n"
+	              "\t\t\tarchival\n"
+	              "\t-i RATE\t\tCapture sample rate (profile)\n"
+	              "\t-f FRAMES\tCapture period size (profile)\n"
+	              "\t-n PERIODS\tCapture periods in the buffer (profile)\n"
+	              "\t-q QUALITY\tResampler, 0 (linear) to 4 (best sinc) (profile)\n"
+#ifdef HAVE_JACK
+	              "\t-j\t\tUse JACK for output\n"
+	              "\t-m\t\tResample all channels in one pass (JACK)\n"
+	              "\t-l FILTER\tDelay smoothing: hann, cma or iir (JACK)\n"
+	              "\t-c CONTROL\tDrift controller: fixed or adaptive (JACK)\n"
+	              "\t-K FILE\t\tCapture clock of each device, kept up to date\n"
+	              "\t\t\t(JACK)\n"
+	              "\t-M METRICS\tServe statistics on a socket path, or\n"
+	              "\t\t\t[HOST]:PORT for HTTP (JACK)\n"
+	              "\t-t FRAMES\tTarget delay (JACK, profile)\n"
+	              "\t-x FRAMES\tMaximum delay error before a reset (JACK)\n"
+#endif
+#ifdef HAVE_OPUS
+	              "\t-r HOST:PORT\tStream the audio as RTP/Opus over UDP\n"
+	              "\t-O MS\t\tOpus frame duration, 10 or 20 (default 20)\n"
+#endif
+	              , DEFAULT_AUDIO_DEVICE);
+#endif
       exit(EXIT_FAILURE);
     }
   }
 
-  if ((fd = open(device, O_RDONLY)) > 0) {
-    struct v4l2_tuner tuner;
-
-    memset(&tuner, 0, sizeof(tuner));
-
-    if (ioctl(fd, VIDIOC_G_TUNER, &tuner) != -1) {
-      struct v4l2_capability caps;
+#ifdef HAVE_AUDIO
+  setLatencyProfile(latencyProfile);
+  if (rate) inputSampleRate = rate;
+  if (period) period_size = period;
+  if (periods) num_periods = periods;
+  if (quality >= 0) resample_quality = quality;
+#endif
 
-      printf("Tuner: %s (%s), %d\n",
-	     tuner.name, tuner.audmode&V4L2_TUNER_MODE_STEREO?"stereo":"mono",
-	     tuner.signal);
-      if (ioctl(fd, VIDIOC_QUERYCAP, &caps) != -1) {
-	printf("Capabilities: %X\n", caps.capabilities);
-      } else perror("ioctl VIDIOC_QUERYCAP");
+  if (rawRdsFile != NULL) {
+    return decodeRawRds(rawRdsFile)? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (replayFile != NULL) {
+    return replayRds(replayFile)? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  initProgramTable(&programs);
+  if (cacheFile != NULL) openProgramCache(&programs, cacheFile);
+  if (stationFile != NULL) loadStations(&programs, stationFile);
+  if (daemonTunerCount > 0) {
+    return runDaemon(daemonTuners, daemonTunerCount, &programs,
+                     stationFile, scan)?
+      EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
-      if (tuner.type == V4L2_TUNER_RADIO) {
-	int cpid;
+  if (openTuner(&tuner, device)) {
+#ifdef HAVE_AUDIO
+    int cpid;
+#endif
 
-	frequencyDivider = (tuner.capability & V4L2_TUNER_CAP_LOW)? 16000: 16;
-	minFrequency = ((float)tuner.rangelow)/frequencyDivider;
-	maxFrequency = ((float)tuner.rangehigh)/frequencyDivider;
-	
-	printf("Radio: %.1f <= %.1f <= %.1f\n",
-	       minFrequency, getTunerFrequency(fd), maxFrequency);
+    tuner.programs = &programs;
+    if (scan) {
+      Tuner *tuners[] = { &tuner };
+      const float freq = tuner.currentFrequency;
 
-	if (newFreq != 0) {
-	  setTunerFrequency(fd, &tuner, currentFrequency = newFreq);
-	} else {
-	  currentFrequency = getTunerFrequency(fd);
-	}
+      printf("%d stations found\n", scanBand(tuners, 1, &programs));
+      if (stationFile != NULL) saveStations(&programs, stationFile);
+      setTunerFrequency(&tuner, freq);
+    }
+    if (newFreq != 0) {
+      tuner.currentFrequency = newFreq;
+      setTunerFrequency(&tuner, newFreq);
+    }
 
-	if (seekUp) {
-	  float freq = seekTunerFrequency(fd, 0);
-	  if (freq >= minFrequency/2) {
-	    currentFrequency = freq;
-	    printf("Seek stopped at %.2f\n", freq);
-	  } else {
-	    printf("Seek failed\n");
-	  }
-	}
+    if (seekUp) {
+      float freq = seekTunerFrequency(&tuner, 0);
+      if (freq >= tuner.minFrequency/2) {
+	tuner.currentFrequency = freq;
+	printf("Seek stopped at %.2f\n", freq);
+      } else {
+	printf("Seek failed\n");
+      }
+    }
 
-	setTunerVolume(fd, 100);
+    setTunerVolume(&tuner, 100);
 
-	cpid = fork();
+#ifdef HAVE_AUDIO
+    cpid = fork();
 	      
-	if (cpid == 0) {
-	  char command[0XFF];
- 
-	  if (outFile != NULL) {
-	    snprintf(command, sizeof(command)/sizeof(*command),
-		     "arecord -q -D '%s' -r96000 -c2 -f S16_LE |"
-		     "oggenc -Q --resample 48000 -q 5 -o '%s' -",
-		     alsaDevice, outFile);
-	    execl("/bin/sh", "sh", "-c", command, (char *)0);
-	  } else {
-	    if (useJack) {
-#ifdef HAVE_JACK
-	      const char *jack_name = "si470x";
-
-	      if (setupSmoothing()) {
-		if ((pcmIn = openAudioIn(alsaDevice,
-					 inputSampleRate, num_channels,
-					 period_size, num_periods)) != NULL) {
-		  if ((jackClient = jack_client_open(jack_name, JackNullOption, NULL)) 
-		      != NULL) {
-		    jack_set_process_callback(jackClient, process, 0);
-		    jack_on_shutdown(jackClient, jack_shutdown, 0);
-		    jackSampleRate = jack_get_sample_rate(jackClient);
-
-		    static_resample_factor = (double)jackSampleRate
-		                           / (double)inputSampleRate;
-		    resample_mean = static_resample_factor;
-      
-		    jackBufferSize = jack_get_buffer_size(jackClient);
-		    if (!target_delay)
-		      target_delay = (num_periods*period_size / 2)
-			           + jackBufferSize/2;
-		    if (!max_diff)
-		      max_diff = num_periods*period_size - target_delay;	
-      
-                    if (verbose > 1)
-                      printf("target_delay=%d\nmax_diff=%d\n",
-                             target_delay, max_diff);
-		    alloc_ports(num_channels);
-
-		    if (jack_activate(jackClient) == 0) {
-		      signal(SIGTERM, sigterm_handler);
-		      signal(SIGINT, sigterm_handler);
-
-		      int i;
-		      const char **port = jack_get_ports(jackClient, NULL, NULL,
-							 JackPortIsInput);
-		      for (i = 0; i < num_channels && *port; i++) {
-			if (*port[0]) {
-			  jack_connect(jackClient,
-				       jack_port_name(jackPorts[i]),
-				       *port);
-			  port++;
-			}
-		      }
-		      while (!quit) {
-			usleep(250000);
-			if (verbose > 0 && output_new_delay > 0) {
-			  printf("delay = %d\n", output_new_delay);
-                          output_new_delay = 0;
-                        }
-                        if (verbose > 1)
-			  printf("srcfactor: %f, diff = %f, offset = %f, integral=%f\n",
-				 output_resampling_factor, output_diff,
-                                 output_offset, output_integral);
-		      }
-
-                      jack_deactivate(jackClient);
-		    } else {
-		      fprintf(stderr, "cannot activate JACK client\n");
-		    }
-		    jack_client_close(jackClient);
-		    src_delete(srcs[0]); src_delete(srcs[1]);
-		  } else {
-		    fprintf (stderr, "jack server not running?\n");
-		  }
-
-		  snd_pcm_close(pcmIn);
-		  exit(EXIT_SUCCESS);
-		}
-	      }
-
-	      exit(EXIT_FAILURE);
-#else
-	      printf("Jack support not compiled in\n");
+    if (cpid == 0) {
+      char command[0XFF];
+
+#ifndef HAVE_VORBIS
+      if (outFile != NULL && !useJack && streamSocket == NULL) {
+	snprintf(command, sizeof(command)/sizeof(*command),
+		 "arecord -q -D '%s' -r%u -c%d -f S16_LE |"
+		 "oggenc -Q --resample 48000 -q 5 -o '%s' -",
+		 alsaDevice, inputSampleRate, num_channels, outFile);
+	execl("/bin/sh", "sh", "-c", command, (char *)0);
+	perror("execl");
+	return 1;
+      }
 #endif
-	    } else {
-	      snprintf(command, sizeof(command)/sizeof(*command),
-		       "arecord -q -D '%s' -r96000 -c2 -f S16_LE |"
-		       "aplay -q -B -",
-		       alsaDevice);
-	      execl("/bin/sh", "sh", "-c", command, (char *)0);
-	    }
-	  }
-	  perror("execl");
-	  return 1;
-	} else {
-	  if (caps.capabilities & V4L2_CAP_RDS_CAPTURE) {
-	    decodeRds(fd, &tuner);
-	  } else {
-	    printf("Radio Data System not supported, "
-		   "try linux-2.6.32 or later\n");
-	    while (1) sleep(1);
-	  }
-	  //kill(-cpid, SIGTERM);
-	}
+      if (outFile != NULL || useJack || streamSocket != NULL
+#ifdef HAVE_OPUS
+	  || rtpDestination != NULL
+#endif
+	  )
+	exit(runAudio(alsaDevice, outFile, useJack, clockFile)?
+	     EXIT_SUCCESS : EXIT_FAILURE);
+
+      snprintf(command, sizeof(command)/sizeof(*command),
+	       "arecord -q -D '%s' -r%u -c%d -f S16_LE --period-size=%u |"
+	       "aplay -q -B %lu -",
+	       alsaDevice, inputSampleRate, num_channels, period_size,
+	       (unsigned long)period_size*num_periods*1000000/inputSampleRate);
+      execl("/bin/sh", "sh", "-c", command, (char *)0);
+      perror("execl");
+      return 1;
+    } else {
+      if (tuner.capabilities & V4L2_CAP_RDS_CAPTURE) {
+	decodeRds(&tuner);
       } else {
-	printf("%s is not a FM radio\n", device);
+	printf("Radio Data System not supported, "
+	       "try linux-2.6.32 or later\n");
+	while (1) sleep(1);
       }
-    } else {
-      perror("ioctl VIDIOC_G_TUNER");
+      //kill(-cpid, SIGTERM);
     }
+#else
+    /* Nothing to do without RDS when the audio is left to the device */
+    if (tuner.capabilities & V4L2_CAP_RDS_CAPTURE)
+      decodeRds(&tuner);
+    else
+      printf("Radio Data System not supported, "
+             "try linux-2.6.32 or later\n");
+#endif
 
-    close(fd);
-  } else {
-    switch (errno) {
-    case ENOENT:
-      printf("Device %s does not exist\n", device);
-      break;
-    default:
-      perror("open");
-    }
+    close(tuner.fd);
   }
 
   return 1;
 }
+#endif
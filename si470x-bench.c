@@ -0,0 +1,420 @@
+/* Benchmarks for the audio path of linux-si470x, see "make bench"
+ *
+ * The program source is included so that its static functions can be
+ * driven directly, without a JACK server or capture hardware.  The two
+ * JACK calls process() makes are redirected to the simulation below.
+ */
+
+#define SI470X_BENCH 1
+/* Most of the program is not driven here */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define jack_port_get_buffer benchPortBuffer
+#define jack_frames_since_cycle_start benchFramesSinceCycleStart
+#include "linux-si470x.c"
+
+/* Uniform noise in [-1, 1] */
+static double
+benchNoise() {
+  return 2.0 * rand() / (double)RAND_MAX - 1.0;
+}
+
+/* The quantized controller keeps resample_mean in a small limit cycle,
+ * so settling is judged against this tolerance and the resulting factor
+ * is the average over the second half of the run.
+ */
+#define SETTLE_PPM 20.0
+
+typedef struct {
+  double factor;       /* mean resample factor over the second half */
+  double settleTime;   /* until resample_mean stays within SETTLE_PPM */
+  double maxOffset;    /* largest delay offset after settling, frames */
+  double nsPerCycle;
+  int skips, rewinds;
+} SmoothingResult;
+
+/**
+ * Simulate the drift controller against an input clock which is off by
+ * drift ppm, with the delay seen by process() jittering by up to jitter
+ * frames.
+ */
+static SmoothingResult
+benchSmoothing(smoothing_t filter, int nframes, double outRate, double drift,
+               double jitter, double seconds) {
+  const double inRate = inputSampleRate;
+  const double inputFramesPerCycle = nframes * inRate * (1 + drift*1e-6)
+                                   / outRate;
+  const double trueFactor = nframes / inputFramesPerCycle;
+  const long cycles = seconds * outRate / nframes;
+  double delay, factorSum = 0;
+  uint64_t elapsed = 0;
+  SmoothingResult result = { 0 };
+
+  long low, high;
+
+  smoothing = filter;
+  jackBufferSize = nframes;
+  target_delay = max_diff = 0;
+  initControl(outRate / inRate);
+  setupTargetDelay(nframes);
+  controlLimits(2*num_periods*period_size, nframes, &low, &high);
+  srand(1);
+
+  delay = target_delay;
+  for (long cycle = 0; cycle < cycles; cycle++) {
+    double observed = delay + jitter * benchNoise();
+    double factor;
+    uint64_t start;
+
+    if (observed > high) {
+      delay -= observed - target_delay;
+      observed = target_delay;
+      result.skips += 1;
+      restartControl();
+    } else if (observed < low) {
+      delay += target_delay - observed;
+      observed = target_delay;
+      result.rewinds += 1;
+      restartControl();
+    }
+
+    start = monotonicTime();
+    factor = controlResampleFactor(observed - target_delay);
+    elapsed += monotonicTime() - start;
+
+    delay += inputFramesPerCycle - nframes / factor;
+    if (cycle >= cycles / 2) factorSum += factor;
+    if (fabs(resample_mean - trueFactor) / trueFactor > SETTLE_PPM*1e-6) {
+      result.settleTime = (cycle + 1) * nframes / outRate;
+      result.maxOffset = 0;
+    } else if (fabs(delay - target_delay) > result.maxOffset) {
+      result.maxOffset = fabs(delay - target_delay);
+    }
+  }
+  result.factor = factorSum / (cycles - cycles / 2);
+  result.nsPerCycle = (double)elapsed / cycles;
+
+  return result;
+}
+
+/* process() against a simulated capture device
+ *
+ * Time is simulated: the ALSA device completes a period every
+ * period_size input frames, at the drifting input clock, and the capture
+ * thread publishes it up to jitter input frames late.  process() runs
+ * once per JACK period, up to jitter output frames (at most half a
+ * period) after the cycle started.  The ring is filled with a sine once,
+ * so a delivery only publishes frames.  Only the time spent in process()
+ * itself is measured.
+ */
+
+static float *benchOutputs[MAX_CHANNELS];
+static jack_nframes_t benchCycleOffset;
+
+void *
+benchPortBuffer(jack_port_t *port, jack_nframes_t nframes) {
+  return port;
+}
+
+jack_nframes_t
+benchFramesSinceCycleStart(const jack_client_t *client) {
+  return benchCycleOffset;
+}
+
+typedef struct {
+  double p50, p99, max;   /* us per cycle */
+  double cpu;             /* ms of CPU per second of audio */
+  double factor;          /* mean resample factor over the second half */
+  double settleTime;      /* until resample_mean stays within SETTLE_PPM */
+  int skips, rewinds;
+} ProcessResult;
+
+static int
+compareTimes(const void *a, const void *b) {
+  const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y? -1 : x > y;
+}
+
+/* Set up what alloc_ports() and runAudio() would */
+static int
+setupBenchPipeline(int nframes) {
+  const size_t frameSize = formats[format].sample_size * num_channels;
+  const unsigned long bufferFrames = num_periods*period_size;
+  FrameRing *ring = &jackRing;
+
+  memset(&jackRing, 0, sizeof(jackRing));
+  if (!initFrameRing(ring, 2*bufferFrames, frameSize, bufferFrames))
+    return 0;
+  for (unsigned long i = 0; i < ring->size; i++) {
+    const double v = sin(2*M_PI * 1000 * i / inputSampleRate);
+    for (int c = 0; c < num_channels; c++) {
+      int32_t sample = v * (c? -0X40000000 : 0X40000000);
+      memcpy(ring->data + i*frameSize + c*formats[format].sample_size,
+             (char *)&sample + 4 - formats[format].sample_size,
+             formats[format].sample_size);
+    }
+  }
+
+  resampbufFrames = ceil(nframes / MIN_RESAMPLE_FACTOR) + 2;
+  resampbuf = malloc(resampbufFrames * MAX_CHANNELS * sizeof(*resampbuf));
+  resampout = malloc(nframes * num_channels * sizeof(*resampout));
+  for (int c = 0; c < num_channels; c++) {
+    benchOutputs[c] = malloc(nframes * sizeof(*benchOutputs[c]));
+    jackPorts[c] = (jack_port_t *)benchOutputs[c];
+    srcs[c] = interleaved_resampling? NULL
+            : src_new(4-resample_quality, 1, NULL);
+  }
+  if (interleaved_resampling)
+    srcs[0] = src_new(4-resample_quality, num_channels, NULL);
+  return resampbuf != NULL && resampout != NULL && srcs[0] != NULL;
+}
+
+static void
+freeBenchPipeline() {
+  freeFrameRing(&jackRing);
+  free(resampbuf);
+  free(resampout);
+  for (int c = 0; c < MAX_CHANNELS; c++) {
+    if (srcs[c] != NULL) src_delete(srcs[c]);
+    srcs[c] = NULL;
+    free(benchOutputs[c]);
+    benchOutputs[c] = NULL;
+  }
+}
+
+static ProcessResult
+benchProcess(int nframes, double outRate, double drift, double jitter,
+             double seconds) {
+  const double inRate = inputSampleRate * (1 + drift*1e-6);
+  const double trueFactor = outRate / inRate;
+  const long cycles = seconds * outRate / nframes;
+  FrameRing *ring = &jackRing;
+  uint32_t *times = malloc(cycles * sizeof(*times));
+  ProcessResult result = { 0 };
+  double factorSum = 0, lastWrite = 0, delivery;
+  unsigned long periods = 0;
+  uint64_t elapsed = 0;
+
+  if (times == NULL || !setupBenchPipeline(nframes)) {
+    fprintf(stderr, "no memory for process() benchmark\n");
+    exit(EXIT_FAILURE);
+  }
+  jackBufferSize = nframes;
+  target_delay = max_diff = 0;
+  initControl(outRate / inputSampleRate);
+  setupTargetDelay(nframes);
+  srand(1);
+  /* Capture has been running for a while when JACK starts the client */
+  frameRingWritten(ring, target_delay);
+  delivery = period_size / inRate + jitter * (benchNoise() + 1) / 2 / inRate;
+
+  for (long cycle = 0; cycle < cycles; cycle++) {
+    const double offset = (jitter < nframes/2? jitter : nframes/2)
+                        * (benchNoise() + 1) / 2;
+    const double now = (cycle * nframes + offset) / outRate;
+    TelemetryRecord record;
+    uint64_t start;
+
+    while (delivery <= now) {
+      unsigned long left = period_size, space;
+
+      /* Free space ends at the end of the ring, frames which do not fit
+       * are lost like in captureThread()
+       */
+      while (left > 0 && (frameRingWriteSpace(ring, &space), space > 0)) {
+        if (space > left) space = left;
+        frameRingWritten(ring, space);
+        left -= space;
+      }
+      lastWrite = delivery;
+      periods += 1;
+      delivery = (periods + 1) * period_size / inRate
+               + jitter * (benchNoise() + 1) / 2 / inRate;
+    }
+    benchCycleOffset = offset;
+    ring->writeTime = monotonicTime() - (uint64_t)((now - lastWrite) * 1e9);
+
+    start = monotonicTime();
+    process(nframes, NULL);
+    times[cycle] = monotonicTime() - start;
+    elapsed += times[cycle];
+
+    /* Read back the record process() published, like runTelemetry() */
+    if (!popTelemetry(&record)) {
+      fprintf(stderr, "process() published no telemetry\n");
+      exit(EXIT_FAILURE);
+    }
+    if (record.event == CYCLE_SKIP) result.skips += 1;
+    if (record.event == CYCLE_REWIND) result.rewinds += 1;
+    if (cycle >= cycles / 2) factorSum += record.factor;
+    if (fabs(resample_mean - trueFactor) / trueFactor > SETTLE_PPM*1e-6)
+      result.settleTime = (cycle + 1) * nframes / outRate;
+  }
+
+  qsort(times, cycles, sizeof(*times), compareTimes);
+  result.p50 = times[cycles / 2] / 1e3;
+  result.p99 = times[cycles * 99 / 100] / 1e3;
+  result.max = times[cycles - 1] / 1e3;
+  result.cpu = elapsed / 1e6 / seconds;
+  result.factor = factorSum / (cycles - cycles / 2);
+  free(times);
+  freeBenchPipeline();
+
+  return result;
+}
+
+int
+main(int argc, char *argv[]) {
+  int option, nframes = 64, outRate = 48000, runController = 1, runProcess = 1;
+  int minQuality = 0, maxQuality = 4;
+  double drift = 50, jitter = 32, seconds = 600, processSeconds = 60;
+
+  while ((option = getopt(argc, argv, "ab:c:C:d:i:j:k:K:l:L:mo:p:P:q:t:T:")) != -1) {
+    switch (option) {
+    case 'a':
+      adaptive_control = 1;
+      break;
+    case 'b':
+      runController = strcmp(optarg, "process") != 0;
+      runProcess = strcmp(optarg, "controller") != 0;
+      break;
+    case 'c':
+      catch_factor = atoi(optarg);
+      break;
+    case 'C':
+      catch_factor2 = atoi(optarg);
+      break;
+    case 'd':
+      drift = strtod(optarg, NULL);
+      break;
+    case 'i':
+      inputSampleRate = atoi(optarg);
+      break;
+    case 'j':
+      jitter = strtod(optarg, NULL);
+      break;
+    case 'k':
+      pclamp = strtod(optarg, NULL);
+      break;
+    case 'K':
+      clock_ratio = 1 + strtod(optarg, NULL) * 1e-6;
+      break;
+    case 'l':
+      for (smoothing = 0; smoothing < sizeof(smoothingNames)/sizeof(*smoothingNames); smoothing++) {
+        if (strcmp(optarg, smoothingNames[smoothing]) == 0) break;
+      }
+      if (smoothing == sizeof(smoothingNames)/sizeof(*smoothingNames)) {
+        fprintf(stderr, "Unknown smoothing filter %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'L':
+      if ((latencyProfile = findLatencyProfile(optarg)) == NULL) {
+        fprintf(stderr, "Unknown latency profile %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'm':
+      interleaved_resampling = 1;
+      break;
+    case 'o':
+      outRate = atoi(optarg);
+      break;
+    case 'p':
+      nframes = atoi(optarg);
+      break;
+    case 'P':
+      period_size = atoi(optarg);
+      break;
+    case 'q':
+      if (sscanf(optarg, "%d-%d", &minQuality, &maxQuality) == 1)
+        maxQuality = minQuality;
+      if (minQuality < 0 || maxQuality > 4 || minQuality > maxQuality) {
+        fprintf(stderr, "Resample quality must be 0 to 4\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      seconds = strtod(optarg, NULL);
+      break;
+    case 'T':
+      processSeconds = strtod(optarg, NULL);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-b controller|process] [-p PERIOD] [-d PPM] "
+                      "[-j FRAMES] [-t SECONDS]\n"
+                      "          [-i RATE] [-o RATE] [-P PERIOD] [-q QUALITY[-QUALITY]] "
+                      "[-m] [-l FILTER] [-L PROFILE] [-T SECONDS]\n"
+                      "          [-a] [-K PPM] [-c CATCH] [-C CATCH2] [-k PCLAMP]\n"
+                      "\n"
+                      "Options\n"
+                      "\t-b SUITE\tOnly run the controller or process() benchmark\n"
+                      "\t-p PERIOD\tJACK period size (default 64)\n"
+                      "\t-d PPM\t\tInput clock drift (default 50)\n"
+                      "\t-j FRAMES\tDelay jitter (default 32)\n"
+                      "\t-t SECONDS\tSimulated time of the controller (default 600)\n"
+                      "\t-i RATE\t\tInput sample rate (default 96000)\n"
+                      "\t-o RATE\t\tJACK sample rate (default 48000)\n"
+                      "\t-P PERIOD\tALSA period size (default 2048)\n"
+                      "\t-q QUALITY\tResample qualities to run (default 0-4)\n"
+                      "\t-m\t\tResample all channels in one pass\n"
+                      "\t-l FILTER\tDelay smoothing for process() (default hann)\n"
+                      "\t-L PROFILE\tLatency profile whose target delay is used\n"
+                      "\t-T SECONDS\tSimulated time of process() (default 60)\n"
+                      "\t-a\t\tUse the adaptive controller\n"
+                      "\t-K PPM\t\tSaved capture clock the controller starts from\n"
+                      "\t-c CATCH\tcatch_factor (default 100000)\n"
+                      "\t-C CATCH2\tcatch_factor2 (default 10000)\n"
+                      "\t-k PCLAMP\tpclamp (default 15)\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!setupSmoothing()) exit(EXIT_FAILURE);
+  setupConverters();
+
+  if (runController) {
+    const smoothing_t selected = smoothing;
+
+    printf("%s drift controller, period %d, drift %.1fppm, jitter %.0f frames, "
+           "%.0fs\n", adaptive_control? "Adaptive" : "Fixed", nframes, drift,
+           jitter, seconds);
+    printf("filter  mean factor        error   settle  max offset  "
+           "skips rewinds  ns/cycle\n");
+    for (int i = 0; i < sizeof(smoothingNames)/sizeof(*smoothingNames); i++) {
+      const double trueFactor = outRate / (inputSampleRate * (1 + drift*1e-6));
+      SmoothingResult r;
+
+      r = benchSmoothing(i, nframes, outRate, drift, jitter, seconds);
+      printf("%-6s  %.10f  %+6.2fppm  %6.1fs  %10.0f  %5d %7d  %8.1f\n",
+             smoothingNames[i], r.factor,
+             (r.factor - trueFactor) / trueFactor * 1e6, r.settleTime,
+             r.maxOffset, r.skips, r.rewinds, r.nsPerCycle);
+    }
+    smoothing = selected;
+    if (runProcess) printf("\n");
+  }
+
+  if (runProcess) {
+    const double trueFactor = outRate / (inputSampleRate * (1 + drift*1e-6));
+
+    printf("process(), %d -> %d Hz, period %d/%u, drift %.1fppm, "
+           "jitter %.0f frames, %s%s, %.0fs\n", inputSampleRate, outRate,
+           nframes, period_size, drift, jitter, smoothingNames[smoothing],
+           interleaved_resampling? ", interleaved" : "", processSeconds);
+    printf("quality  p50 us  p99 us  max us  CPU ms/s       error   settle  "
+           "skips rewinds\n");
+    for (int q = minQuality; q <= maxQuality; q++) {
+      ProcessResult r;
+
+      resample_quality = q;
+      r = benchProcess(nframes, outRate, drift, jitter, processSeconds);
+      printf("%7d  %6.1f  %6.1f  %6.1f  %8.2f  %+6.2fppm  %6.1fs  %5d %7d\n",
+             q, r.p50, r.p99, r.max, r.cpu,
+             (r.factor - trueFactor) / trueFactor * 1e6, r.settleTime,
+             r.skips, r.rewinds);
+    }
+  }
+
+  return 0;
+}